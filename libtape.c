@@ -0,0 +1,4246 @@
+/* libtape.c — the Turing machine of tape.c, as a library. Every function here works on the struct
+ * machine it is given, so a program can hold as many machines as it likes, run them on separate
+ * threads and reuse them from one run to the next. Errors are returned, with a message kept in the
+ * machine, rather than printed. The interface is in libtape.h, and the machine itself is described at
+ * the top of tape.c.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "libtape.h"
+
+#define JOIN_CHUNK 65536
+#define MAP_CHUNK (64L << 20)
+#define BIN_HEADER_SIZE 40
+#define BIN_VERSION 1
+#define MACRO_EXIT 0
+#define MACRO_HALT 1
+#define MACRO_LOOP 2
+#define TRACE_HEADER_SIZE 24
+#define TRACE_VERSION 1
+#define TRACE_RECORDS 65536
+#define TIME_CHECK_STEPS (1L << 20)
+#define CKPT_HEADER_SIZE 64
+#define CKPT_VERSION 2
+#define CKPT_CHANGED 0x80000000u
+#define TMB_HEADER_SIZE 48
+#define TMB_VERSION 1
+#define TABLE_LINE_SHOWN 80
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Read or write the cell at index i of a block packed bits to a cell
+static inline unsigned get_cell(uint64_t *block, long i, const int bits){
+	long b = i * bits;
+	return (block[b / WORD_BITS] >> (b % WORD_BITS)) & ((1u << bits) - 1);
+}
+
+static inline void set_cell(uint64_t *block, long i, unsigned val, const int bits){
+	long b = i * bits;
+	uint64_t mask = (((uint64_t) 1 << bits) - 1) << (b % WORD_BITS);
+	block[b / WORD_BITS] = (block[b / WORD_BITS] & ~mask) | ((uint64_t) val << (b % WORD_BITS));
+}
+
+// Symbols are written on the tape and in the table as the hex digits 0-9 and a-f. cell_value()
+// gives the symbol for a character, or -1 if it isn't one.
+static const char cell_chars[] = "0123456789abcdef";
+
+static inline int cell_value(char c){
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// Write or read a little-endian field of the given number of bytes, for the binary file formats
+static void put_le(unsigned char *p, uint64_t val, int bytes){
+	for (int i=0; i<bytes; i++)
+		p[i] = val >> (8*i);
+}
+
+static uint64_t get_le(unsigned char *p, int bytes){
+	uint64_t val = 0;
+	for (int i=0; i<bytes; i++)
+		val |= (uint64_t) p[i] << (8*i);
+	return val;
+}
+
+/* The tape is scanned in bulk by the kernels below: to find where the marks on an ASCII tape begin
+ * and end when it is stripped, to check and pack the cells of a binary tape as they are read, and
+ * to count the marks left on it. They take a vector at a time with AVX2 or SSE2 on x86-64, or NEON
+ * on 64-bit ARM, whichever the compiler targets, and a byte or a word at a time for whatever is
+ * left over, or on anything else.
+ */
+
+// The index of the first byte of p that isn't c, or n if there is none
+static long scan_past(const char *p, long n, char c){
+	long i = 0;
+#if defined(__AVX2__)
+	__m256i v = _mm256_set1_epi8(c);
+	for (; i + 32 <= n; i += 32){
+		unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i)), v));
+		if (same != 0xffffffffu)
+			return i + __builtin_ctz(~same);
+	}
+#elif defined(__SSE2__)
+	__m128i v = _mm_set1_epi8(c);
+	for (; i + 16 <= n; i += 16){
+		unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), v));
+		if (same != 0xffff)
+			return i + __builtin_ctz(~same);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t v = vdupq_n_u8(c);
+	for (; i + 16 <= n && !vmaxvq_u8(vmvnq_u8(vceqq_u8(vld1q_u8((const uint8_t *) (p + i)), v))); i += 16)
+		;
+#endif
+	for (; i < n; i++){
+		if (p[i] != c)
+			return i;
+	}
+	return n;
+}
+
+// One past the last byte of p that isn't c, or 0 if there is none
+static long scan_back(const char *p, long n, char c){
+	long i = n;
+#if defined(__AVX2__)
+	__m256i v = _mm256_set1_epi8(c);
+	for (; i >= 32; i -= 32){
+		unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i - 32)), v));
+		if (same != 0xffffffffu)
+			return i - __builtin_clz(~same);
+	}
+#elif defined(__SSE2__)
+	__m128i v = _mm_set1_epi8(c);
+	for (; i >= 16; i -= 16){
+		unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i - 16)), v));
+		if (same != 0xffff)
+			return i + 16 - __builtin_clz(~same & 0xffff);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t v = vdupq_n_u8(c);
+	for (; i >= 16 && !vmaxvq_u8(vmvnq_u8(vceqq_u8(vld1q_u8((const uint8_t *) (p + i - 16)), v))); i -= 16)
+		;
+#endif
+	for (; i > 0; i--){
+		if (p[i-1] != c)
+			return i;
+	}
+	return 0;
+}
+
+// The number of bytes of p that aren't c. The vector loops count the bytes that are c in a lane of
+// their own for up to 255 vectors at a time, before they could overflow, and then sum the lanes.
+static long count_other(const char *p, long n, char c){
+	long same = 0;
+	long i = 0;
+#if defined(__AVX2__)
+	__m256i v = _mm256_set1_epi8(c);
+	while (i + 32 <= n){
+		__m256i counts = _mm256_setzero_si256();
+		for (int k=0; k<255 && i + 32 <= n; k++, i += 32)
+			counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i)), v));
+		uint64_t sums[4];
+		_mm256_storeu_si256((__m256i *) sums, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+		same += sums[0] + sums[1] + sums[2] + sums[3];
+	}
+#elif defined(__SSE2__)
+	__m128i v = _mm_set1_epi8(c);
+	while (i + 16 <= n){
+		__m128i counts = _mm_setzero_si128();
+		for (int k=0; k<255 && i + 16 <= n; k++, i += 16)
+			counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), v));
+		uint64_t sums[2];
+		_mm_storeu_si128((__m128i *) sums, _mm_sad_epu8(counts, _mm_setzero_si128()));
+		same += sums[0] + sums[1];
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t v = vdupq_n_u8(c);
+	while (i + 16 <= n){
+		uint8x16_t counts = vdupq_n_u8(0);
+		for (int k=0; k<255 && i + 16 <= n; k++, i += 16)
+			counts = vsubq_u8(counts, vceqq_u8(vld1q_u8((const uint8_t *) (p + i)), v));
+		same += vaddlvq_u8(counts);
+	}
+#endif
+	for (; i < n; i++)
+		same += p[i] == c;
+	return n - same;
+}
+
+// Pack n cells of an ASCII binary tape from p into block, a bit to a cell, returning 1 if any of
+// them is neither 0 nor 1. Whole words are written outright, and the cells of a last, partial word
+// are added to what is there, which should be blank. A character is 0 or 1 if it is '0' once its
+// lowest bit is cleared, and the character '1' is the bit 1.
+static int pack_binary(const char *p, long n, uint64_t *block){
+	long i = 0;
+#if defined(__AVX2__)
+	__m256i low = _mm256_set1_epi8(~1);
+	__m256i zero = _mm256_set1_epi8('0');
+	__m256i one = _mm256_set1_epi8('1');
+	for (; i + 64 <= n; i += 64){
+		__m256i a = _mm256_loadu_si256((const __m256i *) (p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+		unsigned valid = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(a, low), zero))
+			& _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(b, low), zero));
+		if (valid != 0xffffffffu)
+			return 1;
+		block[i / WORD_BITS] = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, one))
+			| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, one)) << 32;
+	}
+#elif defined(__SSE2__)
+	__m128i low = _mm_set1_epi8(~1);
+	__m128i zero = _mm_set1_epi8('0');
+	__m128i one = _mm_set1_epi8('1');
+	for (; i + 64 <= n; i += 64){
+		uint64_t bits = 0;
+		for (int k=0; k<4; k++){
+			__m128i a = _mm_loadu_si128((const __m128i *) (p + i + 16*k));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, low), zero)) != 0xffff)
+				return 1;
+			bits |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, one)) << (16*k);
+		}
+		block[i / WORD_BITS] = bits;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	// NEON has no movemask, so each byte is weighted by its place among the eight it will be
+	// packed with, and the weights added up pairwise into bytes
+	static const uint8_t places[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t weights = vld1q_u8(places);
+	uint8x16_t low = vdupq_n_u8((uint8_t) ~1);
+	uint8x16_t zero = vdupq_n_u8('0');
+	uint8x16_t one = vdupq_n_u8('1');
+	for (; i + 64 <= n; i += 64){
+		uint8x16_t set[4];
+		for (int k=0; k<4; k++){
+			uint8x16_t a = vld1q_u8((const uint8_t *) (p + i + 16*k));
+			if (vminvq_u8(vceqq_u8(vandq_u8(a, low), zero)) != 0xff)
+				return 1;
+			set[k] = vandq_u8(vceqq_u8(a, one), weights);
+		}
+		uint8x16_t sums = vpaddq_u8(vpaddq_u8(set[0], set[1]), vpaddq_u8(set[2], set[3]));
+		block[i / WORD_BITS] = vgetq_lane_u64(vreinterpretq_u64_u8(vpaddq_u8(sums, sums)), 0);
+	}
+#endif
+	for (; i < n; i++){
+		if ((p[i] & ~1) != '0')
+			return 1;
+		block[i / WORD_BITS] |= (uint64_t) (p[i] == '1') << (i % WORD_BITS);
+	}
+	return 0;
+}
+
+// Count the cells that aren't blank among n words packed bits to a cell, by folding each cell's
+// bits down onto its lowest one and counting the bits that are set. The vector loops count the
+// bits of each byte, with a table of the counts for each nibble where there is a shuffle to look
+// them up, and sum the bytes of each word.
+static long count_marks(uint64_t *words, long n, int bits){
+	uint64_t fold = bits == 4 ? 0x1111111111111111 : bits == 2 ? 0x5555555555555555 : ~(uint64_t) 0;
+	long marks = 0;
+	long w = 0;
+#if defined(__AVX2__)
+	__m256i nibbles = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	__m256i low = _mm256_set1_epi8(0x0f);
+	__m256i mask = _mm256_set1_epi64x(fold);
+	__m256i total = _mm256_setzero_si256();
+	for (; w + 4 <= n; w += 4){
+		__m256i x = _mm256_loadu_si256((const __m256i *) (words + w));
+		if (bits == 4)
+			x = _mm256_or_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 1)), _mm256_or_si256(_mm256_srli_epi64(x, 2), _mm256_srli_epi64(x, 3)));
+		else if (bits == 2)
+			x = _mm256_or_si256(x, _mm256_srli_epi64(x, 1));
+		x = _mm256_and_si256(x, mask);
+		__m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibbles, _mm256_and_si256(x, low)),
+			_mm256_shuffle_epi8(nibbles, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+	uint64_t sums[4];
+	_mm256_storeu_si256((__m256i *) sums, total);
+	marks = sums[0] + sums[1] + sums[2] + sums[3];
+#elif defined(__SSE2__)
+	// Without a shuffle, the bits of each byte are added up in pairs, then fours, then the byte
+	__m128i m1 = _mm_set1_epi8(0x55);
+	__m128i m2 = _mm_set1_epi8(0x33);
+	__m128i m4 = _mm_set1_epi8(0x0f);
+	__m128i mask = _mm_set1_epi64x(fold);
+	__m128i total = _mm_setzero_si128();
+	for (; w + 2 <= n; w += 2){
+		__m128i x = _mm_loadu_si128((const __m128i *) (words + w));
+		if (bits == 4)
+			x = _mm_or_si128(_mm_or_si128(x, _mm_srli_epi64(x, 1)), _mm_or_si128(_mm_srli_epi64(x, 2), _mm_srli_epi64(x, 3)));
+		else if (bits == 2)
+			x = _mm_or_si128(x, _mm_srli_epi64(x, 1));
+		x = _mm_and_si128(x, mask);
+		x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+		x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+		x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+		total = _mm_add_epi64(total, _mm_sad_epu8(x, _mm_setzero_si128()));
+	}
+	uint64_t sums[2];
+	_mm_storeu_si128((__m128i *) sums, total);
+	marks = sums[0] + sums[1];
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint64x2_t mask = vdupq_n_u64(fold);
+	for (; w + 2 <= n; w += 2){
+		uint64x2_t x = vld1q_u64(words + w);
+		if (bits == 4)
+			x = vorrq_u64(vorrq_u64(x, vshrq_n_u64(x, 1)), vorrq_u64(vshrq_n_u64(x, 2), vshrq_n_u64(x, 3)));
+		else if (bits == 2)
+			x = vorrq_u64(x, vshrq_n_u64(x, 1));
+		marks += vaddvq_u8(vcntq_u8(vreinterpretq_u8_u64(vandq_u64(x, mask))));
+	}
+#endif
+	for (; w<n; w++){
+		uint64_t x = words[w];
+		if (bits == 4)
+			x = x | x >> 1 | x >> 2 | x >> 3;
+		else if (bits == 2)
+			x = x | x >> 1;
+		marks += __builtin_popcountll(x & fold);
+	}
+	return marks;
+}
+
+// Print a formatted string to the log, i.e. either to stdout or do nothing
+// The machine's log_stream is the stream that we print to, by default stdout or a file if specified with -o;
+// But the user can also suppress the log altogether with -s. Since we can't fprint to NULL, we
+// need to first check log_stream isn't null and go ahead only if it isn't.
+static void logprint(struct machine *m, char *fmt, ...){
+	if (m->log_stream){
+		va_list args;
+		va_start(args, fmt);
+		vfprintf(m->log_stream, fmt, args);
+		va_end(args);
+	}
+}
+
+// Keep an error message in the machine, for tm_error() to give back
+static void set_error(struct machine *m, char *fmt, ...){
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(m->error, sizeof(m->error), fmt, args);
+	va_end(args);
+}
+
+// Return a char * detailing the given instruction
+static void print_instruc(struct machine *m, int instate, int indigit){
+	struct op curr_op = m->instructions[instate * m->symbols + indigit];
+
+	if (m->log_stream)
+		fprintf(m->log_stream, "%d,%x->%d,%x,%c%s", instate, indigit, curr_op.state, curr_op.val, (curr_op.dir ? 'R' : 'L'), (curr_op.stop ? "STOP" : ""));
+}
+
+/* A text table is read in a single pass over the whole file, mapped into memory, or read into it
+ * in one go where it can't be mapped, as from a pipe, and parsed where it lies. It begins with a
+ * "STATES: [N]" line, which may be followed by "SYMBOLS: [K]", and then has an instruction to a
+ * line, of the form
+ *   STATE,SYMBOL->NEW STATE,NEW SYMBOL,R|L[STOP]
+ * with blanks allowed between the parts. Blank lines, and anything from a # to the end of a line,
+ * are skipped, and anything after the first STATES × SYMBOLS instructions is ignored with a
+ * warning. Instructions left out just move right. An error is given as the file, line and column
+ * it was found at, followed by the line itself with the column marked, if it is no longer than
+ * TABLE_LINE_SHOWN.
+ */
+struct scanner{
+	char *fname;
+	char *p;
+	char *end;
+	char *line;			// The start of the line p is on
+	long line_no;
+};
+
+// Skip any spaces and tabs at p
+static void scan_blanks(struct scanner *s){
+	while (s->p < s->end && (*s->p == ' ' || *s->p == '\t'))
+		s->p++;
+}
+
+// Whether nothing but blanks and a comment is left of the line, skipping the blanks
+static bool scan_line_end(struct scanner *s){
+	scan_blanks(s);
+	return s->p == s->end || *s->p == '\n' || *s->p == '\r' || *s->p == '#';
+}
+
+static void scan_next_line(struct scanner *s){
+	char *nl = memchr(s->p, '\n', s->end - s->p);
+	s->p = nl ? nl + 1 : s->end;
+	s->line = s->p;
+	s->line_no++;
+}
+
+// Move on to the next line with something on it but blanks and a comment, returning false if there
+// is none
+static bool scan_skip_empty(struct scanner *s){
+	while (s->p < s->end){
+		if (!scan_line_end(s))
+			return true;
+		scan_next_line(s);
+	}
+	return false;
+}
+
+// Give an error at p, returning 1
+static int scan_error(struct machine *m, struct scanner *s, char *fmt, ...){
+	char msg[160];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	char *eol = memchr(s->line, '\n', s->end - s->line);
+	long len = (eol ? eol : s->end) - s->line;
+	if (len > 0 && s->line[len-1] == '\r')
+		len--;
+	long col = s->p - s->line;
+
+	// The line is left out if it would be cut short
+	long room = sizeof(m->error) - strlen(s->fname) - strlen(msg) - 48;
+	if (len == 0 || len > TABLE_LINE_SHOWN || col > len || 2 * len > room){
+		set_error(m, "%s:%ld:%ld: %s", s->fname, s->line_no, col + 1, msg);
+	} else{
+		// The mark keeps any tabs before the column, so as to line up under it
+		char mark[TABLE_LINE_SHOWN + 1];
+		for (long i=0; i<col; i++)
+			mark[i] = s->line[i] == '\t' ? '\t' : ' ';
+		mark[col] = '\0';
+		set_error(m, "%s:%ld:%ld: %s\n%.*s\n%s^", s->fname, s->line_no, col + 1, msg, (int) len, s->line, mark);
+	}
+	return 1;
+}
+
+// Read the decimal number at *p, moving *p past it, or give -1 if there isn't one. Anything too big
+// to be a number of states is given as MAX_STATES + 1.
+static long parse_number(char **p, char *end){
+	if (*p == end || !isdigit((unsigned char) **p))
+		return -1;
+
+	long n = 0;
+	for (; *p < end && isdigit((unsigned char) **p); (*p)++)
+		n = n <= MAX_STATES ? n*10 + **p - '0' : n;
+	return n <= MAX_STATES ? n : MAX_STATES + 1;
+}
+
+// Read a state at p, giving an error for none or one out of range, and returning -1 for either
+static long parse_state(struct machine *m, struct scanner *s, char *what){
+	char *at = s->p;
+	long state = parse_number(&s->p, s->end);
+	if (state < 0){
+		scan_error(m, s, "Expected the %s, a number.", what);
+		return -1;
+	}
+	if (state >= m->max_states){
+		int digits = s->p - at;
+		s->p = at;
+		scan_error(m, s, "The %s %.*s%s is out of range, as STATES gives %d, counting from 0.", what, digits > 12 ? 12 : digits,
+			at, digits > 12 ? "..." : "", m->max_states);
+		return -1;
+	}
+	scan_blanks(s);
+	return state;
+}
+
+// Read a symbol at p, giving an error for one that isn't of the table's alphabet, and returning -1
+static int parse_symbol(struct machine *m, struct scanner *s, char *what){
+	int val = s->p < s->end ? cell_value(*s->p) : -1;
+	if (val < 0 || val >= m->symbols){
+		scan_error(m, s, "%s must be one of the table's symbols, 0 %s %c.", what, m->symbols == 2 ? "or" : "to", cell_chars[m->symbols - 1]);
+		return -1;
+	}
+	s->p++;
+	scan_blanks(s);
+	return val;
+}
+
+// Read the comma that should follow what, returning 1 for none
+static int parse_comma(struct machine *m, struct scanner *s, char *what){
+	if (s->p == s->end || *s->p != ',')
+		return scan_error(m, s, "%s must be followed by a comma.", what);
+	s->p++;
+	scan_blanks(s);
+	return 0;
+}
+
+// Parse the instruction on the line at p and add it to the table, returning 1 on error
+static int parse_instruc(struct machine *m, struct scanner *s){
+	// The state and symbol it is the instruction for, separated by a comma, and then ->
+	long instate = parse_state(m, s, "input state");
+	if (instate < 0 || parse_comma(m, s, "Input state"))
+		return 1;
+	int indigit = parse_symbol(m, s, "Input symbol");
+	if (indigit < 0)
+		return 1;
+	if (s->end - s->p < 2 || s->p[0] != '-' || s->p[1] != '>')
+		return scan_error(m, s, "Input symbol must be followed by ->.");
+	s->p += 2;
+	scan_blanks(s);
+
+	// Now the operation, which takes the form state,symbol,direction(STOP)
+	struct op curr_op;
+	long state = parse_state(m, s, "new state");
+	if (state < 0 || parse_comma(m, s, "New state"))
+		return 1;
+	curr_op.state = state;
+	int val = parse_symbol(m, s, "Symbol to write");
+	if (val < 0 || parse_comma(m, s, "Symbol to write"))
+		return 1;
+	curr_op.val = val;
+
+	// Then either R or L, and perhaps STOP
+	if (s->p == s->end || (*s->p != 'L' && *s->p != 'R'))
+		return scan_error(m, s, "Direction must be either R or L.");
+	curr_op.dir = *s->p++ == 'R';
+	scan_blanks(s);
+	curr_op.stop = s->end - s->p >= 4 && memcmp(s->p, "STOP", 4) == 0;
+	if (curr_op.stop)
+		s->p += 4;
+	if (!scan_line_end(s))
+		return scan_error(m, s, curr_op.stop ? "Nothing but a comment may follow STOP." : "Direction must be followed either by end of line or by STOP.");
+
+	// Then store the instruction in instructions
+	m->instructions[instate * m->symbols + indigit] = curr_op;
+	logprint(m, "Loading operation %d, %x, %c %sto state %ld and bit %x.\n", curr_op.state, curr_op.val, (curr_op.dir ? 'R' : 'L'), (curr_op.stop ? ", STOP " : " "), instate, indigit);
+
+	return 0;
+}
+
+// Read the number after a header such as "STATES:" on the line at p, giving -1, and leaving p where
+// it was, if the line isn't that header, and 0 if the number isn't a positive one alone on the line
+static long parse_header(struct scanner *s, char *name){
+	long len = strlen(name);
+	if (s->end - s->p < len || memcmp(s->p, name, len) != 0)
+		return -1;
+
+	s->p += len;
+	scan_blanks(s);
+	long n = parse_number(&s->p, s->end);
+	return n > 0 && scan_line_end(s) ? n : 0;
+}
+
+// Pack the tape as tightly as an alphabet of the given size allows: 1 bit to a cell for two symbols,
+// 2 for up to four, and 4 for up to sixteen. Blocks of a different width can't reuse the tape
+// storage of an earlier run, so that is let go.
+static void set_symbols(struct machine *m, int symbols){
+	int bits = symbols <= 2 ? 1 : symbols <= 4 ? 2 : 4;
+
+	if (bits != m->cell_bits){
+		free(m->mem_tape.right);
+		free(m->mem_tape.left);
+		free(m->cache.slots);
+		free(m->cache.bits);
+		free(m->cache.hash);
+		free(m->cache.scratch);
+		free(m->map_buffer);
+		free(m->sparse_tape.bits);
+		free(m->sparse_tape.blank);
+		m->mem_tape.right = m->mem_tape.left = m->cache.bits = m->map_buffer = NULL;
+		m->sparse_tape.bits = m->sparse_tape.blank = NULL;
+		m->mem_tape.right_cap = m->mem_tape.left_cap = m->sparse_tape.cap = 0;
+		m->cache.slots = NULL;
+		m->cache.hash = NULL;
+		m->cache.scratch = NULL;
+	}
+
+	m->symbols = symbols;
+	m->cell_bits = bits;
+	m->buffer_words = m->buffer_size * bits / WORD_BITS;
+}
+
+/* A text table is compiled the first time it is loaded to a .tmb file beside it, which later loads
+ * map and use as the instruction table as it is, so long as the text hasn't changed since. The
+ * file is a header of TMB_HEADER_SIZE bytes, all little-endian:
+ *   0  "TTMB"
+ *   4  u32 version, TMB_VERSION
+ *   8  u32 number of states
+ *  12  u32 number of symbols
+ *  16  i64 size of the text table it was compiled from
+ *  24  i64 modification time of the text table, seconds
+ *  32  u32 and nanoseconds
+ *  36  u32 reserved, 0
+ *  40  u64 FNV-1a checksum of the operations
+ * followed by the operations in the order of the table in memory, each a u32 of the new state in
+ * the low 24 bits, the symbol to write in the next 4, then the direction and STOP. Every operation
+ * is checked as the file is loaded, so a table that loads can be run without further checks.
+ */
+
+static uint32_t tmb_word(struct op o){
+	return o.state | (uint32_t) o.val << 24 | (uint32_t) o.dir << 28 | (uint32_t) o.stop << 29;
+}
+
+// Whether struct op is laid out in memory as an operation is in the file, so that a mapped file can
+// serve as the table without being copied
+static bool tmb_native(){
+	struct op o;
+	unsigned char bytes[sizeof(o)];
+
+	memset(&o, 0, sizeof(o));
+	o.state = 0x123456;
+	o.val = 0xa;
+	o.dir = 1;
+	memcpy(bytes, &o, sizeof(o));
+	return sizeof(o) == 4 && get_le(bytes, 4) == tmb_word(o);
+}
+
+// Check the n operations of a file are all in range, and give the right checksum
+static bool tmb_valid(unsigned char *ops, long n, unsigned long states, unsigned long symbols, uint64_t sum){
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for (long i=0; i<4*n; i++)
+		hash = (hash ^ ops[i]) * 0x100000001b3ull;
+	for (long i=0; i<n; i++){
+		uint32_t word = get_le(ops + 4*i, 4);
+		if ((word & 0xffffff) >= states || (word >> 24 & 0xf) >= symbols || word >> 30)
+			return false;
+	}
+
+	return hash == sum;
+}
+
+// Let go of a table mapped from a file, so that instructions can be allocated again
+static void tmb_unmap(struct machine *m){
+	if (m->table_map.base){
+		munmap(m->table_map.base, m->table_map.size);
+		m->table_map.base = NULL;
+		m->instructions = NULL;
+	}
+}
+
+// Load the compiled table at path, returning 1 if it isn't a whole and valid one, or, given the
+// stat of a text table, if it wasn't compiled from the table as it is now
+static int tmb_load(struct machine *m, char *path, struct stat *source){
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	struct stat st;
+	unsigned char *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= TMB_HEADER_SIZE)
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 1;
+
+	unsigned long states = get_le(base+8, 4);
+	unsigned long symbols = get_le(base+12, 4);
+	long n = states * symbols;
+	bool ok = memcmp(base, "TTMB", 4) == 0 && get_le(base+4, 4) == TMB_VERSION && states >= 1 && states <= MAX_STATES
+		&& symbols >= 2 && symbols <= MAX_SYMBOLS && st.st_size == TMB_HEADER_SIZE + 4*n;
+	// File times only move on every few milliseconds, so a text table changed in the same tick as
+	// it was compiled would look unchanged. The compiled file is only trusted once it is stamped
+	// later than the text, then, and until then the text is compiled again on each load.
+	if (ok && source)
+		ok = (long) get_le(base+16, 8) == source->st_size && (long) get_le(base+24, 8) == source->st_mtim.tv_sec
+			&& (long) get_le(base+32, 4) == source->st_mtim.tv_nsec
+			&& (source->st_mtim.tv_sec < st.st_mtim.tv_sec
+				|| (source->st_mtim.tv_sec == st.st_mtim.tv_sec && source->st_mtim.tv_nsec < st.st_mtim.tv_nsec));
+	if (ok)
+		ok = tmb_valid(base + TMB_HEADER_SIZE, n, states, symbols, get_le(base+40, 8));
+	if (!ok){
+		munmap(base, st.st_size);
+		return 1;
+	}
+
+	// Where the file is laid out as the table is in memory, it is used as it is; otherwise it is
+	// copied out an operation at a time
+	tmb_unmap(m);
+	if (tmb_native()){
+		m->instructions = (struct op *) (base + TMB_HEADER_SIZE);
+		m->table_map.base = base;
+		m->table_map.size = st.st_size;
+	} else{
+		struct op *table = realloc(m->instructions, sizeof(struct op) * n);
+		if (!table){
+			munmap(base, st.st_size);
+			return 1;
+		}
+		for (long i=0; i<n; i++){
+			uint32_t word = get_le(base + TMB_HEADER_SIZE + 4*i, 4);
+			table[i] = (struct op){word & 0xffffff, word >> 24 & 0xf, word >> 28 & 1, word >> 29 & 1};
+		}
+		m->instructions = table;
+		munmap(base, st.st_size);
+	}
+
+	m->max_states = states;
+	set_symbols(m, symbols);
+	logprint(m, "Loading %ld operations compiled in %s.\n", n, path);
+
+	return 0;
+}
+
+// Compile the table just parsed from the text table of the given stat to path. The file is only a
+// cache, so a failure to write it is no more than a warning. It is written to a temporary file and
+// renamed into place, so that machines loading the same table at once never see half of one.
+static void tmb_write(struct machine *m, char *path, struct stat *source){
+	char tmp[PATH_MAX];
+	long n = (long) m->max_states * m->symbols;
+	unsigned char *ops = malloc(4*n);
+	int fd = -1;
+
+	if (ops && snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) < (int) sizeof(tmp))
+		fd = mkstemp(tmp);
+	if (fd == -1){
+		logprint(m, "WARNING: Could not compile the table to %s.\n", path);
+		free(ops);
+		return;
+	}
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (long i=0; i<n; i++){
+		put_le(ops + 4*i, tmb_word(m->instructions[i]), 4);
+		for (int b=0; b<4; b++)
+			hash = (hash ^ ops[4*i + b]) * 0x100000001b3ull;
+	}
+
+	unsigned char h[TMB_HEADER_SIZE] = "TTMB";
+	put_le(h+4, TMB_VERSION, 4);
+	put_le(h+8, m->max_states, 4);
+	put_le(h+12, m->symbols, 4);
+	put_le(h+16, source->st_size, 8);
+	put_le(h+24, source->st_mtim.tv_sec, 8);
+	put_le(h+32, source->st_mtim.tv_nsec, 4);
+	put_le(h+36, 0, 4);
+	put_le(h+40, hash, 8);
+
+	bool error = fchmod(fd, 0644) != 0 || write(fd, h, TMB_HEADER_SIZE) != TMB_HEADER_SIZE || write(fd, ops, 4*n) != 4*n;
+	error |= close(fd) != 0;
+	if (error || rename(tmp, path) != 0){
+		logprint(m, "WARNING: Could not compile the table to %s.\n", path);
+		unlink(tmp);
+	}
+	free(ops);
+}
+
+// Read the whole of a file that can't be mapped, such as a pipe, into memory, returning 1 on error
+static int read_whole(int fd, char **text, long *size){
+	char *buf = NULL;
+	long cap = 0;
+	long used = 0;
+
+	while (true){
+		if (used == cap){
+			cap = cap ? 2 * cap : JOIN_CHUNK;
+			char *more = realloc(buf, cap);
+			if (!more){
+				free(buf);
+				return 1;
+			}
+			buf = more;
+		}
+		ssize_t n = read(fd, buf + used, cap - used);
+		if (n < 0){
+			free(buf);
+			return 1;
+		}
+		if (n == 0)
+			break;
+		used += n;
+	}
+
+	*text = buf;
+	*size = used;
+	return 0;
+}
+
+// Parse the text table at s->p, as given above, into the instruction table, returning 1 on error
+static int parse_table(struct machine *m, struct scanner *s){
+	// First comes "STATES: [number between 1 and MAX_STATES]", which may be followed by
+	// "SYMBOLS: [number between 2 and MAX_SYMBOLS]"; otherwise there are two symbols, 0 and 1
+	long states = scan_skip_empty(s) ? parse_header(s, "STATES:") : -1;
+	if (states <= 0 || states > MAX_STATES){
+		s->p = s->line;
+		return scan_error(m, s, "The table should begin \"STATES: [number between 1 and %d]\".", MAX_STATES);
+	}
+	m->max_states = states;
+	scan_next_line(s);
+
+	long symbols = scan_skip_empty(s) ? parse_header(s, "SYMBOLS:") : -1;
+	if (symbols != -1 && (symbols < 2 || symbols > MAX_SYMBOLS)){
+		s->p = s->line;
+		return scan_error(m, s, "SYMBOLS should be given as \"SYMBOLS: [number between 2 and %d]\".", MAX_SYMBOLS);
+	}
+	if (symbols != -1)
+		scan_next_line(s);
+	set_symbols(m, symbols != -1 ? symbols : 2);
+
+	tmb_unmap(m);
+	struct op *table = realloc(m->instructions, sizeof(struct op) * m->max_states * m->symbols);
+	if (!table){
+		set_error(m, "Error: out of memory.");
+		return 1;
+	}
+	m->instructions = table;
+
+	// Set all instructions to just go right, to begin with
+	for (int state=0; state<m->max_states; state++){
+		for (int d=0; d<m->symbols; d++){
+			struct op default_op;
+			default_op.state = state;
+			default_op.val = d;
+			default_op.dir = 1;
+			default_op.stop = 0;
+			m->instructions[state * m->symbols + d] = default_op;
+		}
+	}
+
+	// Then go through the instructions, of which there should be max_states * symbols
+	long lines = (long) m->max_states * m->symbols;
+	for (long l=0; l<lines && scan_skip_empty(s); l++){
+		if (parse_instruc(m, s))
+			return 1;
+		scan_next_line(s);
+	}
+
+	// Ignore the rest of the file if there is any
+	if (scan_skip_empty(s))
+		logprint(m, "WARNING: Ignoring %s from line %ld.\n", s->fname, s->line_no);
+
+	return 0;
+}
+
+// Try to read and parse the instruction table in the file fname
+static int load_instrucs(struct machine *m, char *fname){
+	int fd = open(fname, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) != 0){
+		set_error(m, "Couldn't open file: %s.", fname);
+		if (fd != -1)
+			close(fd);
+		return 1;
+	}
+
+	// The file is mapped if it can be, and otherwise read into memory
+	char *text = MAP_FAILED;
+	long size = st.st_size;
+	if (S_ISREG(st.st_mode) && size > 0)
+		text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	bool mapped = text != MAP_FAILED;
+	int error = !mapped && read_whole(fd, &text, &size);
+	close(fd);
+	if (error){
+		set_error(m, "Error reading file: %s.", fname);
+		return 1;
+	}
+
+	// A compiled table is loaded as it is, and so is the compiled copy of a text table, if it was
+	// compiled from the table as it is now
+	char path[PATH_MAX];
+	bool compiled = size >= 4 && memcmp(text, "TTMB", 4) == 0;
+	bool cache = !compiled && m->table_cache && snprintf(path, sizeof(path), "%s.tmb", fname) < (int) sizeof(path);
+	if (compiled){
+		error = tmb_load(m, fname, NULL);
+		if (error)
+			set_error(m, "Error: %s is not a valid compiled table.", fname);
+	} else if (!cache || tmb_load(m, path, &st) != 0){
+		struct scanner s = {fname, text, text + size, text, 1};
+		error = parse_table(m, &s);
+		if (!error && cache)
+			tmb_write(m, path, &st);
+	}
+
+	if (mapped)
+		munmap(text, size);
+	else
+		free(text);
+	return error;
+}
+
+/* The following functions handle the tape and its buffer.
+ * read_buf() reads buffer_size cells into a block, starting at the given cell
+ * write_buf() writes a block back to the relevant segment of tape
+ * join_left() joins the blocks added to the left of the tape onto the start of the tape file
+ * cache_fetch() returns the cache slot holding a block of the file, reading it in if necessary
+ * mem_block() returns a block of the in-memory tape, growing it if necessary
+ * sparse_block() returns a block of the sparse tape, adding it to the table if necessary
+ * map_fetch() and map_store() copy a block from or to the memory-mapped tape
+ * change_buf() swaps the block under the head for another, by whichever means the tape uses
+ * load_tape() opens the tape file and sets the machine's tapef to point to it
+ * save_tape() writes everything still held in memory back to the tape file
+ */
+
+// The tape file only holds the tape from position 0 rightwards while the machine runs. Blocks to
+// the left of position 0 go into a separate, temporary left file, stored outwards from block -1,
+// so that growing the tape to the left costs the same as growing it to the right. The two are only
+// joined up by join_left(), once the machine stops. block_file() gives the file which holds the
+// block starting at start, the offset of that block in it, and the file's current length.
+static FILE *block_file(struct machine *m, long start, long *offset, long **len){
+	if (start >= 0){
+		*offset = start;
+		*len = &m->flen;
+		return m->tapef;
+	}
+
+	*offset = -start - m->buffer_size;
+	*len = &m->left_len;
+	return m->leftf;
+}
+
+static int read_buf(struct machine *m, long start, uint64_t *block){
+	long offset;
+	long *len;
+	FILE *fp = block_file(m, start, &offset, &len);
+
+	for (int w=0; w<m->buffer_words; w++)
+		block[w] = 0;
+
+	// Generate indefinite zeroes to either side of the tape that already exists
+	if (!fp || offset >= *len || fseek(fp, offset, SEEK_SET) != 0)
+		return 0;
+
+	// Anything short of a full block is past the end of the file, and is left as zeroes
+	size_t got = fread(m->cache.scratch, 1, m->buffer_size, fp);
+	m->io.block_loads++;
+	m->io.bytes_read += got;
+	if (m->cell_bits == 1 && !pack_binary(m->cache.scratch, got, block))
+		return 0;
+
+	// Otherwise the cells are checked and packed one at a time, which finds any that is wrong
+	for (size_t i=0; i<got; i++){
+		char c = m->cache.scratch[i];
+		int val = cell_value(c);
+		if (val < 0 || val >= m->symbols){
+			set_error(m, "Unrecognised character in tape: %c.", c);
+			return 1;
+		}
+		if (val)
+			set_cell(block, i, val, m->cell_bits);
+	}
+
+	return 0;
+}
+
+static int write_buf(struct machine *m, long start, uint64_t *block){
+	if (start < 0 && !m->leftf && !(m->leftf = tmpfile())){
+		set_error(m, "Error: could not create a file for the left of the tape.");
+		return 1;
+	}
+
+	long offset;
+	long *len;
+	FILE *fp = block_file(m, start, &offset, &len);
+
+	// If start is beyond where the file ends, pad it with zeroes up to there
+	if (offset > *len){
+		memset(m->cache.scratch, '0', m->buffer_size);
+		fseek(fp, 0, SEEK_END);
+		while (*len < offset){
+			int n = offset - *len < m->buffer_size ? offset - *len : m->buffer_size;
+			if (fwrite(m->cache.scratch, 1, n, fp) != (size_t) n){
+				set_error(m, "Error writing to tape.");
+				return 1;
+			}
+			*len += n;
+			m->io.bytes_written += n;
+		}
+	}
+
+	for (int i=0; i<m->buffer_size; i++)
+		m->cache.scratch[i] = cell_chars[get_cell(block, i, m->cell_bits)];
+	if (fseek(fp, offset, SEEK_SET) != 0 || fwrite(m->cache.scratch, 1, m->buffer_size, fp) != (size_t) m->buffer_size){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	m->io.block_stores++;
+	m->io.bytes_written += m->buffer_size;
+
+	// Keep the file lengths up to date as the tape grows, along with the number of blocks that
+	// have been added to the left
+	if (offset + m->buffer_size > *len)
+		*len = offset + m->buffer_size;
+	m->left_added = m->left_len / m->buffer_size;
+
+	return 0;
+}
+
+// Prepend the blocks in the left file onto the tape file. This is the only time the tape is shifted
+// along the file, and it is done once, in large chunks, after the machine has stopped.
+static int join_left(struct machine *m){
+	if (!m->leftf)
+		return 0;
+
+	int chunk_size = m->buffer_size > JOIN_CHUNK ? m->buffer_size : JOIN_CHUNK;
+	char *chunk = malloc(chunk_size);
+	if (!chunk){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	// Move the existing tape right by the length of the left file, starting from the end
+	int error = 0;
+	for (long remaining=m->flen; remaining>0 && !error; ){
+		int n = remaining < chunk_size ? remaining : chunk_size;
+		remaining -= n;
+		error = fseek(m->tapef, remaining, SEEK_SET) != 0 || fread(chunk, 1, n, m->tapef) != (size_t) n
+			|| fseek(m->tapef, remaining + m->left_len, SEEK_SET) != 0 || fwrite(chunk, 1, n, m->tapef) != (size_t) n;
+	}
+
+	// Then copy in the left blocks, furthest left first
+	for (int b=m->left_added-1; b>=0 && !error; b--){
+		error = fseek(m->leftf, (long) b * m->buffer_size, SEEK_SET) != 0
+			|| fread(chunk, 1, m->buffer_size, m->leftf) != (size_t) m->buffer_size
+			|| fseek(m->tapef, (long) (m->left_added-1-b) * m->buffer_size, SEEK_SET) != 0
+			|| fwrite(chunk, 1, m->buffer_size, m->tapef) != (size_t) m->buffer_size;
+	}
+
+	free(chunk);
+	if (error || fflush(m->tapef) == EOF){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	m->io.bytes_read += m->flen + m->left_len;
+	m->io.bytes_written += m->flen + m->left_len;
+
+	m->flen += m->left_len;
+	m->left_len = 0;
+	fclose(m->leftf);
+	m->leftf = NULL;
+
+	return 0;
+}
+
+// Allocate the block cache for the file-backed tape, with a hash table of at least twice as many
+// buckets as there are slots
+static int cache_init(struct machine *m){
+	int buckets = 1;
+	while (buckets < 2 * m->cache_blocks)
+		buckets *= 2;
+
+	// A machine that has been reset keeps the cache it had
+	if (!m->cache.slots){
+		m->cache.slots = malloc(sizeof(struct cache_slot) * m->cache_blocks);
+		m->cache.bits = malloc(sizeof(uint64_t) * m->buffer_words * m->cache_blocks);
+		m->cache.hash = malloc(sizeof(int) * buckets);
+		m->cache.scratch = malloc(m->buffer_size);
+	}
+	if (!m->cache.slots || !m->cache.bits || !m->cache.hash || !m->cache.scratch){
+		set_error(m, "Error: out of memory for tape cache.");
+		return 1;
+	}
+
+	for (int b=0; b<buckets; b++)
+		m->cache.hash[b] = -1;
+	m->cache.mask = buckets - 1;
+	m->cache.used = 0;
+	m->cache.head = m->cache.tail = -1;
+
+	return 0;
+}
+
+static int cache_bucket(struct machine *m, int blk){
+	return ((unsigned) blk * 2654435761u) & m->cache.mask;
+}
+
+// Unlink slot s from the LRU list, and optionally put it back at the most recently used end
+static void cache_unlink(struct machine *m, int s){
+	struct cache_slot *slot = &m->cache.slots[s];
+
+	if (slot->prev == -1)
+		m->cache.head = slot->next;
+	else
+		m->cache.slots[slot->prev].next = slot->next;
+
+	if (slot->next == -1)
+		m->cache.tail = slot->prev;
+	else
+		m->cache.slots[slot->next].prev = slot->prev;
+}
+
+static void cache_push(struct machine *m, int s){
+	m->cache.slots[s].prev = -1;
+	m->cache.slots[s].next = m->cache.head;
+	if (m->cache.head != -1)
+		m->cache.slots[m->cache.head].prev = s;
+	m->cache.head = s;
+	if (m->cache.tail == -1)
+		m->cache.tail = s;
+}
+
+// Find the slot holding a block in the cache, or -1 if it isn't there
+static int cache_find(struct machine *m, int blk){
+	for (int s=m->cache.hash[cache_bucket(m, blk)]; s!=-1; s=m->cache.slots[s].next_hash){
+		if (m->cache.slots[s].blk == blk)
+			return s;
+	}
+	return -1;
+}
+
+/* With --async-io, the blocks evicted from the cache are written behind, and the next block along
+ * read ahead, by an I/O thread, as described above struct io_job.
+ * async_start() starts the thread once the machine starts running
+ * async_write() queues an evicted block to be written
+ * async_read() gets a block from the jobs if it is in one, or has the thread read it and waits
+ * async_prefetch() queues a block to be read ahead, if there is a job free for it
+ * async_stop() waits for every job to be done and stops the thread
+ * All but the thread itself are called without the lock, and take it for themselves.
+ */
+
+static void *async_worker(void *arg){
+	struct machine *m = arg;
+
+	pthread_mutex_lock(&m->async.lock);
+	while (true){
+		struct io_job *job = NULL;
+		for (int j=0; j<ASYNC_JOBS; j++){
+			if (m->async.jobs[j].state == JOB_QUEUED && (!job || m->async.jobs[j].seq < job->seq))
+				job = &m->async.jobs[j];
+		}
+		if (!job){
+			if (m->async.quit)
+				break;
+			m->async.idle = true;
+			pthread_cond_wait(&m->async.wake, &m->async.lock);
+			m->async.idle = false;
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&m->async.lock);
+		long start = (long) job->blk * m->buffer_size;
+		int error = job->write ? write_buf(m, start, job->bits) : read_buf(m, start, job->bits);
+		pthread_mutex_lock(&m->async.lock);
+
+		job->state = JOB_DONE;
+		m->async.failed |= error;
+		if (m->async.waiting)
+			pthread_cond_signal(&m->async.done);
+	}
+	pthread_mutex_unlock(&m->async.lock);
+
+	return NULL;
+}
+
+// Start the I/O thread, or leave the tape to do its own I/O if it can't be started
+static void async_start(struct machine *m){
+	if (!(m->async.bits = malloc(sizeof(uint64_t) * m->buffer_words * ASYNC_JOBS)))
+		return;
+	for (int j=0; j<ASYNC_JOBS; j++)
+		m->async.jobs[j] = (struct io_job){.state = JOB_FREE, .bits = m->async.bits + j * m->buffer_words};
+	m->async.seq = 0;
+	m->async.quit = m->async.failed = m->async.idle = m->async.waiting = false;
+	m->async.flen = m->flen;
+	m->async.left_len = m->left_len;
+
+	pthread_mutex_init(&m->async.lock, NULL);
+	pthread_cond_init(&m->async.wake, NULL);
+	pthread_cond_init(&m->async.done, NULL);
+	if (pthread_create(&m->async.thread, NULL, async_worker, m) != 0){
+		pthread_mutex_destroy(&m->async.lock);
+		pthread_cond_destroy(&m->async.wake);
+		pthread_cond_destroy(&m->async.done);
+		free(m->async.bits);
+		m->async.bits = NULL;
+		return;
+	}
+	m->async.running = true;
+}
+
+// Wait for the jobs to be done and stop the thread, returning 1 if any of them failed
+static int async_stop(struct machine *m){
+	if (!m->async.running)
+		return 0;
+
+	pthread_mutex_lock(&m->async.lock);
+	m->async.quit = true;
+	pthread_cond_signal(&m->async.wake);
+	pthread_mutex_unlock(&m->async.lock);
+	pthread_join(m->async.thread, NULL);
+
+	pthread_mutex_destroy(&m->async.lock);
+	pthread_cond_destroy(&m->async.wake);
+	pthread_cond_destroy(&m->async.done);
+	free(m->async.bits);
+	m->async.bits = NULL;
+	m->async.running = false;
+
+	return m->async.failed;
+}
+
+// Wait for the thread to finish a job. Called with the lock held.
+static void async_wait(struct machine *m){
+	m->io.stalls++;
+	m->async.waiting = true;
+	pthread_cond_wait(&m->async.done, &m->async.lock);
+	m->async.waiting = false;
+}
+
+// Give the newest job for a block that can still be used, writes first, or NULL if there is none.
+// Called with the lock held.
+static struct io_job *async_find(struct machine *m, int blk){
+	struct io_job *found = NULL;
+	for (int j=0; j<ASYNC_JOBS; j++){
+		struct io_job *job = &m->async.jobs[j];
+		if (job->state == JOB_FREE || job->blk != blk || job->stale)
+			continue;
+		if (!found || job->write > found->write || (job->write == found->write && job->seq > found->seq))
+			found = job;
+	}
+	return found;
+}
+
+// Take a free job, or the oldest one done, waiting for one if there are none and wait is set.
+// Called with the lock held.
+static struct io_job *async_take(struct machine *m, bool wait){
+	while (true){
+		struct io_job *oldest = NULL;
+		for (int j=0; j<ASYNC_JOBS; j++){
+			struct io_job *job = &m->async.jobs[j];
+			if (job->state == JOB_FREE)
+				return job;
+			if (job->state == JOB_DONE && (!oldest || job->seq < oldest->seq))
+				oldest = job;
+		}
+		if (oldest || !wait)
+			return oldest;
+
+		async_wait(m);
+	}
+}
+
+// Queue a job for the thread. Called with the lock held.
+static void async_queue(struct machine *m, struct io_job *job, bool write, int blk){
+	job->state = JOB_QUEUED;
+	job->write = write;
+	job->stale = false;
+	job->ahead = false;
+	job->blk = blk;
+	job->seq = m->async.seq++;
+	if (m->async.idle)
+		pthread_cond_signal(&m->async.wake);
+}
+
+static int async_write(struct machine *m, int blk, uint64_t *bits){
+	pthread_mutex_lock(&m->async.lock);
+	if (m->async.failed){
+		pthread_mutex_unlock(&m->async.lock);
+		return 1;
+	}
+
+	// Anything read of the block before this write is done is out of date
+	for (int j=0; j<ASYNC_JOBS; j++){
+		if (!m->async.jobs[j].write && m->async.jobs[j].blk == blk)
+			m->async.jobs[j].stale = true;
+	}
+
+	struct io_job *job = async_take(m, true);
+	memcpy(job->bits, bits, sizeof(uint64_t) * m->buffer_words);
+	async_queue(m, job, true, blk);
+
+	long start = (long) blk * m->buffer_size;
+	long *len = start >= 0 ? &m->async.flen : &m->async.left_len;
+	long offset = start >= 0 ? start : -start - m->buffer_size;
+	if (offset + m->buffer_size > *len)
+		*len = offset + m->buffer_size;
+	pthread_mutex_unlock(&m->async.lock);
+
+	return 0;
+}
+
+static int async_read(struct machine *m, int blk, uint64_t *bits){
+	pthread_mutex_lock(&m->async.lock);
+	while (!m->async.failed){
+		struct io_job *job = async_find(m, blk);
+
+		if (!job){
+			async_queue(m, async_take(m, true), false, blk);
+			continue;
+		}
+		if (job->write || job->state == JOB_DONE){
+			memcpy(bits, job->bits, sizeof(uint64_t) * m->buffer_words);
+			if (!job->write){
+				m->io.prefetch_hits += job->ahead;
+				job->state = JOB_FREE;
+			}
+			break;
+		}
+
+		async_wait(m);
+	}
+	int error = m->async.failed;
+	pthread_mutex_unlock(&m->async.lock);
+
+	return error;
+}
+
+static void async_prefetch(struct machine *m, int blk){
+	long start = (long) blk * m->buffer_size;
+	long offset = start >= 0 ? start : -start - m->buffer_size;
+	if (cache_find(m, blk) != -1 || offset >= (start >= 0 ? m->async.flen : m->async.left_len))
+		return;
+
+	pthread_mutex_lock(&m->async.lock);
+	struct io_job *job;
+	if (!async_find(m, blk) && (job = async_take(m, false))){
+		async_queue(m, job, false, blk);
+		job->ahead = true;
+		m->io.prefetches++;
+	}
+	pthread_mutex_unlock(&m->async.lock);
+}
+
+static int cache_fetch(struct machine *m, int blk){
+	// Look for the block in the hash table first
+	int found = cache_find(m, blk);
+	if (found != -1){
+		cache_unlink(m, found);
+		cache_push(m, found);
+		return found;
+	}
+
+	// Otherwise take a free slot, or evict the least recently used block, writing it back if needed
+	int s;
+	if (m->cache.used < m->cache_blocks){
+		s = m->cache.used++;
+	} else{
+		s = m->cache.tail;
+		struct cache_slot *old = &m->cache.slots[s];
+
+		if (old->dirty && (m->async.running ? async_write(m, old->blk, old->bits) : write_buf(m, (long) old->blk * m->buffer_size, old->bits)))
+			return -1;
+
+		int *link = &m->cache.hash[cache_bucket(m, old->blk)];
+		while (*link != s)
+			link = &m->cache.slots[*link].next_hash;
+		*link = old->next_hash;
+		cache_unlink(m, s);
+	}
+
+	// A block that isn't wholly inside its file yet is written back even if unchanged, so that the
+	// tape still grows to cover every block the head has visited
+	struct cache_slot *slot = &m->cache.slots[s];
+	long start = (long) blk * m->buffer_size;
+	long offset = start >= 0 ? start : -start - m->buffer_size;
+	long len = start >= 0 ? (m->async.running ? m->async.flen : m->flen) : (m->async.running ? m->async.left_len : m->left_len);
+	slot->blk = blk;
+	slot->dirty = offset + m->buffer_size > len;
+	slot->bits = m->cache.bits + s * m->buffer_words;
+
+	// Past the end of its file, and of any write to it still to be done, a block can only be blank,
+	// so the I/O thread needn't be asked for it
+	if (m->async.running && offset >= len)
+		memset(slot->bits, 0, sizeof(uint64_t) * m->buffer_words);
+	else if (m->async.running ? async_read(m, blk, slot->bits) : read_buf(m, start, slot->bits))
+		return -1;
+
+	slot->next_hash = m->cache.hash[cache_bucket(m, blk)];
+	m->cache.hash[cache_bucket(m, blk)] = s;
+	cache_push(m, s);
+
+	return s;
+}
+
+// Write every changed block in the cache back to the file
+static int cache_flush(struct machine *m){
+	for (int s=0; s<m->cache.used; s++){
+		if (m->cache.slots[s].dirty){
+			if (write_buf(m, (long) m->cache.slots[s].blk * m->buffer_size, m->cache.slots[s].bits))
+				return 1;
+			m->cache.slots[s].dirty = false;
+		}
+	}
+
+	return 0;
+}
+
+// Make sure arr has room for at least need blocks, zeroing any new ones
+static int grow_blocks(struct machine *m, uint64_t **arr, int *cap, int need){
+	if (need <= *cap)
+		return 0;
+
+	int new_cap = *cap ? *cap : 16;
+	while (new_cap < need)
+		new_cap *= 2;
+
+	uint64_t *new_arr = realloc(*arr, sizeof(uint64_t) * m->buffer_words * new_cap);
+	if (!new_arr){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+	memset(new_arr + *cap * m->buffer_words, 0, sizeof(uint64_t) * m->buffer_words * (new_cap - *cap));
+
+	*arr = new_arr;
+	*cap = new_cap;
+	return 0;
+}
+
+static uint64_t *mem_block(struct machine *m, int blk){
+	if (blk >= 0){
+		if (grow_blocks(m, &m->mem_tape.right, &m->mem_tape.right_cap, blk + 1))
+			return NULL;
+		if (blk >= m->mem_tape.right_blocks)
+			m->mem_tape.right_blocks = blk + 1;
+
+		// Any block the head visits is written back in full, as write_buf() would do
+		if ((long) (blk+1) * m->buffer_size > m->mem_tape.len)
+			m->mem_tape.len = (long) (blk+1) * m->buffer_size;
+
+		return m->mem_tape.right + blk * m->buffer_words;
+	}
+
+	// Block -1 is stored first in left, block -2 second, and so on
+	if (grow_blocks(m, &m->mem_tape.left, &m->mem_tape.left_cap, -blk))
+		return NULL;
+	if (-blk > m->mem_tape.left_blocks)
+		m->mem_tape.left_blocks = -blk;
+
+	return m->mem_tape.left + (-blk - 1) * m->buffer_words;
+}
+
+static long sparse_bucket(struct machine *m, int blk){
+	return ((unsigned) blk * 2654435761u) & m->sparse_tape.mask;
+}
+
+// Find the bucket holding a block of the sparse tape, or the empty one it would go in
+static long sparse_find(struct machine *m, int blk){
+	long b = sparse_bucket(m, blk);
+	while (m->sparse_tape.table[b].slot != -1 && m->sparse_tape.table[b].blk != blk)
+		b = (b + 1) & m->sparse_tape.mask;
+	return b;
+}
+
+// Set up the sparse tape the first time it is used, or after the width of a cell has changed
+static int sparse_init(struct machine *m){
+	if (!m->sparse_tape.table){
+		m->sparse_tape.table = malloc(sizeof(struct sparse_entry) * 64);
+		if (!m->sparse_tape.table){
+			set_error(m, "Error: out of memory for tape.");
+			return 1;
+		}
+		for (int b=0; b<64; b++)
+			m->sparse_tape.table[b].slot = -1;
+		m->sparse_tape.mask = 63;
+	}
+	if (!m->sparse_tape.blank && !(m->sparse_tape.blank = calloc(m->buffer_words, sizeof(uint64_t)))){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Double the hash table of the sparse tape, putting every block back in its new place
+static int sparse_grow(struct machine *m){
+	long size = (m->sparse_tape.mask + 1) * 2;
+	struct sparse_entry *old = m->sparse_tape.table;
+	struct sparse_entry *table = malloc(sizeof(struct sparse_entry) * size);
+	if (!table){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	for (long b=0; b<size; b++)
+		table[b].slot = -1;
+	m->sparse_tape.table = table;
+	m->sparse_tape.mask = size - 1;
+	for (long b=0; b<size/2; b++){
+		if (old[b].slot != -1)
+			table[sparse_find(m, old[b].blk)] = old[b];
+	}
+
+	free(old);
+	return 0;
+}
+
+// Add a block of the sparse tape to the table, taking a slot from the free list or the pool, and
+// give the slot of its cells, or -1 on error. Growing the pool moves every block in it.
+static int sparse_add(struct machine *m, int blk){
+	if (2 * (m->sparse_tape.used + 1) > m->sparse_tape.mask + 1 && sparse_grow(m))
+		return -1;
+
+	int slot = m->sparse_tape.free_slot;
+	if (slot != -1){
+		m->sparse_tape.free_slot = m->sparse_tape.bits[(long) slot * m->buffer_words];
+	} else{
+		if (m->sparse_tape.slots == m->sparse_tape.cap){
+			int cap = m->sparse_tape.cap ? 2 * m->sparse_tape.cap : 64;
+			uint64_t *bits = realloc(m->sparse_tape.bits, sizeof(uint64_t) * m->buffer_words * cap);
+			if (!bits){
+				set_error(m, "Error: out of memory for tape.");
+				return -1;
+			}
+			m->sparse_tape.bits = bits;
+			m->sparse_tape.cap = cap;
+		}
+		slot = m->sparse_tape.slots++;
+	}
+	memset(m->sparse_tape.bits + (long) slot * m->buffer_words, 0, sizeof(uint64_t) * m->buffer_words);
+
+	m->sparse_tape.table[sparse_find(m, blk)] = (struct sparse_entry){blk, slot};
+	m->sparse_tape.used++;
+	return slot;
+}
+
+// Drop the block in bucket b, putting its slot on the free list, and shift back any blocks after
+// it that would no longer be found across the gap
+static void sparse_drop(struct machine *m, long b){
+	long mask = m->sparse_tape.mask;
+	struct sparse_entry *table = m->sparse_tape.table;
+
+	m->sparse_tape.bits[(long) table[b].slot * m->buffer_words] = m->sparse_tape.free_slot;
+	m->sparse_tape.free_slot = table[b].slot;
+	table[b].slot = -1;
+	m->sparse_tape.used--;
+
+	for (long i=(b+1)&mask; table[i].slot!=-1; i=(i+1)&mask){
+		long home = sparse_bucket(m, table[i].blk);
+		if (((i - home) & mask) >= ((i - b) & mask)){
+			table[b] = table[i];
+			table[i].slot = -1;
+			b = i;
+		}
+	}
+}
+
+// Find a block of the sparse tape, adding it if it isn't held yet, or NULL on error
+static uint64_t *sparse_block(struct machine *m, int blk){
+	int slot = m->sparse_tape.table[sparse_find(m, blk)].slot;
+	if (slot == -1 && (slot = sparse_add(m, blk)) == -1)
+		return NULL;
+	return m->sparse_tape.bits + (long) slot * m->buffer_words;
+}
+
+// Put the head's buffer on block buf_pos of the sparse tape, held or not
+static void sparse_enter(struct machine *m){
+	int slot = m->sparse_tape.table[sparse_find(m, m->buf_pos)].slot;
+	m->sparse_tape.on_blank = slot == -1;
+	m->buffer = slot == -1 ? m->sparse_tape.blank : m->sparse_tape.bits + (long) slot * m->buffer_words;
+
+	if (m->buf_pos < m->sparse_tape.low_block)
+		m->sparse_tape.low_block = m->buf_pos;
+	if ((long) (m->buf_pos+1) * m->buffer_size > m->sparse_tape.len)
+		m->sparse_tape.len = (long) (m->buf_pos+1) * m->buffer_size;
+}
+
+// Take the head's buffer off its block of the sparse tape, keeping the blank block if anything
+// was left on it, and dropping a held block if nothing was
+static int sparse_leave(struct machine *m){
+	bool blank = true;
+	for (int w=0; w<m->buffer_words && blank; w++)
+		blank = !m->buffer[w];
+
+	if (m->sparse_tape.on_blank && !blank){
+		int slot = sparse_add(m, m->buf_pos);
+		if (slot == -1)
+			return 1;
+		memcpy(m->sparse_tape.bits + (long) slot * m->buffer_words, m->sparse_tape.blank, sizeof(uint64_t) * m->buffer_words);
+		memset(m->sparse_tape.blank, 0, sizeof(uint64_t) * m->buffer_words);
+	} else if (!m->sparse_tape.on_blank && blank){
+		sparse_drop(m, sparse_find(m, m->buf_pos));
+	}
+	m->buffer_dirty = false;
+
+	return 0;
+}
+
+// Make sure map maps at least need bytes of its file, growing the file if it is shorter
+static int map_reserve(struct machine *m, struct tape_map *map, long need){
+	if (need <= map->size)
+		return 0;
+
+	long new_size = map->size + MAP_CHUNK > need ? map->size + MAP_CHUNK : need;
+	if (map->cells && munmap(map->cells, map->size) != 0){
+		set_error(m, "Error: could not unmap tape.");
+		return 1;
+	}
+	map->cells = NULL;
+
+	if (ftruncate(map->fd, new_size) != 0){
+		set_error(m, "Error: could not grow tape file.");
+		return 1;
+	}
+
+	map->cells = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (map->cells == MAP_FAILED){
+		map->cells = NULL;
+		set_error(m, "Error: could not map tape file.");
+		return 1;
+	}
+	map->size = new_size;
+
+	return 0;
+}
+
+// Find the cells of the block starting at start in the mapped tape, mapping more of the file as
+// needed. Every block the head visits becomes part of the tape, as write_buf() would make it.
+static char *map_cells(struct machine *m, long start){
+	struct tape_map *map = &m->right_map;
+	long offset = start;
+	long *len = &m->flen;
+
+	if (start < 0){
+		if (m->left_map.fd == -1){
+			if (!(m->leftf = tmpfile())){
+				set_error(m, "Error: could not create a file for the left of the tape.");
+				return NULL;
+			}
+			m->left_map.fd = fileno(m->leftf);
+		}
+
+		map = &m->left_map;
+		offset = -start - m->buffer_size;
+		len = &m->left_len;
+	}
+
+	if (map_reserve(m, map, offset + m->buffer_size))
+		return NULL;
+
+	if (offset + m->buffer_size > *len){
+		memset(map->cells + *len, '0', offset + m->buffer_size - *len);
+		*len = offset + m->buffer_size;
+	}
+
+	return map->cells + offset;
+}
+
+static int map_fetch(struct machine *m, long start, uint64_t *block){
+	char *cells = map_cells(m, start);
+	if (!cells)
+		return 1;
+	if (m->cell_bits == 1 && !pack_binary(cells, m->buffer_size, block)){
+		m->io.block_loads++;
+		m->io.bytes_read += m->buffer_size;
+		return 0;
+	}
+
+	int word_cells = WORD_BITS / m->cell_bits;
+	for (int w=0; w<m->buffer_words; w++){
+		uint64_t bits = 0;
+		for (int i=0; i<word_cells; i++){
+			char c = cells[w*word_cells + i];
+			int val = cell_value(c);
+			if (val < 0 || val >= m->symbols){
+				set_error(m, "Unrecognised character in tape: %c.", c);
+				return 1;
+			}
+			bits |= (uint64_t) val << (i * m->cell_bits);
+		}
+		block[w] = bits;
+	}
+	m->io.block_loads++;
+	m->io.bytes_read += m->buffer_size;
+
+	return 0;
+}
+
+static int map_store(struct machine *m, long start, uint64_t *block){
+	char *cells = map_cells(m, start);
+	if (!cells)
+		return 1;
+
+	for (int i=0; i<m->buffer_size; i++)
+		cells[i] = cell_chars[get_cell(block, i, m->cell_bits)];
+	m->io.block_stores++;
+	m->io.bytes_written += m->buffer_size;
+
+	return 0;
+}
+
+// Unmap both files and cut them back to the tape in use, ready to be joined
+static int map_close(struct machine *m){
+	int error = 0;
+
+	if (m->right_map.cells)
+		error |= munmap(m->right_map.cells, m->right_map.size);
+	if (m->left_map.cells)
+		error |= munmap(m->left_map.cells, m->left_map.size);
+	m->right_map.cells = m->left_map.cells = NULL;
+
+	error |= ftruncate(m->right_map.fd, m->flen);
+	if (m->left_map.fd != -1)
+		error |= ftruncate(m->left_map.fd, m->left_len);
+	m->left_added = m->left_len / m->buffer_size;
+
+	// The files have changed underneath stdio, so drop anything it has buffered before
+	// join_left() reads them back
+	error |= fflush(m->tapef);
+	if (m->leftf)
+		error |= fflush(m->leftf);
+
+	if (error){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Find the checkpoint entry of a block, growing the tables if need be, or NULL if out of memory
+static uint32_t *ckpt_entry(struct machine *m, int blk){
+	uint32_t **arr = blk >= 0 ? &m->ckpt.right : &m->ckpt.left;
+	int *cap = blk >= 0 ? &m->ckpt.right_cap : &m->ckpt.left_cap;
+	int i = blk >= 0 ? blk : -blk - 1;
+
+	if (i >= *cap){
+		int new_cap = *cap ? *cap : 64;
+		while (new_cap <= i)
+			new_cap *= 2;
+
+		uint32_t *new_arr = realloc(*arr, sizeof(uint32_t) * new_cap);
+		if (!new_arr){
+			set_error(m, "Error: out of memory for checkpoint.");
+			return NULL;
+		}
+		memset(new_arr + *cap, 0, sizeof(uint32_t) * (new_cap - *cap));
+		*arr = new_arr;
+		*cap = new_cap;
+	}
+
+	return &(*arr)[i];
+}
+
+static int move_buf(struct machine *m, int new_pos){
+	int old_pos = m->buf_pos;
+
+	if (m->backend == BACKEND_SPARSE){
+		if (m->buffer_dirty && sparse_leave(m))
+			return 1;
+		m->buf_pos = new_pos;
+		sparse_enter(m);
+		return 0;
+	}
+
+	if (m->backend == BACKEND_MAP){
+		if (m->buffer_dirty && map_store(m, (long) m->buf_pos * m->buffer_size, m->buffer))
+			return 1;
+		m->buffer_dirty = false;
+		m->buf_pos = new_pos;
+		return map_fetch(m, (long) m->buf_pos * m->buffer_size, m->buffer);
+	}
+
+	// Once there has been a checkpoint, the blocks changed since are marked to go in the next
+	if (m->backend == BACKEND_MEMORY && m->ckpt.blocks && m->buffer_dirty){
+		uint32_t *e = ckpt_entry(m, m->buf_pos);
+		if (!e)
+			return 1;
+		*e |= CKPT_CHANGED;
+		m->buffer_dirty = false;
+	}
+
+	m->buf_pos = new_pos;
+
+	if (m->backend == BACKEND_MEMORY)
+		return (m->buffer = mem_block(m, m->buf_pos)) == NULL;
+
+	if (m->buffer_dirty){
+		m->cache.slots[m->curr_slot].dirty = true;
+		m->buffer_dirty = false;
+	}
+
+	if ((m->curr_slot = cache_fetch(m, m->buf_pos)) == -1)
+		return 1;
+	m->buffer = m->cache.slots[m->curr_slot].bits;
+
+	// Read ahead the block beyond, in the direction the head is going
+	if (m->async.running)
+		async_prefetch(m, 2 * new_pos - old_pos);
+
+	return 0;
+}
+
+// Move the head's buffer to block new_pos, counting the blocks the tape grows by to the left, and
+// with count_stats, the time it takes
+static int change_buf(struct machine *m, int new_pos){
+	if (new_pos < m->io.low_block){
+		m->io.left_extensions += m->io.low_block - new_pos;
+		m->io.low_block = new_pos;
+	}
+	if (!m->count_stats)
+		return move_buf(m, new_pos);
+
+	double start = tm_clock();
+	int error = move_buf(m, new_pos);
+	m->stats.block_seconds += tm_clock() - start;
+	return error;
+}
+
+// Read the ASCII tape from fp, up to its end, into the in-memory tape
+static int load_mem_tape(struct machine *m, FILE *fp){
+	char chunk[4096];
+	size_t got;
+	long i = 0;
+
+	while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0){
+		m->io.bytes_read += got;
+		if (grow_blocks(m, &m->mem_tape.right, &m->mem_tape.right_cap, (i + got + m->buffer_size - 1) / m->buffer_size))
+			return 1;
+		if (m->cell_bits == 1 && i % WORD_BITS == 0 && !pack_binary(chunk, got, m->mem_tape.right + i / WORD_BITS)){
+			i += got;
+			continue;
+		}
+		for (size_t c=0; c<got; c++, i++){
+			int val = cell_value(chunk[c]);
+			if (val < 0 || val >= m->symbols){
+				set_error(m, "Unrecognised character in tape: %c.", chunk[c]);
+				return 1;
+			}
+			if (val)
+				set_cell(m->mem_tape.right, i, val, m->cell_bits);
+		}
+	}
+	if (ferror(fp)){
+		set_error(m, "Error reading tape.");
+		return 1;
+	}
+	m->mem_tape.right_blocks = (i + m->buffer_size - 1) / m->buffer_size;
+	m->mem_tape.len = i;
+
+	return 0;
+}
+
+// Write the in-memory tape to fp as ASCII, from the leftmost block visited onwards
+static int save_mem_tape(struct machine *m, FILE *fp){
+	char *line = malloc(m->buffer_size);
+	int error = 0;
+
+	if (!line){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	fseek(fp, 0, SEEK_SET);
+	for (int b=m->mem_tape.left_blocks-1; b>=0 && !error; b--){
+		for (int i=0; i<m->buffer_size; i++)
+			line[i] = cell_chars[get_cell(m->mem_tape.left + b * m->buffer_words, i, m->cell_bits)];
+		error = fwrite(line, 1, m->buffer_size, fp) != (size_t) m->buffer_size;
+	}
+
+	for (long b=0; b*m->buffer_size < m->mem_tape.len && !error; b++){
+		int n = m->mem_tape.len - b*m->buffer_size < m->buffer_size ? m->mem_tape.len - b*m->buffer_size : m->buffer_size;
+		for (int i=0; i<n; i++)
+			line[i] = cell_chars[get_cell(m->mem_tape.right + b * m->buffer_words, i, m->cell_bits)];
+		error = fwrite(line, 1, n, fp) != (size_t) n;
+	}
+
+	free(line);
+	if (error || fflush(fp) == EOF){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	m->io.bytes_written += ftell(fp);
+
+	return 0;
+}
+
+// Read the ASCII tape from fp into the sparse tape, keeping only the blocks with something on them
+static int load_sparse_tape(struct machine *m, FILE *fp){
+	char *line = malloc(m->buffer_size);
+	size_t got;
+	long len = 0;
+
+	if (!line){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	for (int b=0; (got = fread(line, 1, m->buffer_size, fp)) > 0; b++){
+		uint64_t *block = NULL;
+		m->io.bytes_read += got;
+		len += got;
+		if (scan_past(line, got, '0') == (long) got)
+			continue;
+		if (m->cell_bits == 1){
+			if (!(block = sparse_block(m, b))){
+				free(line);
+				return 1;
+			}
+			if (!pack_binary(line, got, block))
+				continue;
+		}
+		for (size_t i=0; i<got; i++){
+			int val = cell_value(line[i]);
+			if (val < 0 || val >= m->symbols){
+				set_error(m, "Unrecognised character in tape: %c.", line[i]);
+				free(line);
+				return 1;
+			}
+			if (val && !block && !(block = sparse_block(m, b))){
+				free(line);
+				return 1;
+			}
+			if (val)
+				set_cell(block, i, val, m->cell_bits);
+		}
+	}
+	m->sparse_tape.len = len;
+
+	free(line);
+	if (ferror(fp)){
+		set_error(m, "Error reading tape.");
+		return 1;
+	}
+	return 0;
+}
+
+// Write the sparse tape to fp as ASCII, from the leftmost block visited onwards, every block that
+// isn't held being written as zeroes
+static int save_sparse_tape(struct machine *m, FILE *fp){
+	char *line = malloc(m->buffer_size);
+	int error = 0;
+
+	if (!line){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	fseek(fp, 0, SEEK_SET);
+	for (long b=m->sparse_tape.low_block; b*m->buffer_size < m->sparse_tape.len && !error; b++){
+		int n = m->sparse_tape.len - b*m->buffer_size < m->buffer_size ? m->sparse_tape.len - b*m->buffer_size : m->buffer_size;
+		int slot = m->sparse_tape.table[sparse_find(m, b)].slot;
+		if (slot == -1){
+			memset(line, '0', n);
+		} else{
+			for (int i=0; i<n; i++)
+				line[i] = cell_chars[get_cell(m->sparse_tape.bits + (long) slot * m->buffer_words, i, m->cell_bits)];
+		}
+		error = fwrite(line, 1, n, fp) != (size_t) n;
+	}
+
+	free(line);
+	if (error || fflush(fp) == EOF){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	m->io.bytes_written += ftell(fp);
+
+	return 0;
+}
+
+/* The binary tape format starts with a BIN_HEADER_SIZE byte header, all little-endian:
+ *   0  magic "TTAP"
+ *   4  u32 format version, BIN_VERSION
+ *   8  i64 origin: the number of cells stored to the left of position 0
+ *  16  i64 length: the number of cells stored in all
+ *  24  i64 head position
+ *  32  i32 machine state
+ *  36  u32 bits to a cell, 1, 2 or 4 (0 in older tapes, meaning 1)
+ * followed by the cells, packed into little-endian u64 words as on the in-memory tape, with the
+ * cell at position -origin in the lowest bits of the first word. A binary tape is always run on
+ * the in-memory tape, or the sparse tape with --sparse, which leaves the words of any block it
+ * doesn't hold as a hole in the file.
+ */
+
+// Convert words between host order and the little-endian order of the file, in place
+static void swap_words(uint64_t *words, long n){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (long i=0; i<n; i++)
+		words[i] = __builtin_bswap64(words[i]);
+#else
+	(void) words;
+	(void) n;
+#endif
+}
+
+// Find the word of the in-memory or sparse tape holding the word_cells cells from pos, a multiple
+// of word_cells, the number of cells to a word. On the sparse tape the block is added if need be,
+// and NULL given if that fails.
+static uint64_t *mem_word(struct machine *m, long pos){
+	long blk = pos >= 0 ? pos / m->buffer_size : -((-pos + m->buffer_size - 1) / m->buffer_size);
+	long off = pos - blk * m->buffer_size;
+	int word_cells = WORD_BITS / m->cell_bits;
+
+	if (m->backend == BACKEND_SPARSE){
+		uint64_t *block = sparse_block(m, blk);
+		return block ? block + off / word_cells : NULL;
+	}
+	if (blk >= 0)
+		return m->mem_tape.right + blk * m->buffer_words + off / word_cells;
+	return m->mem_tape.left + (-blk - 1) * m->buffer_words + off / word_cells;
+}
+
+// Read the word at pos as mem_word() finds it, without adding a block to the sparse tape
+static uint64_t mem_read(struct machine *m, long pos){
+	if (m->backend != BACKEND_SPARSE)
+		return *mem_word(m, pos);
+
+	long blk = pos >= 0 ? pos / m->buffer_size : -((-pos + m->buffer_size - 1) / m->buffer_size);
+	long off = pos - blk * m->buffer_size;
+	int slot = m->sparse_tape.table[sparse_find(m, blk)].slot;
+	return slot == -1 ? 0 : m->sparse_tape.bits[(long) slot * m->buffer_words + off / (WORD_BITS / m->cell_bits)];
+}
+
+static unsigned mem_cell(struct machine *m, long pos){
+	int word_cells = WORD_BITS / m->cell_bits;
+	long cell = (pos % word_cells + word_cells) % word_cells;
+	return (mem_read(m, pos - cell) >> (cell * m->cell_bits)) & ((1u << m->cell_bits) - 1);
+}
+
+// Read the binary tape from fp, which is flen bytes long, or -1 if that isn't known, as for a stream
+static int load_bin_tape(struct machine *m, FILE *fp, long flen){
+	unsigned char h[BIN_HEADER_SIZE];
+
+	if (fread(h, 1, BIN_HEADER_SIZE, fp) != BIN_HEADER_SIZE || memcmp(h, "TTAP", 4) != 0 || get_le(h+4, 4) != BIN_VERSION){
+		set_error(m, "Error: unsupported binary tape.");
+		return 1;
+	}
+
+	// Without a table to go by, as in tm_convert(), the cells are taken to be as wide as the tape's
+	int bits = get_le(h+36, 4) ? (int) get_le(h+36, 4) : 1;
+	if (bits != 1 && bits != 2 && bits != 4){
+		set_error(m, "Error: corrupt binary tape.");
+		return 1;
+	}
+	if (!m->max_states)
+		set_symbols(m, 1 << bits);
+	if (bits != m->cell_bits){
+		set_error(m, "Error: the binary tape has %d bits to a cell, but the table's %d symbols need %d.", bits, m->symbols, m->cell_bits);
+		return 1;
+	}
+
+	long origin = get_le(h+8, 8);
+	long length = get_le(h+16, 8);
+	long head = get_le(h+24, 8);
+	int word_cells = WORD_BITS / bits;
+	long words = (length + word_cells - 1) / word_cells;
+	if (origin < 0 || length < origin || (flen >= 0 && BIN_HEADER_SIZE + words * 8 > flen)){
+		set_error(m, "Error: corrupt binary tape.");
+		return 1;
+	}
+
+	// The words are read before room is made for them, so that a stream whose header is corrupt runs
+	// out of words rather than memory
+	long cap = flen >= 0 || words < JOIN_CHUNK ? words : JOIN_CHUNK;
+	long got = 0;
+	uint64_t *cells = malloc(sizeof(uint64_t) * (cap ? cap : 1));
+	if (!cells){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+	while (got < words){
+		if (got == cap){
+			cap = cap * 2 < words ? cap * 2 : words;
+			uint64_t *grown = realloc(cells, sizeof(uint64_t) * cap);
+			if (!grown){
+				set_error(m, "Error: out of memory for tape.");
+				free(cells);
+				return 1;
+			}
+			cells = grown;
+		}
+		size_t n = fread(cells + got, sizeof(uint64_t), cap - got, fp);
+		if (n == 0)
+			break;
+		got += n;
+	}
+	if (got < words){
+		set_error(m, "Error reading tape.");
+		free(cells);
+		return 1;
+	}
+	m->io.bytes_read += BIN_HEADER_SIZE + words * 8;
+	swap_words(cells, words);
+	if (length % word_cells)
+		cells[words-1] &= ((uint64_t) 1 << (length % word_cells * bits)) - 1;
+
+	// Make room for every cell, on either side of position 0; the sparse tape only needs to know
+	// how far they go
+	long left_blocks = (origin + m->buffer_size - 1) / m->buffer_size;
+	long right_blocks = (length - origin + m->buffer_size - 1) / m->buffer_size;
+	if (m->backend == BACKEND_SPARSE){
+		m->sparse_tape.low_block = -left_blocks;
+		m->sparse_tape.len = length - origin;
+	} else{
+		if (grow_blocks(m, &m->mem_tape.left, &m->mem_tape.left_cap, left_blocks)
+				|| grow_blocks(m, &m->mem_tape.right, &m->mem_tape.right_cap, right_blocks)){
+			free(cells);
+			return 1;
+		}
+		m->mem_tape.left_blocks = left_blocks;
+		m->mem_tape.right_blocks = right_blocks;
+		m->mem_tape.len = length - origin;
+	}
+
+	// Word-aligned tapes, as this program writes them, are copied a word at a time. Only the words
+	// with something on them are copied, so that the sparse tape holds no more blocks than it must.
+	uint64_t *word = cells;
+	if (origin % word_cells == 0){
+		for (long w=0; w<words && word; w++){
+			if (cells[w] && (word = mem_word(m, w * word_cells - origin)))
+				*word = cells[w];
+		}
+	} else{
+		for (long i=0; i<length && word; i++){
+			uint64_t val = get_cell(cells, i, bits);
+			long pos = i - origin;
+			long cell = (pos % word_cells + word_cells) % word_cells;
+			if (val && (word = mem_word(m, pos - cell)))
+				*word |= val << (cell * bits);
+		}
+	}
+	free(cells);
+	if (!word)
+		return 1;
+
+	// Carry on from where the machine left the tape
+	int32_t saved_state = get_le(h+32, 4);
+	if (m->max_states && (saved_state < 0 || saved_state >= m->max_states)){
+		set_error(m, "Error: the state saved in the tape is not in the instruction table.");
+		return 1;
+	}
+	m->state = saved_state;
+	m->buf_pos = head >= 0 ? head / m->buffer_size : -((-head + m->buffer_size - 1) / m->buffer_size);
+	m->position = head - (long) m->buf_pos * m->buffer_size;
+
+	return 0;
+}
+
+// Write the in-memory or sparse tape to fp in the binary format. If strip is set, leading and
+// trailing zeroes are left out, to the nearest word on the left.
+static int save_bin_tape(struct machine *m, FILE *fp, bool strip){
+	bool sparse = m->backend == BACKEND_SPARSE;
+	long lo = sparse ? (long) m->sparse_tape.low_block * m->buffer_size : -(long) m->mem_tape.left_blocks * m->buffer_size;
+	long hi = sparse ? m->sparse_tape.len : m->mem_tape.len;
+	int word_cells = WORD_BITS / m->cell_bits;
+
+	if (strip){
+		while (hi > lo && !mem_cell(m, hi - 1))
+			hi--;
+		while (lo + word_cells <= hi && !mem_read(m, lo))
+			lo += word_cells;
+	}
+
+	unsigned char h[BIN_HEADER_SIZE] = "TTAP";
+	put_le(h+4, BIN_VERSION, 4);
+	put_le(h+8, -lo, 8);
+	put_le(h+16, hi - lo, 8);
+	put_le(h+24, (long) m->buf_pos * m->buffer_size + m->position, 8);
+	put_le(h+32, m->state, 4);
+	put_le(h+36, m->cell_bits, 4);
+
+	// The tape's own file is written over from the start, and on the sparse tape emptied first so
+	// that the chunks it skips over read as zeroes; any other file or stream is written straight
+	// through
+	bool rewrite = fp == m->tapef;
+	bool holes = sparse && rewrite;
+	if (rewrite)
+		fseek(fp, 0, SEEK_SET);
+	int error = (holes && ftruncate(fileno(fp), 0) != 0) || fwrite(h, 1, BIN_HEADER_SIZE, fp) != BIN_HEADER_SIZE;
+	long written = BIN_HEADER_SIZE;
+
+	// Gather the words from either side of position 0 into a buffer, and write them out in bulk,
+	// or on the sparse tape, seek past a chunk with nothing on it
+	uint64_t chunk[JOIN_CHUNK / sizeof(uint64_t)];
+	int n = 0;
+	uint64_t any = 0;
+	for (long pos=lo; pos<hi && !error; pos+=word_cells){
+		any |= chunk[n++] = mem_read(m, pos);
+		if (n == JOIN_CHUNK / sizeof(uint64_t) || pos + word_cells >= hi){
+			swap_words(chunk, n);
+			if (holes && !any)
+				error = fseek(fp, sizeof(uint64_t) * n, SEEK_CUR) != 0;
+			else
+				error = fwrite(chunk, sizeof(uint64_t), n, fp) != (size_t) n;
+			written += sizeof(uint64_t) * n;
+			n = 0;
+			any = 0;
+		}
+	}
+
+	if (error || fflush(fp) == EOF || (rewrite && ftruncate(fileno(fp), written) != 0)){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	m->io.bytes_written += written;
+
+	return 0;
+}
+
+// Open the tape file, and work out its length and which format it is in
+static int open_tape(struct machine *m, char *fname){
+	if (!(m->tapef = fopen(fname, "rb+"))){
+		set_error(m, "Error: could not open file: %s.", fname);
+		return 1;
+	}
+
+	// Get the file's length in bytes, for later
+	fseek(m->tapef, 0, SEEK_END);
+	m->flen = ftell(m->tapef);
+
+	char magic[4];
+	fseek(m->tapef, 0, SEEK_SET);
+	m->binary_tape = fread(magic, 1, 4, m->tapef) == 4 && memcmp(magic, "TTAP", 4) == 0;
+	fseek(m->tapef, 0, SEEK_SET);
+
+	return 0;
+}
+
+static int load_tape(struct machine *m, char *fname){
+	// Without a file, the machine starts on a blank tape in memory which is never saved
+	if (!fname){
+		m->backend = BACKEND_MEMORY;
+		return (m->buffer = mem_block(m, 0)) == NULL;
+	}
+
+	if (open_tape(m, fname))
+		return 1;
+
+	if (m->sparse){
+		m->backend = BACKEND_SPARSE;
+		if (sparse_init(m) || (m->binary_tape ? load_bin_tape(m, m->tapef, m->flen) : load_sparse_tape(m, m->tapef)))
+			return 1;
+		sparse_enter(m);
+		return 0;
+	}
+
+	if (m->binary_tape){
+		m->backend = BACKEND_MEMORY;
+		if (load_bin_tape(m, m->tapef, m->flen))
+			return 1;
+		return (m->buffer = mem_block(m, m->buf_pos)) == NULL;
+	}
+
+	if (m->in_memory){
+		m->backend = BACKEND_MEMORY;
+		if (load_mem_tape(m, m->tapef))
+			return 1;
+		return (m->buffer = mem_block(m, 0)) == NULL;
+	}
+
+	if (m->mapped){
+		m->backend = BACKEND_MAP;
+		m->right_map.fd = fileno(m->tapef);
+		if (m->flen > 0){
+			m->right_map.cells = mmap(NULL, m->flen, PROT_READ | PROT_WRITE, MAP_SHARED, m->right_map.fd, 0);
+			if (m->right_map.cells == MAP_FAILED){
+				m->right_map.cells = NULL;
+				set_error(m, "Error: could not map tape file: %s.", fname);
+				return 1;
+			}
+			m->right_map.size = m->flen;
+		}
+
+		if (!m->map_buffer && !(m->map_buffer = malloc(sizeof(uint64_t) * m->buffer_words))){
+			set_error(m, "Error: out of memory for tape.");
+			return 1;
+		}
+		m->buffer = m->map_buffer;
+		return map_fetch(m, 0, m->buffer);
+	}
+
+	m->backend = BACKEND_FILE;
+	if (cache_init(m))
+		return 1;
+	if ((m->curr_slot = cache_fetch(m, 0)) == -1)
+		return 1;
+	m->buffer = m->cache.slots[m->curr_slot].bits;
+
+	return 0;
+}
+
+// Load the tape from in, a stream such as a pipe which is read through once, into memory, or the
+// sparse tape with --sparse. A binary tape begins with "TTAP" and an ASCII one with a cell, so the
+// first character tells them apart.
+static int load_stream(struct machine *m, FILE *in){
+	int c = getc(in);
+	if ((c == EOF && ferror(in)) || (c != EOF && ungetc(c, in) == EOF)){
+		set_error(m, "Error reading tape.");
+		return 1;
+	}
+	m->binary_tape = c == 'T';
+
+	if (m->sparse){
+		m->backend = BACKEND_SPARSE;
+		if (sparse_init(m) || (m->binary_tape ? load_bin_tape(m, in, -1) : load_sparse_tape(m, in)))
+			return 1;
+		sparse_enter(m);
+		return 0;
+	}
+
+	m->backend = BACKEND_MEMORY;
+	if (m->binary_tape ? load_bin_tape(m, in, -1) : load_mem_tape(m, in))
+		return 1;
+	return (m->buffer = mem_block(m, m->buf_pos)) == NULL;
+}
+
+// Find the number of symbols an ASCII tape needs, from the highest symbol on it, or -1 on error
+static int tape_symbols(struct machine *m){
+	char chunk[4096];
+	size_t got;
+	int high = 1;
+
+	fseek(m->tapef, 0, SEEK_SET);
+	while ((got = fread(chunk, 1, sizeof(chunk), m->tapef)) > 0){
+		for (size_t c=0; c<got; c++){
+			int val = cell_value(chunk[c]);
+			if (val < 0){
+				set_error(m, "Unrecognised character in tape: %c.", chunk[c]);
+				return -1;
+			}
+			if (val > high)
+				high = val;
+		}
+	}
+
+	return high + 1;
+}
+
+// Convert the tape in one file to the other format, and write it to another file
+int tm_convert(struct machine *m, char *in, char *out){
+	if (open_tape(m, in))
+		return 1;
+
+	// Without a table to go by, an ASCII tape is packed as tightly as its symbols allow
+	if (!m->binary_tape && !m->max_states){
+		int symbols = tape_symbols(m);
+		if (symbols < 0)
+			return 1;
+		set_symbols(m, symbols);
+		fseek(m->tapef, 0, SEEK_SET);
+	}
+	if (m->binary_tape ? load_bin_tape(m, m->tapef, m->flen) : load_mem_tape(m, m->tapef))
+		return 1;
+
+	FILE *fp = fopen(out, "wb");
+	if (!fp){
+		set_error(m, "Error: could not open file: %s.", out);
+		return 1;
+	}
+
+	// The ASCII format has no room for the head's position or state, so warn if they are lost
+	if (m->binary_tape && ((long) m->buf_pos * m->buffer_size + m->position != 0 || m->state != 0))
+		logprint(m, "WARNING: The head position and state saved in %s are not kept in ASCII.\n", in);
+
+	int error = m->binary_tape ? save_mem_tape(m, fp) : save_bin_tape(m, fp, false);
+
+	fclose(fp);
+	return error;
+}
+
+// Narrow the cells from *lo to *hi of the in-memory or sparse tape down to those from the first mark
+// to the last, a word at a time across the words with nothing on them, or to none if there are no
+// marks. *lo starts at the edge of a block.
+static void strip_range(struct machine *m, long *lo, long *hi){
+	int word_cells = WORD_BITS / m->cell_bits;
+
+	while (*lo + word_cells <= *hi && !mem_read(m, *lo))
+		*lo += word_cells;
+	while (*lo < *hi && !mem_cell(m, *lo))
+		(*lo)++;
+
+	while (*hi > *lo && *hi % word_cells && !mem_cell(m, *hi - 1))
+		(*hi)--;
+	while (*hi - word_cells >= *lo && *hi % word_cells == 0 && !mem_read(m, *hi - word_cells))
+		*hi -= word_cells;
+	while (*hi > *lo && !mem_cell(m, *hi - 1))
+		(*hi)--;
+}
+
+// Write the cells from lo to hi of the in-memory or sparse tape to fp as ASCII, a word at a time
+static int write_cells(struct machine *m, FILE *fp, long lo, long hi){
+	int word_cells = WORD_BITS / m->cell_bits;
+	uint64_t mask = (1u << m->cell_bits) - 1;
+	char *line = malloc(JOIN_CHUNK);
+	int error = !line;
+	long n = 0;
+
+	for (long pos=lo-(lo%word_cells+word_cells)%word_cells; pos<hi && !error; pos+=word_cells){
+		uint64_t word = mem_read(m, pos);
+		int from = pos < lo ? lo - pos : 0;
+		int to = hi - pos < word_cells ? hi - pos : word_cells;
+		for (int c=from; c<to; c++)
+			line[n++] = cell_chars[word >> (c * m->cell_bits) & mask];
+		if (n > JOIN_CHUNK - word_cells || pos + word_cells >= hi){
+			error = fwrite(line, 1, n, fp) != (size_t) n;
+			m->io.bytes_written += n;
+			n = 0;
+		}
+	}
+
+	free(line);
+	return error;
+}
+
+// Write the tape to the stream it was given with tm_read_tape(), in the format it was read in, and
+// stripped with strip_stream. The block under the head goes back to the sparse tape first, as for
+// save_tape().
+static int save_stream(struct machine *m){
+	if (m->backend == BACKEND_SPARSE){
+		if (sparse_leave(m))
+			return 1;
+		sparse_enter(m);
+	}
+	if (m->binary_tape)
+		return save_bin_tape(m, m->tape_out, m->strip_stream);
+
+	bool sparse = m->backend == BACKEND_SPARSE;
+	long lo = sparse ? (long) m->sparse_tape.low_block * m->buffer_size : -(long) m->mem_tape.left_blocks * m->buffer_size;
+	long hi = sparse ? m->sparse_tape.len : m->mem_tape.len;
+	if (m->strip_stream)
+		strip_range(m, &lo, &hi);
+
+	if (write_cells(m, m->tape_out, lo, hi) || fflush(m->tape_out) == EOF){
+		set_error(m, "Error writing to tape.");
+		return 1;
+	}
+	return 0;
+}
+
+static int save_tape(struct machine *m){
+	if (m->tape_out)
+		return save_stream(m);
+	if (!m->tapef)
+		return 0;
+	if (m->backend == BACKEND_MEMORY)
+		return m->binary_tape ? save_bin_tape(m, m->tapef, false) : save_mem_tape(m, m->tapef);
+
+	// The block under the head is put back in the table first, but the head is left on it
+	if (m->backend == BACKEND_SPARSE){
+		if (sparse_leave(m))
+			return 1;
+		sparse_enter(m);
+		return m->binary_tape ? save_bin_tape(m, m->tapef, false) : save_sparse_tape(m, m->tapef);
+	}
+
+	if (m->backend == BACKEND_MAP){
+		if (m->buffer_dirty && map_store(m, (long) m->buf_pos * m->buffer_size, m->buffer))
+			return 1;
+		m->buffer_dirty = false;
+		if (map_close(m))
+			return 1;
+		return join_left(m);
+	}
+
+	if (m->buffer_dirty){
+		m->cache.slots[m->curr_slot].dirty = true;
+		m->buffer_dirty = false;
+	}
+
+	if (async_stop(m) || cache_flush(m))
+		return 1;
+
+	return join_left(m);
+}
+
+// Strip the saved ASCII tape in place: find the first and the last mark a chunk at a time, from
+// either end, then move everything in between down to the start of the file, and cut the file off
+// after it. A tape with no marks on it is left empty.
+int tm_strip(struct machine *m){
+	if (!m->tapef)
+		return 0;
+	if (m->binary_tape)
+		return save_bin_tape(m, m->tapef, true);
+
+	char *chunk = malloc(JOIN_CHUNK);
+	if (!chunk){
+		set_error(m, "Error: out of memory for tape.");
+		return 1;
+	}
+
+	int error = fflush(m->tapef) == EOF || fseek(m->tapef, 0, SEEK_END) != 0;
+	long len = ftell(m->tapef);
+	long start = 0;
+	long end = len;
+
+	error |= fseek(m->tapef, 0, SEEK_SET) != 0;
+	while (!error && start < len){
+		long n = len - start < JOIN_CHUNK ? len - start : JOIN_CHUNK;
+		error = fread(chunk, 1, n, m->tapef) != (size_t) n;
+		long past = error ? 0 : scan_past(chunk, n, '0');
+		start += past;
+		if (past < n)
+			break;
+	}
+
+	while (!error && end > start){
+		long n = end - start < JOIN_CHUNK ? end - start : JOIN_CHUNK;
+		error = fseek(m->tapef, end - n, SEEK_SET) != 0 || fread(chunk, 1, n, m->tapef) != (size_t) n;
+		long last = error ? 0 : scan_back(chunk, n, '0');
+		end -= n - last;
+		if (last)
+			break;
+	}
+
+	// The tape only moves left, so each chunk is read before anything is written over it
+	for (long moved=0; start > 0 && moved < end - start && !error; ){
+		long n = end - start - moved < JOIN_CHUNK ? end - start - moved : JOIN_CHUNK;
+		error = fseek(m->tapef, start + moved, SEEK_SET) != 0 || fread(chunk, 1, n, m->tapef) != (size_t) n
+			|| fseek(m->tapef, moved, SEEK_SET) != 0 || fwrite(chunk, 1, n, m->tapef) != (size_t) n;
+		moved += n;
+	}
+
+	free(chunk);
+	if (error || fflush(m->tapef) == EOF || ftruncate(fileno(m->tapef), end - start) != 0){
+		set_error(m, "Error stripping the tape.");
+		return 1;
+	}
+	m->flen = end - start;
+
+	return 0;
+}
+
+double tm_clock(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Check the budgets once the steps taken reach check_at, and set when to check them next. Returns
+// true once either of them has run out.
+static bool budget_spent(struct machine *m, long steps, long *check_at){
+	if (m->step_limit && steps >= m->step_limit)
+		m->budget_hit = BUDGET_STEPS;
+	else if (m->timeout && tm_clock() >= m->deadline)
+		m->budget_hit = BUDGET_TIME;
+	if (m->budget_hit)
+		return true;
+
+	*check_at = m->timeout ? steps + TIME_CHECK_STEPS : LONG_MAX;
+	if (m->step_limit && *check_at > m->step_limit)
+		*check_at = m->step_limit;
+	return false;
+}
+
+/* The macro engine (--engine=macro) treats each aligned group of macro_k cells as a single symbol.
+ * The first time the head enters a group with a given state, offset within the group and group
+ * contents, the group is simulated step by step until the head leaves it or the machine stops, and
+ * the outcome is memoised in a hash table; after that, the whole visit is replayed in one lookup.
+ * macro_k is a power of two no bigger than MACRO_MAX_K, so that groups never straddle a word.
+ */
+
+static uint64_t macro_key(int mstate, int off, unsigned val){
+	return ((uint64_t) (mstate + 1) << 32) | ((uint64_t) off << 16) | val;
+}
+
+static long macro_slot(struct machine *m, uint64_t key){
+	return (key * 0x9E3779B97F4A7C15ull >> 20) & m->macro.mask;
+}
+
+static int macro_grow(struct machine *m){
+	long cap = m->macro.slots ? 2 * (m->macro.mask + 1) : 1 << 12;
+	struct macro_entry *old = m->macro.slots;
+	long old_cap = old ? m->macro.mask + 1 : 0;
+
+	if (!(m->macro.slots = calloc(cap, sizeof(struct macro_entry)))){
+		set_error(m, "Error: out of memory for macro transitions.");
+		m->macro.slots = old;
+		return 1;
+	}
+	m->macro.mask = cap - 1;
+
+	for (long i=0; i<old_cap; i++){
+		if (old[i].key){
+			long s = macro_slot(m, old[i].key);
+			while (m->macro.slots[s].key)
+				s = (s + 1) & m->macro.mask;
+			m->macro.slots[s] = old[i];
+		}
+	}
+	free(old);
+
+	return 0;
+}
+
+// Simulate one visit to a group from scratch. A visit that takes more steps than there are distinct
+// configurations of the group must be repeating itself, and so never leaves.
+static void macro_simulate(struct machine *m, struct macro_entry *e, int mstate, int off, unsigned val){
+	long limit = (long) m->max_states * m->macro_k << m->macro_k;
+
+	e->steps = 0;
+	e->kind = MACRO_LOOP;
+	while (e->steps <= limit){
+		bool bit = (val >> off) & 1;
+		struct op curr_op = m->instructions[mstate*2 + bit];
+
+		val = curr_op.val ? val | (1u << off) : val & ~(1u << off);
+		mstate = curr_op.state;
+		off += curr_op.dir ? 1 : -1;
+		e->steps++;
+
+		if (curr_op.stop){
+			e->kind = MACRO_HALT;
+			break;
+		}
+		if (off < 0 || off >= m->macro_k){
+			e->kind = MACRO_EXIT;
+			break;
+		}
+	}
+
+	e->val = val;
+	e->state = mstate;
+	e->off = off;
+}
+
+static struct macro_entry *macro_lookup(struct machine *m, int mstate, int off, unsigned val){
+	uint64_t key = macro_key(mstate, off, val);
+
+	long s = macro_slot(m, key);
+	while (m->macro.slots[s].key){
+		if (m->macro.slots[s].key == key)
+			return &m->macro.slots[s];
+		s = (s + 1) & m->macro.mask;
+	}
+
+	// Keep the table at most half full
+	if (2 * (m->macro.used + 1) > m->macro.mask + 1){
+		if (macro_grow(m))
+			return NULL;
+		return macro_lookup(m, mstate, off, val);
+	}
+
+	struct macro_entry *e = &m->macro.slots[s];
+	macro_simulate(m, e, mstate, off, val);
+	e->key = key;
+	m->macro.used++;
+
+	return e;
+}
+
+static int run_macro(struct machine *m){
+	unsigned mask = (1u << m->macro_k) - 1;
+	long steps = m->steps_run;
+	long check_at = 0;
+
+	// The budgets are checked between visits to groups, so may be overrun by one visit
+	while (true){
+		if (steps >= check_at && budget_spent(m, steps, &check_at))
+			break;
+
+		int off = m->position % m->macro_k;
+		int group = m->position - off;
+		uint64_t *word = &m->buffer[group / WORD_BITS];
+		int shift = group % WORD_BITS;
+		unsigned val = (*word >> shift) & mask;
+
+		struct macro_entry *e = macro_lookup(m, m->state, off, val);
+		if (!e)
+			return 1;
+
+		*word = (*word & ~((uint64_t) mask << shift)) | ((uint64_t) e->val << shift);
+		m->buffer_dirty |= e->val != val;
+		m->state = e->state;
+		m->position = group + e->off;
+		steps += e->steps;
+
+		// A visit that never leaves its group proves that the machine never halts
+		if (e->kind == MACRO_LOOP){
+			m->looping = true;
+			break;
+		}
+
+		if (m->position == m->buffer_size){
+			if (change_buf(m, m->buf_pos + 1))
+				return 1;
+			m->position = 0;
+		} else if (m->position == -1){
+			if (change_buf(m, m->buf_pos - 1))
+				return 1;
+			m->position = m->buffer_size - 1;
+		}
+
+		if (e->kind == MACRO_HALT){
+			m->halted = true;
+			logprint(m, "STOP reached after %ld steps, using %ld distinct macro transitions.\n", steps, m->macro.used);
+			break;
+		}
+	}
+
+	m->steps_run = steps;
+	return 0;
+}
+
+/* The block engine (--engine=block) works a whole block of the tape at a time. While the head
+ * stays in a block, where it goes depends only on the state and position it came in with and the
+ * block's contents, so the first time the head enters a block at either edge, the visit is stepped
+ * through as usual, and summarised as the side and state it left in, the steps it took and the
+ * contents it left behind. The summary is kept in a bounded cache, direct-mapped by a hash of the
+ * state, edge and contents, which newer summaries overwrite; the next time the head enters a block
+ * just like it, the whole visit is replayed by copying the contents over. The contents are kept in
+ * full and compared, so a summary only ever replays the very same visit.
+ *
+ * A visit that halts, or is cut short by the budgets, or starts away from the edges as the first
+ * one may, isn't summarised. A summary is only replayed if it fits in what is left of the budget of
+ * steps, so the machine stops on the exact step, as on the other engines.
+ */
+
+static int summary_alloc(struct machine *m){
+	if (!(m->summary.slots = calloc(m->summaries, sizeof(struct block_summary)))
+			|| !(m->summary.words = malloc(sizeof(uint64_t) * 2 * m->buffer_words * m->summaries))){
+		free(m->summary.slots);
+		m->summary.slots = NULL;
+		set_error(m, "Error: out of memory for block summaries.");
+		return 1;
+	}
+	return 0;
+}
+
+static uint64_t summary_hash(struct machine *m, uint32_t entry){
+	uint64_t h = (entry + 1) * 0x9E3779B97F4A7C15ull;
+	for (int i=0; i<m->buffer_words; i++){
+		h = (h ^ m->buffer[i]) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+	return h ? h : 1;
+}
+
+// Step the machine within the block under the head until the head leaves it, the machine halts,
+// or the steps taken reach limit, returning true if the head left. The head is left just past the
+// edge of the block, at -1 or buffer_size.
+static bool block_visit(struct machine *m, long *steps, long limit){
+	uint64_t *block = m->buffer;
+	struct op *table = m->instructions;
+	int symbols = m->symbols;
+	int bits = m->cell_bits;
+	int size = m->buffer_size;
+	int pos = m->position;
+	int state = m->state;
+	long n = *steps;
+	bool dirty = false;
+	bool left = false;
+
+	while (n < limit){
+		unsigned cell = get_cell(block, pos, bits);
+		struct op curr_op = table[state*symbols + cell];
+		dirty |= curr_op.val != cell;
+		set_cell(block, pos, curr_op.val, bits);
+		state = curr_op.state;
+		pos += curr_op.dir ? 1 : -1;
+		n++;
+
+		if (curr_op.stop)
+			m->halted = true;
+		if (pos == size || pos == -1)
+			left = true;
+		if (left || m->halted)
+			break;
+	}
+
+	m->state = state;
+	m->position = pos;
+	m->buffer_dirty |= dirty;
+	*steps = n;
+	return left;
+}
+
+static int run_blocks(struct machine *m){
+	int size = m->buffer_size;
+	int words = m->buffer_words;
+	long steps = m->steps_run;
+	long check_at = 0;
+
+	while (!(steps >= check_at && budget_spent(m, steps, &check_at))){
+		struct block_summary *e = NULL;
+		uint64_t *in = NULL;
+		bool at_edge = m->position == 0 || m->position == size - 1;
+		uint32_t entry = m->state * 2 + (m->position != 0);
+		uint64_t hash = 0;
+
+		m->summary.visits++;
+		if (at_edge){
+			hash = summary_hash(m, entry);
+			long slot = hash & (m->summaries - 1);
+			e = &m->summary.slots[slot];
+			in = m->summary.words + slot * 2 * words;
+		}
+
+		if (e && e->hash == hash && e->entry == entry && steps + e->steps <= check_at && memcmp(in, m->buffer, sizeof(uint64_t) * words) == 0){
+			memcpy(m->buffer, in + words, sizeof(uint64_t) * words);
+			m->buffer_dirty |= memcmp(in, in + words, sizeof(uint64_t) * words) != 0;
+			m->state = e->state;
+			m->position = e->right ? size : -1;
+			steps += e->steps;
+			m->summary.replayed++;
+		} else{
+			// The slot is taken over for this visit, and filled in only if it comes to an end
+			long before = steps;
+			if (e){
+				e->hash = 0;
+				memcpy(in, m->buffer, sizeof(uint64_t) * words);
+			}
+			bool left = block_visit(m, &steps, check_at);
+			if (e && left && !m->halted){
+				memcpy(in + words, m->buffer, sizeof(uint64_t) * words);
+				*e = (struct block_summary){hash, steps - before, entry, m->state, m->position == size};
+			}
+		}
+
+		if (m->position == size){
+			if (change_buf(m, m->buf_pos + 1))
+				return 1;
+			m->position = 0;
+		} else if (m->position == -1){
+			if (change_buf(m, m->buf_pos - 1))
+				return 1;
+			m->position = size - 1;
+		}
+
+		if (m->halted){
+			logprint(m, "STOP reached after %ld steps, with %ld of %ld visits to blocks replayed from summaries.\n", steps,
+				m->summary.replayed, m->summary.visits);
+			break;
+		}
+	}
+
+	m->steps_run = steps;
+	return 0;
+}
+
+/* The sweep engine (--engine=sweep) steps like the plain engine, except that when the instruction
+ * for the current state and bit is a self-loop, the head is moved across the whole run of that bit
+ * at once. The packed tape gives the length of a run a word at a time, by counting the trailing (or
+ * leading) bits that match, so the tape itself serves as its own run-length encoding.
+ */
+
+// Find the self-looping instructions in the table, returning the number found or -1 on error
+static int find_self_loops(struct machine *m){
+	int found = 0;
+
+	bool *loops = realloc(m->self_loop, sizeof(bool) * m->max_states * 2);
+	if (!loops){
+		set_error(m, "Error: out of memory.");
+		return -1;
+	}
+	m->self_loop = loops;
+
+	for (int s=0; s<m->max_states; s++){
+		for (int d=0; d<2; d++){
+			struct op curr_op = m->instructions[s*2 + d];
+			m->self_loop[s*2 + d] = curr_op.state == s && curr_op.val == d && !curr_op.stop;
+			found += m->self_loop[s*2 + d];
+		}
+	}
+
+	return found;
+}
+
+// Move the head across the run of cells equal to bit that it is on, in direction dir, but no more
+// than max cells, returning the number of cells crossed, or -1 on error. The head ends up on the
+// first cell that differs.
+static long sweep_run(struct machine *m, bool bit, bool dir, long max){
+	uint64_t flip = bit ? ~(uint64_t) 0 : 0;
+	long crossed = 0;
+
+	while (true){
+		int shift = m->position % WORD_BITS;
+		uint64_t *word = &m->buffer[m->position / WORD_BITS];
+
+		if (dir){
+			// Bits from the head rightwards that differ from bit, lowest first
+			uint64_t diff = (*word ^ flip) >> shift;
+			long n = diff ? __builtin_ctzll(diff) : WORD_BITS - shift;
+			if (n > max - crossed)
+				n = max - crossed;
+
+			m->position += n;
+			crossed += n;
+			if (m->position == m->buffer_size){
+				if (change_buf(m, m->buf_pos + 1))
+					return -1;
+				m->position = 0;
+			}
+			if (diff || crossed == max)
+				return crossed;
+		} else{
+			// Bits from the head leftwards that differ from bit, highest first
+			uint64_t diff = (*word ^ flip) << (WORD_BITS - 1 - shift);
+			long n = diff ? __builtin_clzll(diff) : shift + 1;
+			if (n > max - crossed)
+				n = max - crossed;
+
+			m->position -= n;
+			crossed += n;
+			if (m->position == -1){
+				if (change_buf(m, m->buf_pos - 1))
+					return -1;
+				m->position = m->buffer_size - 1;
+			}
+			if (diff || crossed == max)
+				return crossed;
+		}
+	}
+}
+
+/* With --trace-format=binary, the log file given with -o is replaced by a binary trace, which is
+ * far smaller and quicker to write than the text log. The trace is a header of TRACE_HEADER_SIZE
+ * bytes, all fields little-endian:
+ *   0  "TTRC"
+ *   4  u32 version, TRACE_VERSION
+ *   8  u32 size of a record, in bytes
+ *  12  u32 number of states
+ *  16  u32 engine, 1 for the sweep engine and 0 otherwise
+ *  20  u32 number of symbols (0 in older traces, meaning 2)
+ * then the instruction table, as 8 bytes for each state and symbol in the order of the table in
+ * memory: u32 new state, then a byte each for the symbol to write, the direction and STOP, and a
+ * reserved 0. After that come the records, one for
+ * each row the text log would have, which are gathered TRACE_RECORDS at a time in memory and
+ * written out in bulk. ./tape --decode-trace [TRACE] prints them back as the usual table.
+ */
+
+// Convert records between host order and the little-endian order of the file, in place
+static void swap_records(struct trace_record *recs, int n){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (int i=0; i<n; i++){
+		recs[i].step = __builtin_bswap64(recs[i].step);
+		recs[i].position = __builtin_bswap64(recs[i].position);
+		recs[i].state = __builtin_bswap32(recs[i].state);
+		recs[i].op = __builtin_bswap32(recs[i].op);
+		recs[i].repeat = __builtin_bswap32(recs[i].repeat);
+	}
+#else
+	(void) recs;
+	(void) n;
+#endif
+}
+
+// Write the header and instruction table to the trace file, and set up its buffer
+static int trace_open(struct machine *m, bool sweep){
+	unsigned char h[TRACE_HEADER_SIZE] = "TTRC";
+	put_le(h+4, TRACE_VERSION, 4);
+	put_le(h+8, sizeof(struct trace_record), 4);
+	put_le(h+12, m->max_states, 4);
+	put_le(h+16, sweep, 4);
+	put_le(h+20, m->symbols, 4);
+	int error = fwrite(h, 1, TRACE_HEADER_SIZE, m->trace_stream) != TRACE_HEADER_SIZE;
+
+	for (long i=0; i<(long) m->max_states * m->symbols && !error; i++){
+		struct op curr_op = m->instructions[i];
+		unsigned char e[8];
+		put_le(e, curr_op.state, 4);
+		e[4] = curr_op.val;
+		e[5] = curr_op.dir;
+		e[6] = curr_op.stop;
+		e[7] = 0;
+		error = fwrite(e, 1, 8, m->trace_stream) != 8;
+	}
+
+	if (error){
+		set_error(m, "Error writing to trace.");
+		return 1;
+	}
+
+	if (!m->trace_out.recs && !(m->trace_out.recs = calloc(TRACE_RECORDS, sizeof(struct trace_record)))){
+		set_error(m, "Error: out of memory.");
+		return 1;
+	}
+	m->trace_out.used = 0;
+
+	return 0;
+}
+
+static void trace_flush(struct machine *m){
+	swap_records(m->trace_out.recs, m->trace_out.used);
+	if (fwrite(m->trace_out.recs, sizeof(struct trace_record), m->trace_out.used, m->trace_stream) != (size_t) m->trace_out.used)
+		m->trace_out.error = true;
+	m->trace_out.used = 0;
+}
+
+// Add a row to the trace. Errors are only reported once the trace is closed, to keep them out of
+// the step loop.
+static inline void trace_add(struct machine *m, long steps, long pos, int st, unsigned bit, bool sweep, long repeat){
+	// A sweep too long for one record is split across several
+	while (repeat > UINT32_MAX){
+		trace_add(m, steps, pos, st, bit, true, UINT32_MAX);
+		steps += UINT32_MAX;
+		pos += m->instructions[st*m->symbols + bit].dir ? UINT32_MAX : -(long) UINT32_MAX;
+		repeat -= UINT32_MAX;
+	}
+
+	if (m->trace_out.used == TRACE_RECORDS)
+		trace_flush(m);
+
+	struct trace_record *r = &m->trace_out.recs[m->trace_out.used++];
+	r->step = steps;
+	r->position = pos;
+	r->state = st;
+	r->op = st*m->symbols + bit;
+	r->repeat = repeat;
+	r->bit = bit;
+	r->sweep = sweep;
+}
+
+// Write out the records gathered so far
+static int trace_finish(struct machine *m){
+	trace_flush(m);
+
+	if (m->trace_out.error || fflush(m->trace_stream) == EOF){
+		set_error(m, "Error writing to trace.");
+		return 1;
+	}
+
+	return 0;
+}
+
+// Print one row of the execution table to the log
+static void log_step(struct machine *m, int st, long pos, unsigned bit, bool sweep, long repeat){
+	logprint(m, "| %-13d| %-9ld| %-4x| ", st, pos, bit);
+	print_instruc(m, st, bit);
+	if (sweep)
+		logprint(m, " (x%ld)", repeat);
+	logprint(m, "\n");
+}
+
+static void log_header(struct machine *m){
+	logprint(m, "Execution:\n");
+	logprint(m, "|Machine state | Position | Bit | Instruction\n");
+	logprint(m, "|=================================================\n");
+}
+
+// Print a binary trace back out to the log, as the table of the text log
+int tm_decode_trace(struct machine *m, char *fname){
+	FILE *fp = fopen(fname, "rb");
+	unsigned char h[TRACE_HEADER_SIZE];
+
+	if (!fp){
+		set_error(m, "Error: could not open file: %s.", fname);
+		return 1;
+	}
+
+	if (fread(h, 1, TRACE_HEADER_SIZE, fp) != TRACE_HEADER_SIZE || memcmp(h, "TTRC", 4) != 0
+			|| get_le(h+4, 4) != TRACE_VERSION || get_le(h+8, 4) != sizeof(struct trace_record)){
+		set_error(m, "Error: %s is not a binary trace.", fname);
+		fclose(fp);
+		return 1;
+	}
+
+	unsigned long states = get_le(h+12, 4);
+	bool sweep = get_le(h+16, 4);
+	unsigned long symbols = get_le(h+20, 4) ? get_le(h+20, 4) : 2;
+	tmb_unmap(m);
+	int error = states == 0 || states > MAX_STATES || symbols < 2 || symbols > MAX_SYMBOLS
+		|| !(m->instructions = realloc(m->instructions, sizeof(struct op) * states * symbols));
+	m->symbols = symbols;
+
+	for (unsigned long i=0; i<states * symbols && !error; i++){
+		unsigned char e[8];
+		error = fread(e, 1, 8, fp) != 8 || get_le(e, 4) >= states || e[4] >= symbols;
+		if (!error)
+			m->instructions[i] = (struct op){get_le(e, 4), e[4], e[5], e[6]};
+	}
+
+	struct trace_record *recs = error ? NULL : malloc(TRACE_RECORDS * sizeof(struct trace_record));
+	if (!error && !recs){
+		set_error(m, "Error: out of memory.");
+		error = 1;
+	} else if (error){
+		set_error(m, "Error: corrupt trace: %s.", fname);
+	}
+
+	// Render the records a buffer at a time to the log, through the same functions as a text trace
+	if (!error)
+		log_header(m);
+
+	size_t n;
+	struct trace_record last = {0};
+	while (!error && (n = fread(recs, sizeof(struct trace_record), TRACE_RECORDS, fp)) > 0){
+		swap_records(recs, n);
+		for (size_t i=0; i<n; i++){
+			if (recs[i].state >= states || recs[i].bit >= symbols || recs[i].op != recs[i].state*symbols + recs[i].bit){
+				set_error(m, "Error: corrupt trace: %s.", fname);
+				error = 1;
+				break;
+			}
+			log_step(m, recs[i].state, recs[i].position, recs[i].bit, recs[i].sweep, recs[i].repeat);
+		}
+		if (!error)
+			last = recs[n-1];
+	}
+
+	if (!error && last.repeat && m->instructions[last.state*symbols + last.bit].stop)
+		logprint(m, sweep ? "STOP reached after %ld steps.\n" : "STOP reached.\n", (long) (last.step + last.repeat));
+
+	free(recs);
+	fclose(fp);
+	return error;
+}
+
+/* With --detect-loops, the plain and sweep engines look out for translated cycles, as described
+ * above struct cycle_watch. Suppose the head reaches a new record at the right end in state s, and
+ * later another in the same state, with the same word of cells up to the head, having never gone
+ * back to the left of those in between. Everything to the right of either record is blank, so the
+ * same steps that took the machine from the first to the second will take it from the second to a
+ * third just as far again, and so on forever. The same goes for records at the left end.
+ *
+ * The check itself is kept out of the step loop, which only compares the head's position in the
+ * block with bounds from watch_bounds(), and calls watch_check() when they are crossed.
+ */
+
+// Set the watches up at the start of a run. Nothing beyond the tape as loaded can be anything but
+// blank.
+static void watch_init(struct machine *m){
+	long at = tm_position(m);
+	long left = 0;
+	long right = m->flen;
+
+	if (m->backend == BACKEND_MEMORY){
+		left = -(long) m->mem_tape.left_blocks * m->buffer_size;
+		right = m->mem_tape.len;
+	} else if (m->backend == BACKEND_SPARSE){
+		left = (long) m->sparse_tape.low_block * m->buffer_size;
+		right = m->sparse_tape.len;
+	}
+	m->watch[0] = (struct cycle_watch){.edge = at < left ? at : left, .next = 1};
+	m->watch[1] = (struct cycle_watch){.edge = at > right - 1 ? at : right - 1, .next = 1};
+}
+
+// The word of cells of a block from start rightwards, lowest first
+static inline uint64_t block_window(uint64_t *block, int start, int bits){
+	uint64_t *word = &block[start * bits / WORD_BITS];
+	int shift = start * bits % WORD_BITS;
+
+	return shift ? word[0] >> shift | word[1] << (WORD_BITS - shift) : word[0];
+}
+
+// Check the watches when the head moves to the cell at, which is pos in the block, returning true
+// once the machine is proven never to halt
+static bool watch_check(struct machine *m, long at, int state, uint64_t *block, int pos, long steps){
+	int word_cells = WORD_BITS / m->cell_bits;
+
+	for (int side=0; side<2; side++){
+		struct cycle_watch *w = &m->watch[side];
+		long reach = side ? w->position - (word_cells - 1) : w->position + (word_cells - 1);
+
+		// Not a record, but the snapshot is no good once the head reads a cell outside its window
+		if (side ? at <= w->edge : at >= w->edge){
+			if (w->taken && (side ? at < reach : at > reach))
+				w->taken = false;
+			continue;
+		}
+		w->edge = at;
+
+		// The window is the cell under the head and those behind it, so long as they are all in
+		// this block
+		int start = side ? pos - (word_cells - 1) : pos;
+		bool fits = start >= 0 && start + word_cells <= m->buffer_size;
+		uint64_t window = fits ? block_window(block, start, m->cell_bits) : 0;
+
+		if (fits && w->taken && w->state == state && w->window == window){
+			m->looping = true;
+			m->loop_period = steps - w->steps;
+			m->loop_shift = at - w->position;
+			return true;
+		}
+
+		// Retake the snapshot when the records reach the next power of two, or the first record
+		// after that whose window fits in the block
+		if (++w->records >= w->next && fits)
+			*w = (struct cycle_watch){w->edge, 0, 2 * w->next, true, state, at, steps, window};
+	}
+
+	return false;
+}
+
+// Set the bounds on the head's position in the current block, below lo or above hi, outside which
+// watch_check() has to be called
+static void watch_bounds(struct machine *m, int *lo, int *hi){
+	long base = (long) m->buf_pos * m->buffer_size;
+	long low = m->watch[0].edge;
+	long high = m->watch[1].edge;
+	int word_cells = WORD_BITS / m->cell_bits;
+
+	if (m->watch[1].taken && m->watch[1].position - (word_cells - 1) > low)
+		low = m->watch[1].position - (word_cells - 1);
+	if (m->watch[0].taken && m->watch[0].position + (word_cells - 1) < high)
+		high = m->watch[0].position + (word_cells - 1);
+
+	*lo = low - base < -1 ? -1 : low - base > m->buffer_size ? m->buffer_size : low - base;
+	*hi = high - base < -1 ? -1 : high - base > m->buffer_size ? m->buffer_size : high - base;
+}
+
+/* Run the machine one step at a time, logging every step; or with the sweep engine, every step
+ * outside of a sweep, and each sweep as a single step with the number of times it repeats. With
+ * count, the instructions taken and the extent of the head are counted as well, and with undo,
+ * each step is recorded in the undo log.
+ *
+ * step_loop() is always inlined into run_steps() with constant arguments, so the compiler produces
+ * a separate loop for each combination of trace and sweeping, and the silent ones carry no trace
+ * of the log at all, nor of loop detection unless it is asked for. The silent loops are also made
+ * for each width of cell, so that a binary machine's table is indexed by state*2 + bit, as it
+ * always was. The state, position, block and dirty flag are kept in locals while stepping, and
+ * only written back to the machine when the buffer has to be changed or the machine stops. The
+ * counting loop is only made once, with none of its arguments constant, since counting costs more
+ * than the branches it saves. The undo log costs a single store to each step, and the silent loops
+ * are only made again with it for the plain engine, which is the only one that keeps it.
+ */
+enum{TRACE_OFF, TRACE_TEXT, TRACE_BINARY};
+
+static ALWAYS_INLINE int step_loop(struct machine *m, const int trace, const bool sweep, const bool detect, const int bits,
+		const bool count, const bool undo){
+	struct op *table = m->instructions;
+	struct op curr_op;
+	unsigned bit;
+	int symbols = bits == 1 ? 2 : m->symbols;
+	long steps = m->steps_run;
+	long check_at = 0;
+
+	int curr_state = m->state;
+	int pos = m->position;
+	int size = m->buffer_size;
+	uint64_t *block = m->buffer;
+	bool dirty = false;
+	int lo, hi;
+	long *hits = m->stats.hits;
+	long min_pos = m->stats.min_pos;
+	long max_pos = m->stats.max_pos;
+	long base = (long) m->buf_pos * size;
+	uint32_t *undo_log = m->undo.log;
+	long undo_mask = m->undo_steps - 1;
+	long first = steps;
+
+	if (detect)
+		watch_bounds(m, &lo, &hi);
+
+	while (true){
+		if (steps >= check_at && budget_spent(m, steps, &check_at))
+			break;
+
+		bit = get_cell(block, pos, bits);
+
+		if (sweep && m->self_loop[curr_state*2 + bit]){
+			long start = (long) m->buf_pos * size + pos;
+			bool dir = table[curr_state*2 + bit].dir;
+
+			// A sweep over blank cells out past everything the head has visited would go on forever,
+			// so a sweep over zeroes is cut short at the edge to see if it gets there
+			long max = m->step_limit ? m->step_limit - steps : LONG_MAX;
+			if (detect && !bit){
+				long edge = m->watch[dir].edge;
+				if (dir ? start >= edge : start <= edge){
+					m->looping = true;
+					m->loop_period = 1;
+					m->loop_shift = dir ? 1 : -1;
+					break;
+				}
+				if (labs(edge - start) < max)
+					max = labs(edge - start);
+			}
+
+			m->position = pos;
+			m->buffer_dirty |= dirty;
+			dirty = false;
+			long n = sweep_run(m, bit, dir, max);
+			if (n < 0)
+				return 1;
+			pos = m->position;
+			block = m->buffer;
+			if (count){
+				hits[curr_state*2 + bit] += n;
+				base = (long) m->buf_pos * size;
+				min_pos = base + pos < min_pos ? base + pos : min_pos;
+				max_pos = base + pos > max_pos ? base + pos : max_pos;
+			}
+
+			if (trace == TRACE_TEXT)
+				log_step(m, curr_state, start, bit, true, n);
+			else if (trace == TRACE_BINARY)
+				trace_add(m, steps, start, curr_state, bit, true, n);
+			steps += n;
+
+			if (detect){
+				watch_bounds(m, &lo, &hi);
+				if ((pos > hi || pos < lo) && watch_check(m, (long) m->buf_pos * size + pos, curr_state, block, pos, steps))
+					break;
+				watch_bounds(m, &lo, &hi);
+			}
+			continue;
+		}
+
+		if (trace == TRACE_TEXT)		// Print to log
+			log_step(m, curr_state, (long) m->buf_pos * size + pos, bit, false, 1);
+		else if (trace == TRACE_BINARY)
+			trace_add(m, steps, (long) m->buf_pos * size + pos, curr_state, bit, false, 1);
+
+		// Execute the operation
+		curr_op = table[curr_state*symbols + bit];
+		if (count)
+			hits[curr_state*symbols + bit]++;
+		if (undo)
+			undo_log[steps & undo_mask] = (uint32_t) curr_state << 5 | bit << 1 | curr_op.dir;
+		curr_state = curr_op.state;
+		dirty |= curr_op.val != bit;
+		set_cell(block, pos, curr_op.val, bits);
+		pos += curr_op.dir ? 1 : -1;
+		steps++;
+		if (count){
+			min_pos = base + pos < min_pos ? base + pos : min_pos;
+			max_pos = base + pos > max_pos ? base + pos : max_pos;
+		}
+
+		// Manage the position: move the buffer, stop. etc. The buffer is moved even on STOP, so
+		// that the bit reported at the final position is really the one under the head.
+		if (pos == size || pos == -1){
+			m->buffer_dirty |= dirty;
+			dirty = false;
+
+			// Move on to the block one to the right, or do the same but to the left
+			if (change_buf(m, pos == size ? m->buf_pos + 1 : m->buf_pos - 1))
+				return 1;
+			pos = pos == size ? 0 : size - 1;
+			block = m->buffer;
+			base = (long) m->buf_pos * size;
+			if (detect)
+				watch_bounds(m, &lo, &hi);
+		}
+
+		if (curr_op.stop){
+			m->halted = true;
+			if (trace == TRACE_TEXT)
+				logprint(m, sweep ? "STOP reached after %ld steps.\n" : "STOP reached.\n", steps);
+			break;
+		}
+
+		if (detect && (pos > hi || pos < lo)){
+			if (watch_check(m, (long) m->buf_pos * size + pos, curr_state, block, pos, steps))
+				break;
+			watch_bounds(m, &lo, &hi);
+		}
+	}
+
+	m->state = curr_state;
+	m->position = pos;
+	m->buffer_dirty |= dirty;
+	m->steps_run = steps;
+	m->stats.min_pos = min_pos;
+	m->stats.max_pos = max_pos;
+	if (undo)
+		m->undo.held = m->undo.held + steps - first < m->undo_steps ? m->undo.held + steps - first : m->undo_steps;
+
+	return 0;
+}
+
+// The silent loops of the plain engine, for cells of the given width. Loop detection isn't done
+// along with the undo log, which would leave the watches behind when it is wound back.
+static ALWAYS_INLINE int plain_loop(struct machine *m, const int bits){
+	if (m->undo.log)
+		return step_loop(m, TRACE_OFF, false, false, bits, false, true);
+	return m->detect_loops ? step_loop(m, TRACE_OFF, false, true, bits, false, false) : step_loop(m, TRACE_OFF, false, false, bits, false, false);
+}
+
+static int run_steps(struct machine *m){
+	bool sweep = m->engine == ENGINE_SWEEP;
+	bool detect = m->detect_loops;
+	bool undo = m->undo.log != NULL;
+	int bits = m->cell_bits;
+
+	// Logging costs far more than the check for loop detection or the width of a cell, so only
+	// silent runs have loops of their own for those. The sweep engine only runs binary machines.
+	if (m->count_stats){
+		int trace = m->trace_stream ? TRACE_BINARY : m->log_stream ? TRACE_TEXT : TRACE_OFF;
+		int error = step_loop(m, trace, sweep, detect, bits, true, undo);
+		return m->trace_stream ? trace_finish(m) || error : error;
+	}
+	if (m->trace_stream){
+		int error = sweep ? step_loop(m, TRACE_BINARY, true, detect, 1, false, false) : step_loop(m, TRACE_BINARY, false, detect, bits, false, undo);
+		return trace_finish(m) || error;
+	}
+	if (m->log_stream)
+		return sweep ? step_loop(m, TRACE_TEXT, true, detect, 1, false, false) : step_loop(m, TRACE_TEXT, false, detect, bits, false, undo);
+	if (sweep)
+		return detect ? step_loop(m, TRACE_OFF, true, true, 1, false, false) : step_loop(m, TRACE_OFF, true, false, 1, false, false);
+	if (bits == 4)
+		return plain_loop(m, 4);
+	if (bits == 2)
+		return plain_loop(m, 2);
+	return plain_loop(m, 1);
+}
+
+/* With the compiled engine, the table is translated into C with a label for each state, which reads
+ * the bit under the head with a single test and branches to the operation for either bit, written
+ * out in full with its write, move and jump to the next state; the block, position and step count
+ * are locals the compiler keeps in registers. Only a move off either end of the block calls back
+ * into the library, to change_buf(). The C is compiled by $CC (or cc) in a temporary directory into
+ * a shared object, which is loaded with dlopen() and the files removed, the first time the machine
+ * is stepped.
+ *
+ * The compiled code and the library share a struct jit_run, whose fields are written out once in
+ * JIT_RUN_FIELDS so that the same text can be given to the compiler. The code returns when the
+ * machine halts or the step count reaches limit, and the budgets are then checked as by the other
+ * engines, between stretches of no more than TIME_CHECK_STEPS when there is a timeout.
+ */
+#define JIT_RUN_FIELDS \
+	uint64_t *block; long steps; long limit; int pos; int state; int size; int dirty; int halted; \
+	void *machine; int (*move)(void *machine, int right, void *run);
+#define JIT_STRINGIFY(x) #x
+#define JIT_TEXT(x) JIT_STRINGIFY(x)
+
+struct jit_run{
+	JIT_RUN_FIELDS
+};
+
+// Write the C for the table to fp
+static void jit_write(struct machine *m, FILE *fp){
+	fprintf(fp, "#include <stdint.h>\nstruct jit_run{%s};\n\nint tm_jit(struct jit_run *r){\n", JIT_TEXT(JIT_RUN_FIELDS));
+	fprintf(fp, "\tuint64_t *block = r->block;\n\tlong steps = r->steps;\n\tlong limit = r->limit;\n\tint pos = r->pos;\n\tint size = r->size;\n");
+	fprintf(fp, "\tint dirty = 0;\n\tint state;\n\n\tswitch (r->state){\n");
+	for (int s=0; s<m->max_states; s++)
+		fprintf(fp, "\tcase %d: goto s%d;\n", s, s);
+	fprintf(fp, "\t}\n");
+
+	for (int s=0; s<m->max_states; s++){
+		fprintf(fp, "s%d:\n\tif (steps == limit){\n\t\tstate = %d;\n\t\tgoto out;\n\t}\n", s, s);
+		fprintf(fp, "\tif (block[pos >> 6] >> (pos & 63) & 1){\n");
+		for (int d=1; d>=0; d--){
+			struct op o = m->instructions[s*2 + d];
+			if (o.val != d)
+				fprintf(fp, "\t\tblock[pos >> 6] ^= (uint64_t) 1 << (pos & 63);\n\t\tdirty = 1;\n");
+			fprintf(fp, "\t\tsteps++;\n");
+			if (o.dir)
+				fprintf(fp, "\t\tif (++pos == size){\n\t\t\tr->dirty |= dirty;\n\t\t\tdirty = 0;\n\t\t\tif (r->move(r->machine, 1, r))\n"
+					"\t\t\t\treturn 1;\n\t\t\tblock = r->block;\n\t\t\tpos = 0;\n\t\t}\n");
+			else
+				fprintf(fp, "\t\tif (--pos < 0){\n\t\t\tr->dirty |= dirty;\n\t\t\tdirty = 0;\n\t\t\tif (r->move(r->machine, 0, r))\n"
+					"\t\t\t\treturn 1;\n\t\t\tblock = r->block;\n\t\t\tpos = size - 1;\n\t\t}\n");
+			if (o.stop)
+				fprintf(fp, "\t\tstate = %u;\n\t\tr->halted = 1;\n\t\tgoto out;\n", (unsigned) o.state);
+			else
+				fprintf(fp, "\t\tgoto s%u;\n", (unsigned) o.state);
+			fprintf(fp, d ? "\t} else{\n" : "\t}\n");
+		}
+	}
+
+	fprintf(fp, "out:\n\tr->block = block;\n\tr->steps = steps;\n\tr->pos = pos;\n\tr->state = state;\n\tr->dirty |= dirty;\n\treturn 0;\n}\n");
+}
+
+// Generate, compile and load the code for the table, returning 1 on error
+static int jit_compile(struct machine *m){
+	char dir[] = "/tmp/tape-jit-XXXXXX";
+	char src[sizeof(dir) + 8];
+	char obj[sizeof(dir) + 8];
+	char *cc = getenv("CC") && *getenv("CC") ? getenv("CC") : "cc";
+	FILE *fp;
+
+	if (!mkdtemp(dir)){
+		set_error(m, "Error: could not make a directory to compile the table in.");
+		return 1;
+	}
+	snprintf(src, sizeof(src), "%s/jit.c", dir);
+	snprintf(obj, sizeof(obj), "%s/jit.so", dir);
+
+	int error = !(fp = fopen(src, "w"));
+	if (!error){
+		jit_write(m, fp);
+		error = ferror(fp) | (fclose(fp) == EOF);
+	}
+	if (error){
+		set_error(m, "Error: could not write the code for the table.");
+	} else{
+		// The compiler's own messages go nowhere, since the library prints nothing
+		pid_t pid = fork();
+		if (pid == 0){
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			execlp(cc, cc, "-O2", "-shared", "-fPIC", "-o", obj, src, (char *) NULL);
+			_exit(127);
+		}
+		int wstatus;
+		if (pid < 0 || waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0){
+			set_error(m, "Error: could not compile the table with %s.", cc);
+			error = 1;
+		} else if (!(m->jit.handle = dlopen(obj, RTLD_NOW | RTLD_LOCAL)) || !(m->jit.run = (int (*)(void *)) dlsym(m->jit.handle, "tm_jit"))){
+			set_error(m, "Error: could not load the compiled table: %s.", dlerror());
+			error = 1;
+		}
+	}
+
+	remove(src);
+	remove(obj);
+	rmdir(dir);
+	return error;
+}
+
+// Move the compiled code's head onto the next block, by the means of the tape
+static int jit_move(void *machine, int right, void *run){
+	struct machine *m = machine;
+	struct jit_run *r = run;
+
+	m->buffer_dirty |= r->dirty;
+	r->dirty = 0;
+	if (change_buf(m, m->buf_pos + (right ? 1 : -1)))
+		return 1;
+	r->block = m->buffer;
+	return 0;
+}
+
+static int run_compiled(struct machine *m){
+	struct jit_run r = {m->buffer, m->steps_run, 0, m->position, m->state, m->buffer_size, 0, 0, m, jit_move};
+	long check_at = 0;
+	int error = 0;
+
+	while (!error && !r.halted && !budget_spent(m, r.steps, &check_at)){
+		r.limit = check_at;
+		error = m->jit.run(&r);
+	}
+
+	m->state = r.state;
+	m->position = r.pos;
+	m->steps_run = r.steps;
+	m->buffer_dirty |= r.dirty;
+	m->halted = r.halted;
+
+	return error;
+}
+
+
+/* Checkpoints are kept in two files. The blocks file holds the blocks of the in-memory tape, each
+ * packed into buffer_words little-endian words, in a pair of slots to each block. The checkpoint
+ * file says which slot holds each block, along with the rest of the machine, in a header of
+ * CKPT_HEADER_SIZE bytes, all little-endian:
+ *   0  "TCKP"
+ *   4  u32 version, CKPT_VERSION
+ *   8  u32 cells per block
+ *  12  u32 state
+ *  16  i64 steps taken
+ *  24  i64 head position
+ *  32  i64 blocks to the left of position 0
+ *  40  i64 blocks from position 0 rightwards
+ *  48  i64 cells from position 0 rightwards to write back
+ *  56  u32 bits to a cell
+ *  60  u32 reserved, 0
+ * followed by a u32 slot for each block, from the leftmost.
+ *
+ * A block changed since the last checkpoint is written to whichever of its slots that checkpoint
+ * doesn't use, so the last checkpoint stays whole until the new one replaces it. That is done by
+ * writing it to a temporary file and renaming it over the old one, once the blocks are safely on
+ * disk; so however the process dies, the checkpoint file is either the old one or the new.
+ */
+
+static int ckpt_write_blocks(struct machine *m){
+	uint64_t *words = malloc(sizeof(uint64_t) * m->buffer_words);
+	int error = !words;
+
+	for (int b=-m->mem_tape.left_blocks; b<m->mem_tape.right_blocks && !error; b++){
+		uint32_t *e = ckpt_entry(m, b);
+		if (!e){
+			error = 1;
+			break;
+		}
+		uint32_t last = *e & ~CKPT_CHANGED;
+		if (last && !(*e & CKPT_CHANGED))
+			continue;
+
+		uint32_t slot = last ? (last - 1) ^ 1 : 2 * m->ckpt.pairs++;
+		// Not through mem_block(), which would count the block as visited
+		uint64_t *block = b >= 0 ? m->mem_tape.right + (long) b * m->buffer_words : m->mem_tape.left + (long) (-b - 1) * m->buffer_words;
+		memcpy(words, block, sizeof(uint64_t) * m->buffer_words);
+		swap_words(words, m->buffer_words);
+		error = fseek(m->ckpt.blocks, (long) slot * m->buffer_words * sizeof(uint64_t), SEEK_SET) != 0
+			|| fwrite(words, sizeof(uint64_t), m->buffer_words, m->ckpt.blocks) != (size_t) m->buffer_words;
+		*e = slot + 1;
+	}
+
+	free(words);
+	if (error || fflush(m->ckpt.blocks) == EOF || fsync(fileno(m->ckpt.blocks)) != 0){
+		set_error(m, "Error writing checkpoint blocks.");
+		return 1;
+	}
+
+	return 0;
+}
+
+int tm_checkpoint(struct machine *m, char *fname){
+	char path[PATH_MAX];
+
+	if (m->backend != BACKEND_MEMORY || !m->buffer || m->saved){
+		set_error(m, "Error: checkpoints can only be taken of a tape held in memory, while it runs.");
+		return 1;
+	}
+
+	if (!m->ckpt.blocks){
+		snprintf(path, sizeof(path), "%s.blocks", fname);
+		if (!(m->ckpt.blocks = fopen(path, "wb+"))){
+			set_error(m, "Error: could not open file: %s.", path);
+			return 1;
+		}
+	}
+
+	// The block under the head is marked as it is left, so it hasn't been yet
+	if (m->buffer_dirty){
+		uint32_t *e = ckpt_entry(m, m->buf_pos);
+		if (!e)
+			return 1;
+		*e |= CKPT_CHANGED;
+		m->buffer_dirty = false;
+	}
+	if (ckpt_write_blocks(m))
+		return 1;
+
+	unsigned char h[CKPT_HEADER_SIZE] = "TCKP";
+	put_le(h+4, CKPT_VERSION, 4);
+	put_le(h+8, m->buffer_size, 4);
+	put_le(h+12, m->state, 4);
+	put_le(h+16, m->steps_run, 8);
+	put_le(h+24, (long) m->buf_pos * m->buffer_size + m->position, 8);
+	put_le(h+32, m->mem_tape.left_blocks, 8);
+	put_le(h+40, m->mem_tape.right_blocks, 8);
+	put_le(h+48, m->mem_tape.len, 8);
+	put_le(h+56, m->cell_bits, 4);
+	put_le(h+60, 0, 4);
+
+	snprintf(path, sizeof(path), "%s.tmp", fname);
+	FILE *fp = fopen(path, "wb");
+	if (!fp){
+		set_error(m, "Error: could not open file: %s.", path);
+		return 1;
+	}
+	int error = fwrite(h, 1, CKPT_HEADER_SIZE, fp) != CKPT_HEADER_SIZE;
+	for (int b=-m->mem_tape.left_blocks; b<m->mem_tape.right_blocks && !error; b++){
+		unsigned char slot[4];
+		put_le(slot, *ckpt_entry(m, b) - 1, 4);
+		error = fwrite(slot, 1, 4, fp) != 4;
+	}
+	error |= fflush(fp) == EOF || fsync(fileno(fp)) != 0;
+	error |= fclose(fp) != 0;
+
+	if (error || rename(path, fname) != 0){
+		set_error(m, "Error writing checkpoint: %s.", fname);
+		return 1;
+	}
+
+	return 0;
+}
+
+int tm_resume(struct machine *m, char *fname){
+	char path[PATH_MAX];
+	unsigned char h[CKPT_HEADER_SIZE];
+
+	if (m->backend != BACKEND_MEMORY || !m->buffer || m->started){
+		set_error(m, "Error: a checkpoint can only be resumed on a fresh tape held in memory.");
+		return 1;
+	}
+
+	FILE *fp = fopen(fname, "rb");
+	if (!fp){
+		set_error(m, "Error: could not open file: %s.", fname);
+		return 1;
+	}
+	if (fread(h, 1, CKPT_HEADER_SIZE, fp) != CKPT_HEADER_SIZE || memcmp(h, "TCKP", 4) != 0 || get_le(h+4, 4) != CKPT_VERSION){
+		set_error(m, "Error: unsupported checkpoint: %s.", fname);
+		fclose(fp);
+		return 1;
+	}
+
+	long head = get_le(h+24, 8);
+	long left_blocks = get_le(h+32, 8);
+	long right_blocks = get_le(h+40, 8);
+	long len = get_le(h+48, 8);
+	if (get_le(h+8, 4) != (uint64_t) m->buffer_size){
+		set_error(m, "Error: the checkpoint has blocks of %d cells, so needs -b %d.", (int) get_le(h+8, 4), (int) get_le(h+8, 4));
+		fclose(fp);
+		return 1;
+	}
+	if (left_blocks < m->mem_tape.left_blocks || right_blocks < m->mem_tape.right_blocks || left_blocks > INT_MAX || right_blocks > INT_MAX
+			|| get_le(h+56, 4) != (uint64_t) m->cell_bits
+			|| get_le(h+12, 4) >= (uint64_t) m->max_states || len > right_blocks * m->buffer_size
+			|| head < -left_blocks * m->buffer_size || head >= right_blocks * m->buffer_size){
+		set_error(m, "Error: the checkpoint %s is not of this tape and table.", fname);
+		fclose(fp);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s.blocks", fname);
+	if (!(m->ckpt.blocks = fopen(path, "rb+"))){
+		set_error(m, "Error: could not open file: %s.", path);
+		fclose(fp);
+		return 1;
+	}
+
+	// Read each block back from its slot into the in-memory tape
+	int error = 0;
+	for (long b=-left_blocks; b<right_blocks && !error; b++){
+		unsigned char slot[4];
+		uint32_t *e = ckpt_entry(m, b);
+		uint64_t *block = mem_block(m, b);
+		if (!e || !block){
+			fclose(fp);
+			return 1;
+		}
+
+		uint32_t s = fread(slot, 1, 4, fp) == 4 ? get_le(slot, 4) : UINT32_MAX;
+		error = s == UINT32_MAX || fseek(m->ckpt.blocks, (long) s * m->buffer_words * sizeof(uint64_t), SEEK_SET) != 0
+			|| fread(block, sizeof(uint64_t), m->buffer_words, m->ckpt.blocks) != (size_t) m->buffer_words;
+		swap_words(block, m->buffer_words);
+		*e = s + 1;
+		if (s / 2 >= m->ckpt.pairs)
+			m->ckpt.pairs = s / 2 + 1;
+	}
+	fclose(fp);
+	if (error){
+		set_error(m, "Error reading checkpoint: %s.", fname);
+		return 1;
+	}
+
+	m->mem_tape.len = len;
+	m->state = get_le(h+12, 4);
+	m->steps_run = get_le(h+16, 8);
+	m->buf_pos = head >= 0 ? head / m->buffer_size : -((-head + m->buffer_size - 1) / m->buffer_size);
+	m->position = head - (long) m->buf_pos * m->buffer_size;
+	m->buffer_dirty = false;
+	return (m->buffer = mem_block(m, m->buf_pos)) == NULL;
+}
+
+
+/* The undo log holds the last undo_steps steps of the plain engine, each as the state it was taken
+ * in, the symbol under the head and the way the head moved, packed into 32 bits as state << 5 |
+ * symbol << 1 | dir. That is all it takes to wind a step back: the head moves back onto the cell it
+ * wrote, the symbol is put back and the state restored. Further back than that, tm_goto() starts
+ * again from a snapshot, a copy of the whole in-memory tape and the machine taken by tm_snapshot(),
+ * and steps forward from there; the machine is deterministic, so every snapshot stays good however
+ * often it is gone back over.
+ */
+
+long tm_undo(struct machine *m, long n){
+	if (!m->buffer || m->saved){
+		set_error(m, "Error: there is no tape loaded to run the machine on.");
+		return -1;
+	}
+	if (n > m->undo.held)
+		n = m->undo.held;
+
+	for (long i=0; i<n; i++){
+		uint32_t r = m->undo.log[(m->steps_run - 1) & (m->undo_steps - 1)];
+		int pos = m->position + (r & 1 ? -1 : 1);
+		if (pos < 0 || pos == m->buffer_size){
+			if (change_buf(m, pos < 0 ? m->buf_pos - 1 : m->buf_pos + 1))
+				return -1;
+			pos = pos < 0 ? m->buffer_size - 1 : 0;
+		}
+		m->position = pos;
+		set_cell(m->buffer, pos, r >> 1 & 15, m->cell_bits);
+		m->buffer_dirty = true;
+		m->state = r >> 5;
+		m->steps_run--;
+		m->undo.held--;
+		m->halted = false;
+	}
+
+	return n;
+}
+
+int tm_snapshot(struct machine *m){
+	struct snapshot *shots = m->undo.shots;
+	long words = m->buffer_words;
+	int at = m->undo.shots_used;
+
+	if (m->backend != BACKEND_MEMORY || !m->buffer || m->saved){
+		set_error(m, "Error: snapshots can only be taken of a tape held in memory, while it runs.");
+		return 1;
+	}
+
+	// Snapshots are kept in order of their steps, so that one gone back over isn't taken twice,
+	// and the oldest makes way for a new one once they are all used
+	while (at > 0 && shots[at-1].steps >= m->steps_run){
+		if (shots[at-1].steps == m->steps_run)
+			return 0;
+		at--;
+	}
+	if (m->undo.shots_used == SNAPSHOTS && at == 0)
+		return 0;
+
+	// The copies go in the oldest snapshot once they are all used, or the next spare one
+	struct snapshot *s = &shots[m->undo.shots_used == SNAPSHOTS ? 0 : m->undo.shots_used];
+	uint64_t *right = realloc(s->right, sizeof(uint64_t) * words * (m->mem_tape.right_blocks + 1));
+	if (right)
+		s->right = right;
+	uint64_t *left = right ? realloc(s->left, sizeof(uint64_t) * words * (m->mem_tape.left_blocks + 1)) : NULL;
+	if (left)
+		s->left = left;
+	if (!right || !left){
+		set_error(m, "Error: out of memory for a snapshot.");
+		return 1;
+	}
+
+	struct snapshot spare = *s;
+	if (m->undo.shots_used == SNAPSHOTS){
+		memmove(shots, shots + 1, sizeof(struct snapshot) * --at);
+	} else{
+		memmove(shots + at + 1, shots + at, sizeof(struct snapshot) * (m->undo.shots_used - at));
+		m->undo.shots_used++;
+	}
+	s = &shots[at];
+	*s = spare;
+
+	if (m->mem_tape.right)
+		memcpy(s->right, m->mem_tape.right, sizeof(uint64_t) * words * m->mem_tape.right_blocks);
+	if (m->mem_tape.left)
+		memcpy(s->left, m->mem_tape.left, sizeof(uint64_t) * words * m->mem_tape.left_blocks);
+	s->right_blocks = m->mem_tape.right_blocks;
+	s->left_blocks = m->mem_tape.left_blocks;
+	s->len = m->mem_tape.len;
+	s->steps = m->steps_run;
+	s->head = tm_position(m);
+	s->state = m->state;
+	s->halted = m->halted;
+	return 0;
+}
+
+// Put the tape and the machine back as they were at the snapshot s. The tape has only grown since,
+// so the blocks it has grown by are blanked again.
+static void snapshot_restore(struct machine *m, struct snapshot *s){
+	long words = m->buffer_words;
+
+	if (m->mem_tape.right){
+		memset(m->mem_tape.right + words * s->right_blocks, 0, sizeof(uint64_t) * words * (m->mem_tape.right_blocks - s->right_blocks));
+		memcpy(m->mem_tape.right, s->right, sizeof(uint64_t) * words * s->right_blocks);
+	}
+	if (m->mem_tape.left){
+		memset(m->mem_tape.left + words * s->left_blocks, 0, sizeof(uint64_t) * words * (m->mem_tape.left_blocks - s->left_blocks));
+		memcpy(m->mem_tape.left, s->left, sizeof(uint64_t) * words * s->left_blocks);
+	}
+	m->mem_tape.right_blocks = s->right_blocks;
+	m->mem_tape.left_blocks = s->left_blocks;
+	m->mem_tape.len = s->len;
+
+	// The undo log still holds the steps from before the snapshot
+	long oldest = m->steps_run - m->undo.held;
+	m->undo.held = s->steps > oldest ? s->steps - oldest : 0;
+
+	m->state = s->state;
+	m->steps_run = s->steps;
+	m->halted = s->halted;
+	m->buf_pos = s->head >= 0 ? s->head / m->buffer_size : -((-s->head + m->buffer_size - 1) / m->buffer_size);
+	m->position = s->head - (long) m->buf_pos * m->buffer_size;
+	m->buffer = mem_block(m, m->buf_pos);
+	m->buffer_dirty = false;
+}
+
+int tm_goto(struct machine *m, long step){
+	if (!m->buffer || m->saved){
+		set_error(m, "Error: there is no tape loaded to run the machine on.");
+		return TM_ERROR;
+	}
+	if (step >= m->steps_run)
+		return tm_step(m, step - m->steps_run);
+	if (step >= m->steps_run - m->undo.held)
+		return tm_undo(m, m->steps_run - step) < 0 ? TM_ERROR : TM_RUNNING;
+
+	for (int i=m->undo.shots_used-1; i>=0; i--){
+		if (m->undo.shots[i].steps <= step){
+			snapshot_restore(m, &m->undo.shots[i]);
+			return tm_step(m, step - m->steps_run);
+		}
+	}
+	set_error(m, "Error: step %ld is further back than the undo log and the snapshots go.", step);
+	return TM_ERROR;
+}
+
+int tm_cell(struct machine *m, long pos){
+	if (m->backend != BACKEND_MEMORY || !m->buffer){
+		set_error(m, "Error: only the cells of a tape held in memory can be read.");
+		return -1;
+	}
+
+	// Not through mem_block(), which would count the block as visited
+	int blk = pos >= 0 ? pos / m->buffer_size : -((-pos + m->buffer_size - 1) / m->buffer_size);
+	if (blk >= m->mem_tape.right_blocks || -blk > m->mem_tape.left_blocks)
+		return 0;
+	uint64_t *block = blk >= 0 ? m->mem_tape.right + (long) blk * m->buffer_words : m->mem_tape.left + (long) (-blk - 1) * m->buffer_words;
+	return get_cell(block, pos - (long) blk * m->buffer_size, m->cell_bits);
+}
+
+int tm_copy_blocks(struct machine *m, int first, int last, uint64_t *out){
+	long words = m->buffer_words;
+
+	if (m->backend != BACKEND_MEMORY || !m->buffer){
+		set_error(m, "Error: only the blocks of a tape held in memory can be copied.");
+		return 1;
+	}
+	for (long b=first; b<=last; b++, out+=words){
+		if (b >= m->mem_tape.right_blocks || -b > m->mem_tape.left_blocks)
+			memset(out, 0, sizeof(uint64_t) * words);
+		else
+			memcpy(out, b >= 0 ? m->mem_tape.right + b * words : m->mem_tape.left + (-b - 1) * words, sizeof(uint64_t) * words);
+	}
+	return 0;
+}
+
+/* The interface of the library, as declared in libtape.h. */
+
+void tm_init(struct machine *m){
+	memset(m, 0, sizeof(*m));
+	m->log_stream = NULL;
+	m->buffer_size = BUFFER_SIZE;
+	m->buffer_words = BUFFER_SIZE / WORD_BITS;
+	m->symbols = 2;
+	m->cell_bits = 1;
+	m->cache_blocks = CACHE_BLOCKS;
+	m->engine = ENGINE_PLAIN;
+	m->macro_k = 8;
+	m->summaries = BLOCK_SUMMARIES;
+	m->table_cache = true;
+	m->right_map.fd = -1;
+	m->left_map.fd = -1;
+	m->sparse_tape.free_slot = -1;
+}
+
+// Close the tape files, and forget the tape and the run, but keep everything allocated
+void tm_reset(struct machine *m){
+	async_stop(m);
+	if (m->jit.handle)
+		dlclose(m->jit.handle);
+	m->jit.handle = NULL;
+	m->jit.run = NULL;
+	if (m->right_map.cells)
+		munmap(m->right_map.cells, m->right_map.size);
+	if (m->left_map.cells)
+		munmap(m->left_map.cells, m->left_map.size);
+	m->right_map = m->left_map = (struct tape_map){NULL, 0, -1};
+	if (m->tapef)
+		fclose(m->tapef);
+	if (m->leftf)
+		fclose(m->leftf);
+	if (m->ckpt.blocks)
+		fclose(m->ckpt.blocks);
+	m->tapef = m->leftf = m->ckpt.blocks = NULL;
+	m->tape_out = NULL;
+
+	// The in-memory tape and the memo table are cleared for the next run, so that they can be
+	// reused without being allocated again. Blocks beyond those used are already zero.
+	if (m->mem_tape.right)
+		memset(m->mem_tape.right, 0, sizeof(uint64_t) * m->buffer_words * m->mem_tape.right_blocks);
+	if (m->mem_tape.left)
+		memset(m->mem_tape.left, 0, sizeof(uint64_t) * m->buffer_words * m->mem_tape.left_blocks);
+	m->mem_tape.right_blocks = m->mem_tape.left_blocks = 0;
+	m->mem_tape.len = 0;
+	if (m->sparse_tape.table){
+		for (long b=0; b<=m->sparse_tape.mask; b++)
+			m->sparse_tape.table[b].slot = -1;
+	}
+	if (m->sparse_tape.blank)
+		memset(m->sparse_tape.blank, 0, sizeof(uint64_t) * m->buffer_words);
+	m->sparse_tape.used = m->sparse_tape.slots = 0;
+	m->sparse_tape.free_slot = -1;
+	m->sparse_tape.low_block = 0;
+	m->sparse_tape.len = 0;
+	if (m->ckpt.right)
+		memset(m->ckpt.right, 0, sizeof(uint32_t) * m->ckpt.right_cap);
+	if (m->ckpt.left)
+		memset(m->ckpt.left, 0, sizeof(uint32_t) * m->ckpt.left_cap);
+	m->ckpt.pairs = 0;
+	if (m->macro.slots)
+		memset(m->macro.slots, 0, sizeof(struct macro_entry) * (m->macro.mask + 1));
+	m->macro.used = 0;
+
+	// The block summaries are as big as the blocks, which the next table may change the width of
+	free(m->summary.slots);
+	free(m->summary.words);
+	m->summary.slots = NULL;
+	m->summary.words = NULL;
+	m->summary.visits = m->summary.replayed = 0;
+
+	// So is the undo log, to the undo_steps of the next run; the snapshots are kept for their memory
+	free(m->undo.log);
+	m->undo.log = NULL;
+	m->undo.held = 0;
+	m->undo.shots_used = 0;
+	m->trace_out.used = 0;
+	m->trace_out.error = false;
+
+	m->position = m->buf_pos = m->state = 0;
+	m->flen = m->left_len = m->left_added = 0;
+	m->binary_tape = false;
+	m->buffer = NULL;
+	m->buffer_dirty = false;
+	m->steps_run = 0;
+	m->seconds = 0;
+	m->budget_hit = BUDGET_NONE;
+	m->started = m->halted = m->saved = false;
+	m->looping = false;
+	m->loop_period = m->loop_shift = 0;
+	m->io.block_loads = m->io.block_stores = m->io.bytes_read = m->io.bytes_written = 0;
+	m->io.left_extensions = m->io.low_block = 0;
+	m->io.prefetches = m->io.prefetch_hits = m->io.stalls = 0;
+	m->stats.min_pos = m->stats.max_pos = 0;
+	m->stats.load_seconds = m->stats.block_seconds = m->stats.save_seconds = 0;
+	m->error[0] = '\0';
+}
+
+void tm_free(struct machine *m){
+	tm_reset(m);
+	tmb_unmap(m);
+	free(m->instructions);
+	free(m->mem_tape.right);
+	free(m->mem_tape.left);
+	free(m->cache.slots);
+	free(m->cache.bits);
+	free(m->cache.hash);
+	free(m->cache.scratch);
+	free(m->map_buffer);
+	free(m->sparse_tape.table);
+	free(m->sparse_tape.bits);
+	free(m->sparse_tape.blank);
+	free(m->macro.slots);
+	free(m->self_loop);
+	free(m->trace_out.recs);
+	free(m->ckpt.right);
+	free(m->ckpt.left);
+	for (int i=0; i<SNAPSHOTS; i++){
+		free(m->undo.shots[i].right);
+		free(m->undo.shots[i].left);
+	}
+	free(m->stats.hits);
+	tm_init(m);
+}
+
+int tm_load_table(struct machine *m, char *fname){
+	return load_instrucs(m, fname);
+}
+
+int tm_set_table(struct machine *m, struct op *ops, int states, int symbols){
+	if (states < 1 || states > MAX_STATES || symbols < 2 || symbols > MAX_SYMBOLS){
+		set_error(m, "Error: a table must have between 1 and %d states and between 2 and %d symbols.", MAX_STATES, MAX_SYMBOLS);
+		return 1;
+	}
+	set_symbols(m, symbols);
+
+	tmb_unmap(m);
+	struct op *table = realloc(m->instructions, sizeof(struct op) * states * symbols);
+	if (!table){
+		set_error(m, "Error: out of memory.");
+		return 1;
+	}
+	m->instructions = table;
+	m->max_states = states;
+	memcpy(table, ops, sizeof(struct op) * states * symbols);
+
+	return 0;
+}
+
+int tm_load_tape(struct machine *m, char *fname){
+	if (!m->instructions){
+		set_error(m, "Error: the instruction table must be loaded before the tape.");
+		return 1;
+	}
+	double start = tm_clock();
+	int error = load_tape(m, fname);
+	m->stats.load_seconds += tm_clock() - start;
+	return error;
+}
+
+int tm_read_tape(struct machine *m, FILE *in, FILE *out){
+	if (!m->instructions){
+		set_error(m, "Error: the instruction table must be loaded before the tape.");
+		return 1;
+	}
+	m->tape_out = out;
+	double start = tm_clock();
+	int error = load_stream(m, in);
+	m->stats.load_seconds += tm_clock() - start;
+	return error;
+}
+
+static char *engine_name(enum engine engine){
+	return engine == ENGINE_MACRO ? "macro" : engine == ENGINE_SWEEP ? "sweep" : engine == ENGINE_COMPILED ? "compiled"
+		: engine == ENGINE_BLOCK ? "block" : "plain";
+}
+
+// Get the engine ready the first time the machine is stepped
+static int engine_start(struct machine *m){
+	if (m->started)
+		return 0;
+	m->started = true;
+	m->deadline = tm_clock() + m->timeout;
+	if (m->detect_loops)
+		watch_init(m);
+	if (m->async_io && m->backend == BACKEND_FILE)
+		async_start(m);
+
+	// The tape may already reach out to the left, from a binary tape or a checkpoint
+	int low = m->backend == BACKEND_SPARSE ? m->sparse_tape.low_block : -m->mem_tape.left_blocks;
+	m->io.low_block = m->buf_pos < low ? m->buf_pos : low;
+	if (m->count_stats){
+		long n = (long) m->max_states * m->symbols;
+		if (n > m->stats.hits_cap){
+			long *hits = realloc(m->stats.hits, sizeof(long) * n);
+			if (!hits){
+				set_error(m, "Error: out of memory for statistics.");
+				return 1;
+			}
+			m->stats.hits = hits;
+			m->stats.hits_cap = n;
+		}
+		memset(m->stats.hits, 0, sizeof(long) * n);
+		m->stats.min_pos = m->stats.max_pos = tm_position(m);
+	}
+
+	// The undo log is only kept by the plain engine, and wound back a step at a time
+	if (m->undo_steps){
+		if (m->engine != ENGINE_PLAIN || m->detect_loops){
+			set_error(m, "Error: only the plain engine keeps an undo log, and it can't detect loops as well.");
+			return 1;
+		}
+		if (!(m->undo.log = malloc(sizeof(uint32_t) * m->undo_steps))){
+			set_error(m, "Error: out of memory for the undo log.");
+			return 1;
+		}
+	}
+
+	// The macro, sweep and compiled engines read the tape a bit at a time
+	if (m->engine != ENGINE_PLAIN && m->engine != ENGINE_BLOCK && m->symbols != 2){
+		set_error(m, "Error: the %s engine only runs machines with two symbols.", engine_name(m->engine));
+		return 1;
+	}
+
+	if (m->engine == ENGINE_COMPILED){
+		if (m->log_stream || m->trace_stream || m->detect_loops){
+			set_error(m, "Error: the compiled engine only runs silently, and can't detect loops.");
+			return 1;
+		}
+		return m->jit.run ? 0 : jit_compile(m);
+	}
+
+	if (m->engine == ENGINE_BLOCK){
+		if (m->trace_stream || m->detect_loops){
+			set_error(m, "Error: the block engine can't write a binary trace or detect loops.");
+			return 1;
+		}
+		logprint(m, "Execution, in visits to blocks of %d cells which are not logged individually:\n", m->buffer_size);
+		return m->summary.slots ? 0 : summary_alloc(m);
+	}
+
+	if (m->engine == ENGINE_MACRO){
+		logprint(m, "Execution, in macro steps of %d cells which are not logged individually:\n", m->macro_k);
+		return m->macro.slots ? 0 : macro_grow(m);
+	}
+
+	if (m->engine == ENGINE_SWEEP){
+		int found = find_self_loops(m);
+		if (found < 0)
+			return 1;
+		logprint(m, "Sweeping over runs of cells for %d self-looping instruction(s).\n", found);
+	}
+
+	if (m->trace_stream)
+		return trace_open(m, m->engine == ENGINE_SWEEP);
+	log_header(m);
+
+	return 0;
+}
+
+int tm_step(struct machine *m, long n){
+	if (m->halted)
+		return TM_HALTED;
+	if (m->looping)
+		return TM_LOOPING;
+	if (!m->buffer || m->saved){
+		set_error(m, "Error: there is no tape loaded to run the machine on.");
+		return TM_ERROR;
+	}
+	if (n == 0)
+		return TM_RUNNING;
+	if (engine_start(m))
+		return TM_ERROR;
+
+	// Stop after n more steps, or at the budget if that comes first
+	m->step_limit = m->max_steps;
+	if (n > 0 && (!m->step_limit || m->steps_run + n < m->step_limit))
+		m->step_limit = m->steps_run + n;
+	m->budget_hit = BUDGET_NONE;
+
+	double start = tm_clock();
+	int error = m->engine == ENGINE_MACRO ? run_macro(m) : m->engine == ENGINE_COMPILED ? run_compiled(m)
+		: m->engine == ENGINE_BLOCK ? run_blocks(m) : run_steps(m);
+	m->seconds += tm_clock() - start;
+
+	if (error)
+		return TM_ERROR;
+	if (m->halted)
+		return TM_HALTED;
+	if (m->looping)
+		return TM_LOOPING;
+	if (m->budget_hit == BUDGET_TIME || (m->max_steps && m->steps_run >= m->max_steps))
+		return TM_STOPPED;
+
+	m->budget_hit = BUDGET_NONE;
+	return TM_RUNNING;
+}
+
+int tm_save(struct machine *m){
+	if (m->saved || !m->buffer)
+		return 0;
+	m->saved = true;
+	double start = tm_clock();
+	int error = save_tape(m);
+	m->stats.save_seconds += tm_clock() - start;
+	return error;
+}
+
+int tm_run(struct machine *m){
+	int status = tm_step(m, -1);
+	if (status != TM_ERROR && tm_save(m))
+		return TM_ERROR;
+	return status;
+}
+
+int tm_state(struct machine *m){
+	return m->state;
+}
+
+long tm_position(struct machine *m){
+	return (long) m->buf_pos * m->buffer_size + m->position;
+}
+
+int tm_bit(struct machine *m){
+	return m->buffer ? get_cell(m->buffer, m->position, m->cell_bits) : 0;
+}
+
+long tm_marks(struct machine *m){
+	long words = m->buffer_words;
+
+	if (m->backend == BACKEND_MEMORY && m->buffer)
+		return count_marks(m->mem_tape.right, words * m->mem_tape.right_blocks, m->cell_bits)
+			+ count_marks(m->mem_tape.left, words * m->mem_tape.left_blocks, m->cell_bits);
+
+	if (m->backend == BACKEND_SPARSE && m->buffer){
+		long marks = m->sparse_tape.on_blank ? count_marks(m->sparse_tape.blank, words, m->cell_bits) : 0;
+		for (long b=0; b<=m->sparse_tape.mask; b++){
+			if (m->sparse_tape.table[b].slot != -1)
+				marks += count_marks(m->sparse_tape.bits + (long) m->sparse_tape.table[b].slot * words, words, m->cell_bits);
+		}
+		return marks;
+	}
+
+	// The file-backed and mapped tapes are only all in the file once they have been saved
+	if ((m->backend == BACKEND_FILE || m->backend == BACKEND_MAP) && m->saved && m->tapef && !m->binary_tape){
+		char *chunk = malloc(JOIN_CHUNK);
+		long marks = 0;
+		size_t got;
+		if (!chunk || fseek(m->tapef, 0, SEEK_SET) != 0){
+			free(chunk);
+			set_error(m, "Error: out of memory for tape.");
+			return -1;
+		}
+		while ((got = fread(chunk, 1, JOIN_CHUNK, m->tapef)) > 0)
+			marks += count_other(chunk, got, '0');
+		free(chunk);
+		return marks;
+	}
+
+	set_error(m, "Error: only a tape held in memory, or saved to its file, can be counted.");
+	return -1;
+}
+
+long tm_steps(struct machine *m){
+	return m->steps_run;
+}
+
+double tm_seconds(struct machine *m){
+	return m->seconds;
+}
+
+char *tm_error(struct machine *m){
+	return m->error;
+}
@@ -0,0 +1,498 @@
+/* libtape.h — the interface to libtape.c, the Turing machine of tape.c as a library.
+ *
+ * A machine is set up with tm_init(), given its options by setting the fields at the top of
+ * struct machine, then loaded with an instruction table and a tape and run, either in one go or a
+ * number of steps at a time. tm_reset() readies it for another table and tape while keeping the
+ * memory it has allocated, and tm_free() releases it. Nothing in the library exits the process or
+ * prints to stdout: functions return an error, whose message tm_error() gives, and the only
+ * output is the log and trace streams the machine is given.
+ */
+
+#ifndef LIBTAPE_H
+#define LIBTAPE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define BUFFER_SIZE 128
+#define CACHE_BLOCKS 16
+#define ASYNC_JOBS 8
+#define MACRO_MAX_K 16
+#define BLOCK_SUMMARIES 65536
+#define UNDO_STEPS (1 << 20)
+#define SNAPSHOTS 8
+#define WORD_BITS 64
+#define MAX_STATES (1 << 24)
+#define MAX_SYMBOLS 16
+
+// What tm_step() and tm_run() return
+#define TM_HALTED 0			// The machine reached STOP
+#define TM_ERROR 1
+#define TM_STOPPED 2		// The machine ran out of the budget of max_steps or timeout
+#define TM_RUNNING 3		// The machine took the steps asked of it, and can carry on
+#define TM_LOOPING 4		// The machine was proven never to halt
+
+// The instruction list is captured by a flat array of operations to carry out, one for each state
+// and symbol, with the operation for state s and symbol d at s*symbols + d. Each operation packs a
+// new state to enter, a symbol to write, a bit representing left (0) or right (1), and a bit for
+// stopping into 32 bits, so that a step takes a single load, and even a table of thousands of
+// states stays in the cache.
+struct op{
+	uint32_t state : 24;
+	uint32_t val : 4;
+	uint32_t dir : 1;
+	uint32_t stop : 1;
+};
+
+// The file-backed tape keeps the cache_blocks most recently used blocks in memory (CACHE_BLOCKS
+// unless set with -n), so that a machine oscillating across a block boundary doesn't go back to
+// the file each time. Slots are found by block number through a chained hash table, and kept in
+// least-recently-used order by a doubly-linked list. A block is only written back when it is
+// evicted or the machine stops, and only if it has been changed.
+struct cache_slot{
+	int blk;
+	bool dirty;
+	int next_hash;
+	int prev;
+	int next;
+	uint64_t *bits;
+};
+
+// With -m, the tape file and the left file are mapped into memory instead, and change_buf() packs
+// and unpacks blocks straight from the mapping, leaving the OS to write the pages back. The files
+// are grown with ftruncate() MAP_CHUNK bytes at a time as the head runs past their ends, and cut
+// back to the length of tape actually used once the machine stops.
+struct tape_map{
+	char *cells;
+	long size;
+	int fd;
+};
+
+// With --async-io, the file-backed tape hands its reads and writes to an I/O thread, ASYNC_JOBS of
+// them at a time. A block evicted from the cache is copied into a job to be written behind, and the
+// block beyond the one the head has just moved into is read ahead into another, so that the machine
+// only waits on the thread for a block that is in neither. A job that reads a block which is written
+// after it was queued is stale, and is never used.
+enum{JOB_FREE, JOB_QUEUED, JOB_RUNNING, JOB_DONE};
+
+struct io_job{
+	int state;
+	bool write;
+	bool stale;
+	bool ahead;			// Read ahead, rather than for a block the machine is waiting on
+	int blk;
+	long seq;			// Jobs are done in the order they were queued
+	uint64_t *bits;
+};
+
+// With --sparse, the tape is held in memory as only the blocks with something other than 0 on
+// them, in an open-addressed hash table of block numbers, each giving the slot of its block in a
+// pool. A slot of -1 marks an empty bucket.
+struct sparse_entry{
+	int blk;
+	int slot;
+};
+
+// The memo table of the macro engine, an open-addressed hash table of visits to groups of macro_k
+// cells, keyed by the state, offset and contents of the group on entering it
+struct macro_entry{
+	uint64_t key;		// Zero for an empty slot
+	long steps;
+	uint32_t state;		// State on leaving the group
+	uint16_t val;		// Contents of the group on leaving it
+	char kind;			// MACRO_EXIT, MACRO_HALT or MACRO_LOOP
+	int8_t off;			// Offset of the head on leaving, from -1 to macro_k
+};
+
+// A summary of the block engine, of one visit to a whole block, entered at one edge or the other.
+// The cache of them is direct-mapped by a hash of the state and edge on entering and the block's
+// contents, which are kept alongside each slot, along with the contents on leaving.
+struct block_summary{
+	uint64_t hash;		// Zero for an empty slot
+	long steps;
+	uint32_t entry;		// The state on entering, times two, plus one if entered on the right
+	uint32_t state;		// State on leaving
+	bool right;			// Whether the head left on the right
+};
+
+// A snapshot of the in-memory tape and the machine, taken with tm_snapshot() for tm_goto() to go
+// back to, with copies of mem_tape's blocks
+struct snapshot{
+	uint64_t *right;
+	uint64_t *left;
+	int right_blocks;
+	int left_blocks;
+	long len;
+	long steps;
+	long head;
+	int state;
+	bool halted;
+};
+
+// One step, or one sweep, of a binary trace, laid out as in the file
+struct trace_record{
+	uint64_t step;		// Steps taken before this one
+	int64_t position;
+	uint32_t state;
+	uint32_t op;		// Index of the instruction carried out, state*symbols + bit
+	uint32_t repeat;	// Cells crossed, for a sweep
+	uint8_t bit;		// The symbol read
+	uint8_t sweep;
+	uint8_t reserved[2];
+};
+
+// With detect_loops, the plain and sweep engines watch for translated cycles, in which the head
+// drifts off into blank tape repeating the same steps: each time it reaches a cell further out
+// than any before, on either side, the state and the word of cells behind the head are compared
+// with a snapshot taken at an earlier such record. The snapshot is retaken after 1, 2, 4, ...
+// records, as in Brent's cycle-finding algorithm, and dropped if the head strays further back
+// than the cells it holds.
+struct cycle_watch{
+	long edge;			// The furthest cell out that may not be blank
+	long records;		// Records since the snapshot was taken
+	long next;			// The number of records at which to take the next
+	bool taken;
+	int state;
+	long position;
+	long steps;
+	uint64_t window;
+};
+
+enum engine{ENGINE_PLAIN, ENGINE_MACRO, ENGINE_SWEEP, ENGINE_COMPILED, ENGINE_BLOCK};
+enum backend{BACKEND_FILE, BACKEND_MEMORY, BACKEND_MAP, BACKEND_SPARSE};
+enum budget{BUDGET_NONE, BUDGET_STEPS, BUDGET_TIME};
+
+/* Everything about one machine and its tape is held in a struct machine, so that any number can
+ * run side by side. The first group of fields are the options it runs with, which tm_init() sets
+ * to their defaults and which may be changed before the table and tape are loaded; the rest is the
+ * state of the run itself, which is best left to the tm_ functions. The block and cache sizes
+ * can't be changed once a tape has been loaded, short of tm_free().
+ */
+struct machine{
+	FILE *log_stream;	// Where to write the log, or NULL for none (the default)
+	FILE *trace_stream;	// Where to write a binary trace instead, or NULL for none
+	int buffer_size;	// Cells per block, BUFFER_SIZE unless set with -b
+	int buffer_words;	// Words per block, set when the table is loaded
+	int cache_blocks;	// CACHE_BLOCKS unless set with -n
+	bool in_memory;		// -p
+	bool mapped;		// -m
+	bool sparse;		// --sparse
+	bool async_io;		// --async-io
+	enum engine engine;	// Chosen with --engine
+	int macro_k;
+	long summaries;		// Slots in the block engine's cache, BLOCK_SUMMARIES unless set with
+						// --summaries, and a power of two
+	long max_steps;		// The budget given with --max-steps and --timeout, zero for none
+	double timeout;
+	bool detect_loops;	// --detect-loops
+	bool table_cache;	// Compile text tables to TABLE.tmb and load them from there, unless
+						// --no-table-cache
+	bool count_stats;	// Fill in stats below as the machine runs, for --stats
+	bool strip_stream;	// Strip a tape read with tm_read_tape() of leading and trailing zeroes as
+						// it is written out, for -c
+	long undo_steps;	// Steps the undo log holds, for tm_undo(), zero (the default) for none, and
+						// otherwise a power of two; only the plain engine keeps it
+
+	struct op *instructions;
+	struct{
+		void *base;			// The compiled table the instructions are mapped from, if any
+		long size;
+	} table_map;
+	int max_states;
+	int symbols;		// Symbols in the alphabet, from 2 to MAX_SYMBOLS
+	int cell_bits;		// Bits to a cell of the packed tape: 1, 2 or 4
+	int position;
+	int buf_pos;
+	int state;
+
+	enum backend backend;
+	FILE *tapef;
+	FILE *leftf;
+	FILE *tape_out;		// Where tm_save() writes a tape read from a stream, in place of tapef
+	long flen;
+	long left_len;
+	int left_added;
+	bool binary_tape;
+
+	// The tape is handled in blocks of buffer_size cells. The block under the head is stored
+	// packed, cell_bits to a cell, so 64 cells to a uint64_t word for a binary alphabet. With the
+	// file-backed tape, buffer points at a slot of the cache below, which read_buf() and write_buf()
+	// fill and empty; with the in-memory tape (-p) it points straight into the storage of mem_tape.
+	uint64_t *buffer;
+	bool buffer_dirty;
+
+	int curr_slot;
+	struct{
+		struct cache_slot *slots;
+		uint64_t *bits;
+		int *hash;
+		int mask;
+		int used;
+		int head;			// Most recently used slot
+		int tail;			// Least recently used slot
+		char *scratch;		// One block of ASCII tape, for reading and writing the file
+	} cache;
+
+	// The in-memory tape holds every block touched so far in two growable arrays: one for the
+	// blocks at and to the right of position 0, and one for the blocks to the left of it, stored
+	// outwards from block -1. Growth in either direction is an amortised O(1) append, costing
+	// cell_bits per cell, and the tape file is only rewritten in the usual ASCII format once the
+	// machine stops.
+	struct{
+		uint64_t *right;
+		uint64_t *left;
+		int right_blocks;
+		int left_blocks;
+		int right_cap;
+		int left_cap;
+		long len;			// Cells from position 0 rightwards to write back
+	} mem_tape;
+
+	// The I/O thread, while it runs. The lock covers the jobs and the flags; the tape files, and the
+	// lengths and counters that read_buf() and write_buf() keep, belong to the thread until it has
+	// been stopped, so the cache goes by flen and left_len here, which are the lengths the files will
+	// have once every write queued so far is done.
+	struct{
+		bool running;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t wake;	// Signalled for the thread when a job is queued or it should quit
+		pthread_cond_t done;	// Signalled for the machine when a job is done
+		struct io_job jobs[ASYNC_JOBS];
+		uint64_t *bits;
+		long seq;
+		bool quit;
+		bool failed;
+		bool idle;			// The thread is waiting for a job, and needs waking for one
+		bool waiting;		// The machine is waiting for a job to be done
+		long flen;
+		long left_len;
+	} async;
+
+	struct tape_map right_map;
+	struct tape_map left_map;
+	uint64_t *map_buffer;
+
+	// The sparse tape. While the head is on a block that isn't held, it works on blank, which is
+	// only added to the table when the head leaves something on it; a held block the head leaves
+	// blank is dropped again, its slot going on a free list threaded through the pool. So blocks
+	// the head only passes over cost nothing. low_block and len give the extent of the tape that
+	// has been visited, as left_blocks and len do for mem_tape.
+	struct{
+		struct sparse_entry *table;
+		long mask;
+		long used;
+		uint64_t *bits;
+		int slots;			// Slots handed out from the pool
+		int cap;			// Slots the pool has room for
+		int free_slot;		// First slot of the free list, or -1
+		uint64_t *blank;
+		bool on_blank;
+		int low_block;
+		long len;
+	} sparse_tape;
+
+	// The sweep engine marks which instructions loop back to the same state, write the same bit
+	// and don't stop, so that the head just scans over a run of that bit
+	bool *self_loop;
+
+	struct{
+		struct macro_entry *slots;
+		long mask;
+		long used;
+	} macro;
+
+	// The block engine's cache, with the contents of each slot's block on entering and leaving,
+	// 2 * buffer_words words to a slot, and how many visits to blocks there were, and were replayed
+	struct{
+		struct block_summary *slots;
+		uint64_t *words;
+		long visits;
+		long replayed;
+	} summary;
+
+	// The compiled engine's code for the table, once it has been compiled and loaded, which the
+	// run function is found in
+	struct{
+		void *handle;
+		int (*run)(void *run);
+	} jit;
+
+	// For checkpoints of the in-memory tape, the slot of the blocks file that holds each block,
+	// stored as for mem_tape. Each entry is one more than the slot, or 0 for none yet, with
+	// CKPT_CHANGED set if the block has changed since.
+	struct{
+		FILE *blocks;
+		uint32_t *right;
+		uint32_t *left;
+		int right_cap;
+		int left_cap;
+		uint32_t pairs;		// Pairs of slots handed out
+	} ckpt;
+
+	// The undo log, a ring of the last undo_steps steps taken, each packed into 32 bits as the state
+	// it was taken in, the symbol it wrote over and the way it moved, with the step numbered i at
+	// that index modulo undo_steps; and the snapshots taken with tm_snapshot(), oldest first
+	struct{
+		uint32_t *log;
+		long held;			// Steps in the log, the last being the one before steps_run
+		struct snapshot shots[SNAPSHOTS];
+		int shots_used;
+	} undo;
+
+	struct{
+		struct trace_record *recs;
+		int used;
+		bool error;
+	} trace_out;
+
+	// Which of the budgets the machine ran out of, if any, and the steps it took. The clock is
+	// only read every TIME_CHECK_STEPS steps.
+	double deadline;
+	long step_limit;	// Steps to stop at this time round, zero for none
+	long steps_run;
+	double seconds;
+	enum budget budget_hit;
+	bool started;
+	bool halted;
+
+	// The watches on the left and right ends of the tape, and once the machine is proven never to
+	// halt, the steps it repeats itself every and the cells it moves along in that time. The macro
+	// engine only finds loops within a group of cells, which have neither.
+	struct cycle_watch watch[2];
+	bool looping;
+	long loop_period;
+	long loop_shift;
+	bool saved;			// The tape has been written back, so no more steps can be taken
+
+	// What the tape cost in I/O: the blocks read in from the tape file, or unpacked from the mapping,
+	// and written back, and the bytes of the tape read and written altogether, including loading
+	// and saving the whole of a tape held in memory; and the blocks the tape has grown by to the left
+	// of everything before, low_block being the furthest left so far
+	struct{
+		long block_loads;
+		long block_stores;
+		long bytes_read;
+		long bytes_written;
+		long left_extensions;
+		int low_block;
+		long prefetches;	// With --async-io, the blocks read ahead, those of them that were used,
+		long prefetch_hits;	// and the times the machine had to wait on the I/O thread
+		long stalls;
+	} io;
+
+	// With count_stats, the plain and sweep engines step in a loop of their own which also counts
+	// the times each instruction is taken, indexed as the table is, and the furthest the head has
+	// been to either side; the time spent loading and saving the tape and moving between blocks,
+	// which is I/O for the file-backed and mapped tapes, is timed for every engine.
+	struct{
+		long *hits;
+		long hits_cap;
+		long min_pos;
+		long max_pos;
+		double load_seconds;
+		double block_seconds;	// Counted in seconds, too
+		double save_seconds;
+	} stats;
+	char error[256];	// The message for the last error, for tm_error()
+};
+
+// Set up a machine with the default options, ready to have its table and tape loaded
+void tm_init(struct machine *m);
+
+// Close the machine's tape, and make it ready to load another table and tape, keeping its options
+// and the memory it has allocated
+void tm_reset(struct machine *m);
+
+// Free everything the machine has allocated and close its tape, leaving it as after tm_init().
+// The log and trace streams are left open.
+void tm_free(struct machine *m);
+
+// Load the instruction table from the file fname, text or compiled, returning 1 on error. With
+// table_cache set, a text table is compiled to fname with .tmb added, and later loads use that
+// instead so long as the text hasn't changed.
+int tm_load_table(struct machine *m, char *fname);
+
+// Give the machine an instruction table of states×symbols operations from memory, laid out as
+// instructions is, returning 1 on error. The operations are copied, and aren't checked, so every
+// new state must be less than states and every symbol to write less than symbols.
+int tm_set_table(struct machine *m, struct op *ops, int states, int symbols);
+
+// Load the tape from the file fname, ASCII or binary, returning 1 on error. With no fname, the
+// machine runs on a blank tape in memory, which isn't saved anywhere.
+int tm_load_tape(struct machine *m, char *fname);
+
+// Load the tape, ASCII or binary, from the stream in, such as a pipe, reading it through once to
+// its end, returning 1 on error. The tape is held in memory, or on the sparse tape with sparse
+// set, and tm_save() writes it to the stream out in the same format. Neither stream is closed.
+int tm_read_tape(struct machine *m, FILE *in, FILE *out);
+
+// Run the machine for up to n steps, or until it stops if n is negative, returning TM_HALTED,
+// TM_STOPPED, TM_LOOPING, TM_RUNNING or TM_ERROR. Only tm_save() writes the tape back to its file.
+int tm_step(struct machine *m, long n);
+
+// Write a checkpoint of the machine in the middle of a run to the file fname, and its tape to fname
+// with .blocks added, returning 1 on error. Only the blocks changed since the last checkpoint are
+// written. The tape must be held in memory.
+int tm_checkpoint(struct machine *m, char *fname);
+
+// Carry on from the checkpoint in the file fname, once the tape it was taken of has been loaded,
+// returning 1 on error. Further checkpoints should be written to the same file.
+int tm_resume(struct machine *m, char *fname);
+
+// Take the machine back n steps, or as many as the undo log holds if that is fewer, returning the
+// steps taken back or -1 on error. The statistics of count_stats aren't wound back.
+long tm_undo(struct machine *m, long n);
+
+// Take a snapshot of the machine and its tape, which must be held in memory, returning 1 on error.
+// Only the SNAPSHOTS latest are kept.
+int tm_snapshot(struct machine *m);
+
+// Take the machine to the step given, forward as tm_step() does, or back through the undo log, or
+// failing that from the latest snapshot before it, returning as tm_step()
+int tm_goto(struct machine *m, long step);
+
+// The symbol in the cell at pos of a tape held in memory, or -1 on error
+int tm_cell(struct machine *m, long pos);
+
+// Copy blocks first to last of a tape held in memory to out, packed as the tape is, buffer_words
+// words to a block, with blocks the head hasn't reached as blank, returning 1 on error
+int tm_copy_blocks(struct machine *m, int first, int last, uint64_t *out);
+
+// Write the tape back to its file, or to the stream given to tm_read_tape(), once the machine has
+// been run, returning 1 on error. The machine can't be stepped any further afterwards.
+int tm_save(struct machine *m);
+
+// Run the machine until it stops and save the tape, returning as tm_step()
+int tm_run(struct machine *m);
+
+// The state, the head position and the symbol under the head, the steps taken so far, and the time
+// taken taking them
+int tm_state(struct machine *m);
+long tm_position(struct machine *m);
+int tm_bit(struct machine *m);
+long tm_steps(struct machine *m);
+double tm_seconds(struct machine *m);
+
+// The number of cells of the tape that aren't blank, for a tape held in memory or one that has been
+// saved to its file, or -1 for any other
+long tm_marks(struct machine *m);
+
+// The message for the last error
+char *tm_error(struct machine *m);
+
+// Clean the saved tape of leading and trailing zeroes, returning 1 on error
+int tm_strip(struct machine *m);
+
+// Convert the tape in the file in between ASCII and binary, writing it to the file out
+int tm_convert(struct machine *m, char *in, char *out);
+
+// Print a binary trace from the file fname to the machine's log, as the table of the text log
+int tm_decode_trace(struct machine *m, char *fname);
+
+// Seconds on the clock the budgets are timed by
+double tm_clock();
+
+#endif
@@ -17,547 +17,2435 @@
  * necessarily all be at the STOP command, because the program only reads one buffer of tape at a 
  * time, and writes all changes to that buffer once a new section of tape is needed. The BUFFER_SIZE 
  * is 128 by default, which is much smaller than modern computers demand, but low enough to 
- * demonstrate the principle of a buffer within the small scale on which we are working. The number 
- * of possible internal states is capped at 128 (as the internal state is represented by a non-negative
- * signed byte), and the number of instructions is capped accordingly. Equally, one instruction for
- * every possible combination of internal state and bit currently read.
+ * demonstrate the principle of a buffer within the small scale on which we are working; it can be 
+ * changed with -b. The 16 most recently used buffers are cached, or as many as are given with -n, 
+ * and changed ones are written back to the file when they fall out of the cache. The instructions
+ * are held in one flat table of 32-bit operations, indexed by state and symbol. The number of
+ * possible internal states is capped at 16777216 (as the internal state is held in 24 bits of an
+ * operation), and the number of instructions is capped accordingly. Equally, one instruction for
+ * every possible combination of internal state and symbol currently read.
  *
- * Further details in README.md
+ * The machine itself is kept in libtape.c, behind libtape.h. Further details in README.md, where the
+ * other tapes, the engines, budgets, checkpoints, the debugger, batches, enumeration, benchmarks and
+ * fuzzing each have a section of their own.
  */
 
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
-#include <stdarg.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "libtape.h"
+
+#define SNAPSHOT_EVERY (1L << 24)
+#define VIEW_CELLS 64
+#define VIEW_FPS 25
+#define VIEW_CHUNK (1L << 16)
+#define DIAGRAM_ROWS 4096
+#define DIAGRAM_BLOCKS 4
+#define FUZZ_CASES 100
 
-#define BUFFER_SIZE 128
-FILE *LOG_STREAM;
-FILE *tapef;
-
-// The instruction list is captured by a two-dimensional array, structured as [state][bit], of 
-// operations to carry out. Each operation is a struct of a new state to enter, a digit to write,
-// a bool representing left (0) or right (1), and a bool for stoppping
-struct op{
-	char state;
-	bool val;
-	bool dir;
-	bool stop;
+// Print the command-line usage text
+void print_usg(){
+	printf("USAGE: ./tape.c [INSTRUCTIONS] [TAPE] [OPTIONS]\tTAPE may be -, to read it from stdin\n\t\t\tand write it back to stdout\n");
+	printf("       ./tape.c --convert [TAPE] [NEW TAPE]\tconvert between ASCII and binary tapes\n");
+	printf("       ./tape.c --decode-trace [TRACE]\tprint a binary trace as a table\n");
+	printf("       ./tape.c --batch [MANIFEST] [OPTIONS]\trun each table and tape listed in MANIFEST\n");
+	printf("       ./tape.c --bench [SCALE] [OPTIONS]\trun the benchmarks under each engine, printing JSON\n");
+	printf("       ./tape.c --fuzz [CASES] [OPTIONS]\trun random machines under each engine, checking\n\t\t\tthem against the plain one (default %d cases)\n", FUZZ_CASES);
+	printf("       ./tape.c --enumerate [STATES] [OPTIONS]\trun every 2-symbol machine of STATES states\n\t\t\tfrom a blank tape, for up to --max-steps steps each\n\n");
+	printf("Options:\n\n\t-s\t\tsilence log\n");
+	printf("\t-o [FILENAME]\twrite log to FILENAME\n");
+	printf("\t--trace-format=[FORMAT]\ttext (default), or binary to write a compact trace\n\t\t\tto the -o file in place of the log\n");
+	printf("\t-c\t\tclean resulting tape of leading / trailing zeroes (to the nearest\n\t\t\t64 on the left, for binary tapes)\n");
+	printf("\t--compress=[FORMAT]\tgzip or zstd, to decompress a tape given as - on its way in\n\t\t\tand compress it on its way out\n");
+	printf("\t-p\t\thold the whole tape in memory, bit-packed, and save it on exit\n");
+	printf("\t-m\t\tmap the tape file into memory instead of reading it with stdio\n");
+	printf("\t--sparse\thold only the blocks of tape with something other than 0 on them\n\t\t\tin memory, and save the tape on exit\n");
+	printf("\t-b [CELLS]\tcells per block of tape, a multiple of 64 (default %d)\n", BUFFER_SIZE);
+	printf("\t-n [BLOCKS]\tblocks of tape to cache from the file (default %d)\n", CACHE_BLOCKS);
+	printf("\t--async-io\twrite blocks evicted from the cache, and read the next block ahead,\n\t\t\ton a thread of their own\n");
+	printf("\t--engine=[ENGINE]\tplain, to take one step at a time (default); sweep, to\n\t\t\tcross runs of cells in self-looping states at once;\n\t\t\tmacro, to replay memoised visits to groups of cells; or\n\t\t\tblock, to replay summaries of visits to whole blocks\n");
+	printf("\t--compile\tcompile the table to native code with $CC (or cc) and run that, silently\n");
+	printf("\t-k [CELLS]\tcells per group for the macro engine, a power of two up to %d\n\t\t\t(default 8)\n", MACRO_MAX_K);
+	printf("\t--summaries [N]\tslots in the block engine's cache of summaries, a power of two\n\t\t\t(default %d)\n", BLOCK_SUMMARIES);
+	printf("\t--detect-loops\tstop the machine once it is proven never to halt, by repeating\n\t\t\titself as it drifts along the tape, and exit with status %d\n", TM_LOOPING);
+	printf("\t--checkpoint-every [N]\tcheckpoint the machine every N steps, to TAPE.ckpt or the\n\t\t\t--resume file, holding the tape in memory as with -p\n");
+	printf("\t--break-at [STEP]\tstop the machine at STEP in a debugger, which reads commands\n\t\t\tfrom stdin to step it forwards and back (h for help)\n");
+	printf("\t--undo-steps [N]\tsteps the debugger can take straight back, a power of two\n\t\t\t(default %d)\n", UNDO_STEPS);
+	printf("\t--snapshot-every [N]\tsnapshot the tape every N steps in the debugger, to go\n\t\t\tfurther back from (default %ld)\n", SNAPSHOT_EVERY);
+	printf("\t--view\t\tdraw a window of the tape around the head, and the state, as the\n\t\t\tmachine runs, with -s or -o\n");
+	printf("\t--view-cells [N]\tcells in the window of --view (default %d)\n", VIEW_CELLS);
+	printf("\t--fps [N]\tframes a second drawn by --view (default %d)\n", VIEW_FPS);
+	printf("\t--diagram [IMAGE]\tdraw the tape around the head over time, to a .png or .pbm\n\t\t\timage, a row to every --every steps (default 1), halving the\n\t\t\trows as it goes to keep to %d\n", DIAGRAM_ROWS);
+	printf("\t--resume [CHECKPOINT]\tcarry on from a checkpoint of the same table and tape\n");
+	printf("\t--no-table-cache\tparse the text of the table every time, rather than compiling\n\t\t\tit to TABLE.tmb and loading that while the text is unchanged\n");
+	printf("\t--stats[=json]\tcount the instructions taken, the head's extent and the tape I/O,\n\t\t\tand report them after the run, or print them as JSON\n");
+	printf("\t-j [THREADS]\tthreads to run a batch, a search or the cases on, or render a diagram with\n\t\t\t(default one per core)\n");
+	printf("\t--seed [N]\tthe seed of the cases of --fuzz (default 1)\n");
+	printf("\t--shard [I/N]\trun only the Ith of N shards of a search, counting from 0\n");
+	printf("\t--max-steps [N]\tstop the machine after N steps, counting any before a checkpoint\n");
+	printf("\t--timeout [SEC]\tstop the machine after SEC seconds\n\n");
+	printf("The tape is saved when the machine is stopped by either of these, and the program exits\nwith status %d.\n\n", TM_STOPPED);
+}
+
+// The options given on the command line for running a job, as opposed to those of the machine
+struct run_options{
+	bool strip;
+	bool batch;
+	long checkpoint_every;	// Steps between checkpoints, or zero for none
+	char *resume;			// The checkpoint to carry on from
+	int stats;				// STATS_NONE, STATS_TEXT or STATS_JSON
+	char *compress;			// The compressor for a tape given as -, with --compress
+	FILE *tape_in;			// With - as the tape, the streams it is read from and written to
+	FILE *tape_out;
+	pid_t tape_filter;		// The decompressor tape_in is read from, until it has finished
+	bool debug;				// Whether to stop in the debugger at break_at, with --break-at
+	long break_at;
+	long snapshot_every;	// Steps between the debugger's snapshots
+	bool view;				// Whether to draw the tape as the machine runs, with --view
+	long view_cells;
+	double fps;
+	char *diagram;			// The image to draw the run in, with --diagram, and the steps between
+	long every;				// its rows to begin with
+	int threads;			// Threads to render the image on, with -j
 };
 
-// Some global variables
-struct op (*instructions)[2];
-char max_states;
-int position = 0;
-int buf_pos = 0;
-char state = 0;
-bool buffer[BUFFER_SIZE];
-int flen;
-int left_added = 0;
+enum{STATS_NONE, STATS_TEXT, STATS_JSON};
+
+// Report what the run cost, from the counters the machine kept with count_stats. The time spent
+// stepping is what is left of the run once moving between blocks is taken out, so a job is I/O-bound
+// if that, and loading and saving the tape, take as long or longer.
+void print_stats(struct machine *m, int format){
+	long n = (long) m->max_states * m->symbols;
+	bool counted = m->engine == ENGINE_PLAIN || m->engine == ENGINE_SWEEP;
+	double secs = tm_seconds(m);
+	double stepping = secs - m->stats.block_seconds;
+	long marks = tm_marks(m);
+
+	if (format == STATS_JSON){
+		printf("{\"steps\": %ld, \"seconds\": %.6f, \"steps_per_sec\": %.0f, ", tm_steps(m), secs, secs > 0 ? tm_steps(m) / secs : 0);
+		printf("\"load_seconds\": %.6f, \"block_seconds\": %.6f, \"step_seconds\": %.6f, \"save_seconds\": %.6f, ",
+			m->stats.load_seconds, m->stats.block_seconds, stepping, m->stats.save_seconds);
+		printf("\"block_loads\": %ld, \"block_stores\": %ld, \"bytes_read\": %ld, \"bytes_written\": %ld, \"left_extensions\": %ld",
+			m->io.block_loads, m->io.block_stores, m->io.bytes_read, m->io.bytes_written, m->io.left_extensions);
+		if (marks >= 0)
+			printf(", \"marks\": %ld", marks);
+		if (counted){
+			printf(", \"min_position\": %ld, \"max_position\": %ld, \"transitions\": [", m->stats.min_pos, m->stats.max_pos);
+			bool first = true;
+			for (long i=0; i<n; i++){
+				if (!m->stats.hits[i])
+					continue;
+				printf("%s{\"state\": %ld, \"symbol\": %ld, \"hits\": %ld}", first ? "" : ", ", i / m->symbols, i % m->symbols,
+					m->stats.hits[i]);
+				first = false;
+			}
+			printf("]");
+		}
+		if (m->engine == ENGINE_BLOCK)
+			printf(", \"block_visits\": %ld, \"block_replays\": %ld", m->summary.visits, m->summary.replayed);
+		if (m->async_io)
+			printf(", \"prefetches\": %ld, \"prefetch_hits\": %ld, \"stalls\": %ld", m->io.prefetches, m->io.prefetch_hits, m->io.stalls);
+		printf("}\n");
+		return;
+	}
 
-// Print a formatted string to the log, i.e. either to stdout or do nothing
-// LOG_STREAM is the stream that we print to, by default stdout or a file if specified with -o;
-// But the user can also suppress the log altogether with -s. Since we can't fprint to NULL, we
-// need to first check LOG_STREAM isn't null and go ahead only if it isn't.
-void logprint(char *fmt, ...){
-	extern FILE *LOG_STREM;
+	printf("Statistics:\n");
+	if (counted){
+		printf("|Instruction                      | Hits\n|=================================================\n");
+		for (long i=0; i<n; i++){
+			if (!m->stats.hits[i])
+				continue;
+			struct op o = m->instructions[i];
+			char instruc[64];
+			snprintf(instruc, sizeof(instruc), "%ld,%lx->%u,%x,%c%s", i / m->symbols, i % m->symbols, (unsigned) o.state, (unsigned) o.val,
+				o.dir ? 'R' : 'L', o.stop ? "STOP" : "");
+			printf("| %-32s| %ld (%.1f%%)\n", instruc, m->stats.hits[i], 100.0 * m->stats.hits[i] / tm_steps(m));
+		}
+		printf("Head: from %ld to %ld, %ld cells\n", m->stats.min_pos, m->stats.max_pos, m->stats.max_pos - m->stats.min_pos + 1);
+	} else{
+		printf("The %s engine doesn't count the instructions taken or the extent of the head.\n",
+			m->engine == ENGINE_MACRO ? "macro" : m->engine == ENGINE_BLOCK ? "block" : "compiled");
+	}
+	printf("Steps: %ld in %.3f seconds (%.0f steps/sec)\n", tm_steps(m), secs, secs > 0 ? tm_steps(m) / secs : 0);
+	printf("Tape I/O: %ld block loads, %ld block stores, %ld bytes read, %ld bytes written, %ld block(s) added to the left\n",
+		m->io.block_loads, m->io.block_stores, m->io.bytes_read, m->io.bytes_written, m->io.left_extensions);
+	if (marks >= 0)
+		printf("Marks: %ld cell(s) left on the tape that aren't 0\n", marks);
+	if (m->engine == ENGINE_BLOCK)
+		printf("Summaries: %ld of %ld visit(s) to blocks replayed\n", m->summary.replayed, m->summary.visits);
+	if (m->async_io)
+		printf("Async I/O: %ld block(s) read ahead, %ld of them used, %ld wait(s) on the I/O thread\n", m->io.prefetches,
+			m->io.prefetch_hits, m->io.stalls);
+	printf("Time: %.3f seconds loading the tape, %.3f moving between blocks, %.3f stepping, %.3f saving the tape\n",
+		m->stats.load_seconds, m->stats.block_seconds, stepping, m->stats.save_seconds);
+}
+
+/* With --break-at, the machine is run to the step given and stopped there in a debugger, which
+ * reads one command to a line from stdin and can step the machine forwards or back. Going back is
+ * done through the undo log of the last --undo-steps steps, and beyond that from the latest of the
+ * snapshots the debugger takes of the whole tape every --snapshot-every steps, stepping forward from
+ * there; so the machine can be taken back as far as the oldest snapshot kept, which is step 0 until
+ * SNAPSHOTS of them have been taken. Quitting, or the end of stdin, saves the tape as it is.
+ */
 
-	if (LOG_STREAM){
-		va_list args;
-		va_start(args, fmt);
-		vfprintf(LOG_STREAM, fmt, args);
-		va_end(args);
+// Step the machine on n steps, or until it stops if n is negative, taking a snapshot every
+// snapshot_every steps along the way
+int debug_step(struct machine *m, struct run_options *opts, long n){
+	long every = opts->snapshot_every;
+	long end = n < 0 ? LONG_MAX : tm_steps(m) + n;
+	int status;
+
+	do{
+		long next = (tm_steps(m) / every + 1) * every;
+		status = tm_step(m, (next < end ? next : end) - tm_steps(m));
+		if (status == TM_RUNNING && tm_steps(m) % every == 0 && tm_snapshot(m))
+			return TM_ERROR;
+	} while (status == TM_RUNNING && tm_steps(m) < end);
+
+	return status;
+}
+
+// Print where the machine is, and how it got there
+void debug_show(struct machine *m, int status){
+	printf("Step %ld: state %d, position %ld, reading %x%s.\n", tm_steps(m), tm_state(m), tm_position(m), tm_bit(m),
+		status == TM_HALTED ? ", halted" : status == TM_STOPPED ? ", stopped by --max-steps" : "");
+}
+
+// Print the cells either side of the head, with the head marked beneath
+void debug_tape(struct machine *m, long cells){
+	long pos = tm_position(m);
+
+	printf("%ld: ", pos - cells);
+	for (long i=pos-cells; i<=pos+cells; i++)
+		putchar("0123456789abcdef"[tm_cell(m, i)]);
+	printf("\n%*s^\n", (int) (snprintf(NULL, 0, "%ld: ", pos - cells) + cells), "");
+}
+
+int debug(struct machine *m, struct run_options *opts){
+	char line[256];
+	char cmd[16];
+	long n;
+
+	if (tm_snapshot(m))
+		return TM_ERROR;
+	int status = opts->break_at > tm_steps(m) ? debug_step(m, opts, opts->break_at - tm_steps(m)) : TM_RUNNING;
+	if (status == TM_ERROR)
+		return status;
+	debug_show(m, status);
+
+	while (printf("> "), fflush(stdout), fgets(line, sizeof(line), stdin)){
+		int args = sscanf(line, "%15s %ld", cmd, &n);
+		if (args < 1)
+			continue;
+		if (args == 2 && n < 0){
+			printf("Please give a number of steps or cells that isn't negative.\n");
+			continue;
+		}
+
+		if (strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0){
+			status = debug_step(m, opts, args == 2 ? n : 1);
+		} else if (strcmp(cmd, "b") == 0 || strcmp(cmd, "back") == 0){
+			n = args == 2 ? n : 1;
+			status = tm_goto(m, n < tm_steps(m) ? tm_steps(m) - n : 0);
+		} else if ((strcmp(cmd, "g") == 0 || strcmp(cmd, "goto") == 0) && args == 2){
+			status = n > tm_steps(m) ? debug_step(m, opts, n - tm_steps(m)) : tm_goto(m, n);
+		} else if (strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0){
+			status = debug_step(m, opts, -1);
+		} else if (strcmp(cmd, "t") == 0 || strcmp(cmd, "tape") == 0){
+			debug_tape(m, args == 2 ? n : 32);
+			continue;
+		} else if (strcmp(cmd, "p") == 0 || strcmp(cmd, "print") == 0){
+		} else if (strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0){
+			return status;
+		} else{
+			printf("Commands: s [N] to step forward N steps (default 1), b [N] to step back, g STEP to go to\n"
+				"a step, c to continue until the machine stops, p to print where it is, t [N] to print N cells\n"
+				"either side of the head (default 32), and q to quit, saving the tape as it is.\n");
+			continue;
+		}
+
+		// A step too far back is only reported, and the machine is left where it was
+		if (status == TM_ERROR){
+			printf("%s\n", tm_error(m));
+			status = TM_RUNNING;
+		}
+		debug_show(m, status);
 	}
+
+	return status;
 }
 
-// Print the command-line usage text
-void print_usg(){
-	printf("USAGE: ./tape.c [INSTRUCTIONS] [TAPE] [OPTIONS]\n\n");
-	printf("Options:\n\n\t-s\t\tsilence log\n");
-	printf("\t-o [FILENAME]\twrite log to FILENAME\n");
-	printf("\t-c\t\tclean resulting tape of leading / trailing zeroes\n\n");
+/* With --view, a window of view_cells cells of the in-memory tape is drawn on the terminal, with the
+ * head marked beneath it and the step, state and position above, and redrawn fps times a second
+ * as the machine runs. The machine is stepped VIEW_CHUNK steps at a time, and the clock checked
+ * between them, so the frames are samples of the run, not every step, and cost next to nothing.
+ * Each frame only redraws the cells that have changed since the last, moving the cursor to each
+ * with ANSI escapes, unless the head has left the window, which is then centred on it again.
+ */
+struct view{
+	long cells;
+	long start;			// The position of the leftmost cell of the window
+	long head;			// Where the head was drawn, or LONG_MIN before the first frame
+	char *shown;		// The cells as they were drawn
+};
+
+// Draw a frame, leaving the cursor at the start of its top line
+void view_frame(struct machine *m, struct view *v){
+	long head = tm_position(m);
+	bool all = v->head == LONG_MIN || head < v->start || head >= v->start + v->cells;
+	if (all)
+		v->start = head - v->cells / 2;
+
+	printf("\r\033[KStep %ld: state %d, position %ld, cells %ld to %ld\n", tm_steps(m), tm_state(m), head, v->start,
+		v->start + v->cells - 1);
+	if (all)
+		printf("\033[K");
+
+	// A run of changed cells is written straight along, with one move of the cursor to its start
+	bool moved = false;
+	for (long i=0; i<v->cells; i++){
+		char c = "0123456789abcdef"[tm_cell(m, v->start + i)];
+		if (!all && c == v->shown[i]){
+			moved = true;
+			continue;
+		}
+		if (moved)
+			printf("\033[%ldG", i + 1);
+		putchar(c);
+		v->shown[i] = c;
+		moved = false;
+	}
+
+	if (all)
+		printf("\n\033[K%*s^", (int) (head - v->start), "");
+	else if (head != v->head)
+		printf("\n\033[%ldG \033[%ldG^", v->head - v->start + 1, head - v->start + 1);
+	else
+		printf("\n");
+	printf("\r\033[2A");
+	fflush(stdout);
+	v->head = head;
 }
 
-// Return a char * detailing the given instruction
-void print_instruc(int instate, int indigit){
-	if (LOG_STREAM)
-		fprintf(LOG_STREAM, "%d,%d->%d,%d,%c%s", instate, indigit, instructions[instate][indigit].state, instructions[instate][indigit].val, (instructions[instate][indigit].dir ? 'R' : 'L'), (instructions[instate][indigit].stop ? "STOP" : ""));
+int view_run(struct machine *m, struct run_options *opts){
+	struct view v = {opts->view_cells, 0, LONG_MIN, malloc(opts->view_cells)};
+	double next = 0;
+	int status;
+
+	if (!v.shown){
+		printf("Error: out of memory for the view.\n");
+		return TM_ERROR;
+	}
+
+	// The window is drawn once in full, three lines down the terminal, before any steps are taken
+	printf("\n\n\n\033[3A");
+	while ((status = tm_step(m, VIEW_CHUNK)) == TM_RUNNING){
+		if (tm_clock() >= next){
+			view_frame(m, &v);
+			next = tm_clock() + 1 / opts->fps;
+		}
+	}
+	if (status != TM_ERROR)
+		view_frame(m, &v);
+	printf("\033[3B\r");
+
+	free(v.shown);
+	return status;
 }
 
-// Print an error message based on return value code from parse_instruc
-void parse_error(int code){
-	switch (code){
-		case 1:
-		case 6:
-			logprint("Instruction too short to be valid.\n");
-			break;
-		case 2:
-			logprint("Input state (0 to 127 inclusive) must be followed by a comma.\n");
-			break;
-		case 3:
-			logprint("Input state in an instruction (zero-based) must not exceed STATES.\n");
-			break;
-		case 4:
-			logprint("Input digit must be either 0 or 1.\n");
-			break;
-		case 5:
-			logprint("New internal state (zero-based) must not exceed STATES.\n");
-			break;
-		case 7:
-			logprint("Digit to be written must be either 0 or 1.\n");
-			break;
-		case 8:
-			logprint("Digit to be written must be followed by a comma.\n");
-			break;
-		case 9:
-			logprint("Direction must be either R or L.\n");
+/* With --diagram, the run is drawn as a space-time diagram, a row of the tape to every --every steps,
+ * from the first step at the top to the last at the bottom. Each row is sampled from the in-memory
+ * tape as the DIAGRAM_BLOCKS blocks either side of the head's, copied as they are packed into a
+ * frame buffer of DIAGRAM_ROWS rows; once it is full, every other row is dropped and the steps
+ * between rows doubled, so however long the machine runs the rows take the same memory, and evenly
+ * sample the run. The image spans every block any row was sampled from.
+ *
+ * Once the machine stops the image is rendered by -j threads, a band of rows each, and written
+ * as a PBM, one bit to a cell with the marks black, or as a PNG, with a grey for each symbol, the
+ * head in red and the cells out of a row's reach in light grey. Rather than depend on zlib, each
+ * band of a PNG is compressed by a deflate of its own, in the fixed Huffman code, which matches each
+ * run of pixels against the pixel before or the one a row above, as a diagram is mostly long runs
+ * of one colour and rows much like the last. A band is an IDAT chunk of its own, ending where a
+ * byte does; the thread rendering it works out the chunk's CRC and the band's Adler-32, which are
+ * then combined for the whole image.
+ */
+struct diagram{
+	long every;
+	long row_words;
+	uint64_t *cells;	// The rows, row_words words to each, packed as the tape is
+	int *first;			// The first block of each row
+	long *head;			// The position of the head in each row
+	long *steps;		// The steps taken at each row
+	int rows;
+	bool png;
+	int bits;			// Bits to a cell, cells to a block and symbols of the tape, and the span
+	int size;			// of blocks the image covers
+	int symbols;
+	int low;
+	long width;
+};
+
+struct diagram_band{
+	struct diagram *d;
+	int from;			// The rows of the band
+	int to;
+	unsigned char *out;	// The band as it is written out, deflated for a PNG
+	long len;
+	uint32_t adler;		// The Adler-32 of a PNG band's scanlines, before they were deflated,
+	long raw;			// and their length
+	uint32_t crc;		// The CRC of the IDAT chunk it goes in
+};
+
+static uint32_t crc_table[256];
+
+uint32_t crc32_update(uint32_t crc, unsigned char *p, long n){
+	crc = ~crc;
+	for (long i=0; i<n; i++)
+		crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Combine the Adler-32 of two runs of bytes into that of both, the second n bytes long
+uint32_t adler32_combine(uint32_t a, uint32_t b, long n){
+	uint32_t base = 65521;
+	uint32_t rem = n % base;
+	uint32_t sum1 = a & 0xffff;
+	uint32_t sum2 = (uint32_t) (((uint64_t) rem * sum1) % base);
+
+	sum1 += (b & 0xffff) + base - 1;
+	sum2 += (a >> 16) + (b >> 16) + base - rem;
+	sum1 = sum1 >= base ? sum1 - base : sum1;
+	sum1 = sum1 >= base ? sum1 - base : sum1;
+	sum2 = sum2 >= 2 * base ? sum2 - 2 * base : sum2;
+	sum2 = sum2 >= base ? sum2 - base : sum2;
+	return sum1 | sum2 << 16;
+}
+
+// A stream of bits as deflate packs them, from the lowest bit of each byte up
+struct bit_stream{
+	unsigned char *p;
+	uint64_t bits;
+	int n;
+};
+
+void bits_put(struct bit_stream *s, uint32_t bits, int n){
+	s->bits |= (uint64_t) bits << s->n;
+	s->n += n;
+	while (s->n >= 8){
+		*s->p++ = s->bits;
+		s->bits >>= 8;
+		s->n -= 8;
+	}
+}
+
+// Put a Huffman code, which unlike everything else goes from its highest bit down
+void bits_code(struct bit_stream *s, uint32_t code, int n){
+	uint32_t rev = 0;
+	for (int i=0; i<n; i++)
+		rev |= ((code >> i) & 1) << (n - 1 - i);
+	bits_put(s, rev, n);
+}
+
+// Put a literal byte, a length or the end of a block, in deflate's fixed code
+void deflate_symbol(struct bit_stream *s, int sym){
+	if (sym < 144)
+		bits_code(s, 0x30 + sym, 8);
+	else if (sym < 256)
+		bits_code(s, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		bits_code(s, sym - 256, 7);
+	else
+		bits_code(s, 0xc0 + sym - 280, 8);
+}
+
+// Put a copy of len bytes, from 3 to 258, from dist bytes back, up to 32768
+void deflate_match(struct bit_stream *s, int len, int dist){
+	static const short len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+		67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const short dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+		513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	int c = 28;
+	while (len_base[c] > len)
+		c--;
+	deflate_symbol(s, 257 + c);
+	bits_put(s, len - len_base[c], c < 8 || c == 28 ? 0 : c / 4 - 1);
+	int d = 29;
+	while (dist_base[d] > dist)
+		d--;
+	bits_code(s, d, 5);
+	bits_put(s, dist - dist_base[d], d < 4 ? 0 : d / 2 - 1);
+}
+
+// Compress n bytes of scanlines line bytes long into a fixed Huffman block, not the final one, taking
+// at each byte the longer run that repeats the byte before or the line above, and end it with an
+// empty stored block, as zlib's full flush does, so that the next band's blocks start on a byte of
+// their own. out needs room for n + n / 8 + 8 bytes; returns the bytes written.
+long deflate_band(unsigned char *p, long n, long line, unsigned char *out){
+	struct bit_stream s = {out, 0, 0};
+	long dists[2] = {1, line};
+
+	bits_put(&s, 2, 3);
+	for (long i=0; i<n; ){
+		int best = 0;
+		long dist = 0;
+		for (int k=0; k<2; k++){
+			if (dists[k] > i || dists[k] > 32768)
+				continue;
+			int len = 0;
+			while (len < 258 && i + len < n && p[i + len] == p[i + len - dists[k]])
+				len++;
+			if (len > best){
+				best = len;
+				dist = dists[k];
+			}
+		}
+		if (best >= 3){
+			deflate_match(&s, best, dist);
+			i += best;
+		} else
+			deflate_symbol(&s, p[i++]);
+	}
+	deflate_symbol(&s, 256);
+	bits_put(&s, 0, 3);
+	bits_put(&s, 0, (8 - s.n) % 8);
+	bits_put(&s, 0xffff0000u, 32);
+	return s.p - out;
+}
+
+// Add a row of the tape around the head
+void diagram_sample(struct machine *m, struct diagram *d){
+	long head = tm_position(m);
+	int size = m->buffer_size;
+	int blk = head >= 0 ? head / size : -((-head + size - 1) / size);
+
+	d->first[d->rows] = blk - DIAGRAM_BLOCKS;
+	d->head[d->rows] = head;
+	d->steps[d->rows] = tm_steps(m);
+	tm_copy_blocks(m, blk - DIAGRAM_BLOCKS, blk + DIAGRAM_BLOCKS, d->cells + d->row_words * d->rows);
+	d->rows++;
+}
+
+// Drop every other row, and take rows half as often
+void diagram_halve(struct diagram *d){
+	for (int r=0; r<d->rows/2; r++){
+		memcpy(d->cells + d->row_words * r, d->cells + d->row_words * r * 2, sizeof(uint64_t) * d->row_words);
+		d->first[r] = d->first[r*2];
+		d->head[r] = d->head[r*2];
+		d->steps[r] = d->steps[r*2];
+	}
+	d->rows = (d->rows + 1) / 2;
+	d->every *= 2;
+}
+
+// Render a band of rows, one byte to a pixel in palette order for a PNG, behind the filter byte of
+// each scanline, and packed eight pixels to a byte for a PBM
+void *diagram_render(void *arg){
+	struct diagram_band *band = arg;
+	struct diagram *d = band->d;
+	long line = d->png ? d->width + 1 : (d->width + 7) / 8;
+	long blocks = 2 * DIAGRAM_BLOCKS + 1;
+	unsigned char *raw = calloc(line * (band->to - band->from), 1);
+
+	if (!raw)
+		return NULL;
+	for (int r=band->from; r<band->to; r++){
+		unsigned char *p = raw + line * (r - band->from);
+		uint64_t *row = d->cells + d->row_words * r;
+		long origin = (long) d->low * d->size;
+		for (long x=0; x<d->width; x++){
+			long cell = origin + x - (long) d->first[r] * d->size;
+			int val = -1;
+			if (cell >= 0 && cell < blocks * d->size){
+				long bit = cell * d->bits;
+				val = (row[bit / 64] >> (bit % 64)) & ((1u << d->bits) - 1);
+			}
+			if (d->png)
+				p[x + 1] = origin + x == d->head[r] ? 16 : val < 0 ? 17 : val;
+			else if (val > 0)
+				p[x / 8] |= 0x80 >> (x % 8);
+		}
+	}
+
+	long len = line * (band->to - band->from);
+	if (!d->png){
+		band->out = raw;
+		band->len = len;
+		return NULL;
+	}
+
+	uint32_t s1 = 1;
+	uint32_t s2 = 0;
+	for (long i=0; i<len; i++){
+		s1 = (s1 + raw[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	band->adler = s1 | s2 << 16;
+	band->raw = len;
+
+	unsigned char *out = malloc(4 + len + len / 8 + 8);
+	if (!out){
+		free(raw);
+		return NULL;
+	}
+	memcpy(out, "IDAT", 4);
+	band->len = 4 + deflate_band(raw, len, line, out + 4);
+	free(raw);
+	band->crc = crc32_update(0, out, band->len);
+	band->out = out;
+	return NULL;
+}
+
+// Write a PNG chunk of the type and data given, with its length and CRC
+void png_chunk(FILE *fp, char *type, unsigned char *data, long len){
+	unsigned char buf[4 + 64];
+	unsigned char be[4] = {len >> 24, len >> 16, len >> 8, len};
+	memcpy(buf, type, 4);
+	memcpy(buf + 4, data, len);
+	uint32_t crc = crc32_update(0, buf, 4 + len);
+	unsigned char crc_be[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+	fwrite(be, 1, 4, fp);
+	fwrite(buf, 1, 4 + len, fp);
+	fwrite(crc_be, 1, 4, fp);
+}
+
+int diagram_write(struct diagram *d, char *fname, int threads){
+	int high = d->first[0];
+	d->low = d->first[0];
+	for (int r=0; r<d->rows; r++){
+		d->low = d->first[r] < d->low ? d->first[r] : d->low;
+		high = d->first[r] > high ? d->first[r] : high;
+	}
+	d->width = (long) (high - d->low + 2 * DIAGRAM_BLOCKS + 1) * d->size;
+
+	for (uint32_t i=0; i<256; i++){
+		uint32_t c = i;
+		for (int k=0; k<8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (threads > d->rows)
+		threads = d->rows;
+	struct diagram_band bands[threads];
+	pthread_t pool[threads];
+	bool started[threads];
+	for (int t=0; t<threads; t++){
+		bands[t] = (struct diagram_band){d, (long) d->rows * t / threads, (long) d->rows * (t + 1) / threads, NULL, 0, 1, 0, 0};
+		started[t] = pthread_create(&pool[t], NULL, diagram_render, &bands[t]) == 0;
+	}
+	for (int t=0; t<threads; t++){
+		if (started[t])
+			pthread_join(pool[t], NULL);
+		else
+			diagram_render(&bands[t]);
+	}
+
+	FILE *fp = fopen(fname, "wb");
+	int error = !fp;
+	for (int t=0; t<threads; t++)
+		error |= !bands[t].out;
+
+	if (!error && d->png){
+		unsigned char ihdr[13] = {d->width >> 24, d->width >> 16, d->width >> 8, d->width, d->rows >> 24, d->rows >> 16, d->rows >> 8, d->rows,
+			8, 3, 0, 0, 0};
+		unsigned char palette[18 * 3];
+		for (int i=0; i<16; i++)
+			palette[3*i] = palette[3*i+1] = palette[3*i+2] = 255 - (i < d->symbols ? i : d->symbols - 1) * 255 / (d->symbols - 1);
+		memcpy(palette + 48, "\xff\x00\x00\xe0\xe0\xe0", 6);
+		fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp);
+		png_chunk(fp, "IHDR", ihdr, 13);
+		png_chunk(fp, "PLTE", palette, sizeof(palette));
+		png_chunk(fp, "IDAT", (unsigned char *) "\x78\x01", 2);
+
+		uint32_t adler = 1;
+		for (int t=0; t<threads; t++){
+			long len = bands[t].len - 4;
+			unsigned char be[4] = {len >> 24, len >> 16, len >> 8, len};
+			unsigned char crc_be[4] = {bands[t].crc >> 24, bands[t].crc >> 16, bands[t].crc >> 8, bands[t].crc};
+			fwrite(be, 1, 4, fp);
+			fwrite(bands[t].out, 1, bands[t].len, fp);
+			fwrite(crc_be, 1, 4, fp);
+			adler = adler32_combine(adler, bands[t].adler, bands[t].raw);
+		}
+
+		// The last block is an empty one, marked final, followed by the Adler-32 of the lot
+		unsigned char end[9] = {1, 0, 0, 0xff, 0xff, adler >> 24, adler >> 16, adler >> 8, adler};
+		png_chunk(fp, "IDAT", end, 9);
+		png_chunk(fp, "IEND", (unsigned char *) "", 0);
+	} else if (!error){
+		fprintf(fp, "P4\n%ld %d\n", d->width, d->rows);
+		for (int t=0; t<threads; t++)
+			fwrite(bands[t].out, 1, bands[t].len, fp);
+	}
+	if (fp)
+		error |= ferror(fp) | (fclose(fp) != 0);
+	for (int t=0; t<threads; t++)
+		free(bands[t].out);
+
+	if (error){
+		printf("Error: could not write the diagram to %s.\n", fname);
+		return 1;
+	}
+	printf("Drew %d rows of %ld cells, one every %ld steps, to %s.\n", d->rows, d->width, d->every, fname);
+	return 0;
+}
+
+int diagram_run(struct machine *m, struct run_options *opts){
+	char *ext = strrchr(opts->diagram, '.');
+	struct diagram d = {0};
+	int status;
+
+	d.every = opts->every;
+	d.png = strcmp(ext, ".png") == 0;
+	d.row_words = (long) (2 * DIAGRAM_BLOCKS + 1) * m->buffer_words;
+	d.cells = malloc(sizeof(uint64_t) * d.row_words * (DIAGRAM_ROWS + 1));
+	d.first = malloc(sizeof(int) * (DIAGRAM_ROWS + 1));
+	d.head = malloc(sizeof(long) * (DIAGRAM_ROWS + 1));
+	d.steps = malloc(sizeof(long) * (DIAGRAM_ROWS + 1));
+	if (!d.cells || !d.first || !d.head || !d.steps){
+		printf("Error: out of memory for the diagram.\n");
+		status = TM_ERROR;
+		goto done;
+	}
+	d.bits = m->cell_bits;
+	d.size = m->buffer_size;
+	d.symbols = m->symbols;
+
+	// A row is taken every so many steps, and one more for the last step if it falls in between
+	diagram_sample(m, &d);
+	while (true){
+		long next = (tm_steps(m) / d.every + 1) * d.every;
+		status = tm_step(m, next - tm_steps(m));
+		if (status == TM_ERROR)
 			break;
-		case 10:
-		case 11:
-			logprint("Direction must be followed either by end of line or by STOP.\n");
+		if (status == TM_RUNNING && d.rows == DIAGRAM_ROWS)
+			diagram_halve(&d);
+		if (status == TM_RUNNING || tm_steps(m) != d.steps[d.rows - 1])
+			diagram_sample(m, &d);
+		if (status != TM_RUNNING)
 			break;
 	}
+	if (status != TM_ERROR && diagram_write(&d, opts->diagram, opts->threads))
+		status = TM_ERROR;
+
+done:
+	free(d.cells);
+	free(d.first);
+	free(d.head);
+	free(d.steps);
+	return status;
 }
 
-// Interpret char *instruc and add to the list
-int parse_instruc(char *instruc){
-	// The position in instructions to store the operation (when we get to it)
-	int instate;
-	int indigit;
+// Run the loaded machine until it stops and save the tape, checkpointing it along the way if asked,
+// then report on the run if it isn't one of a batch. Returns as tm_run().
+int run(struct machine *m, char *tape, struct run_options *opts){
+	char ckpt[PATH_MAX];
+	long before = tm_steps(m);
+	int status;
+
+	if (opts->debug || opts->view || opts->diagram){
+		status = opts->debug ? debug(m, opts) : opts->view ? view_run(m, opts) : diagram_run(m, opts);
+		if (status != TM_ERROR && tm_save(m))
+			status = TM_ERROR;
+	} else if (opts->checkpoint_every){
+		if (opts->resume)
+			snprintf(ckpt, sizeof(ckpt), "%s", opts->resume);
+		else
+			snprintf(ckpt, sizeof(ckpt), "%s.ckpt", tape);
+
+		while ((status = tm_step(m, opts->checkpoint_every)) == TM_RUNNING){
+			if (tm_checkpoint(m, ckpt))
+				return TM_ERROR;
+		}
+		if (status != TM_ERROR && tm_save(m))
+			status = TM_ERROR;
+	} else{
+		status = tm_run(m);
+	}
+	if (status == TM_ERROR || opts->batch)
+		return status;
+
+	// With a budget, say how far the machine got and how quickly, not counting any steps taken
+	// before the checkpoint it was resumed from
+	if (m->max_steps || m->timeout){
+		double secs = tm_seconds(m);
+		long ran = tm_steps(m) - before;
+		if (status == TM_STOPPED)
+			printf("Stopped by %s after %ld steps.\n", m->budget_hit == BUDGET_STEPS ? "--max-steps" : "--timeout", tm_steps(m));
+		printf("Ran %ld steps in %.3f seconds (%.0f steps/sec).\n", ran, secs, secs > 0 ? ran / secs : 0);
+	}
 
-	// The shortest a syntactically correct instruction can be is 11
-	if (strlen(instruc) < 10) return 1;
+	if (status == TM_LOOPING && m->loop_period)
+		printf("Proven never to halt after %ld steps: the machine repeats itself every %ld steps, %ld cells further %s.\n",
+			tm_steps(m), m->loop_period, labs(m->loop_shift), m->loop_shift > 0 ? "right" : "left");
+	else if (status == TM_LOOPING)
+		printf("Proven never to halt after %ld steps: the machine loops forever within a group of cells.\n", tm_steps(m));
 
-	// The 1-3 characters before the first comma represent a state
-	int i;
-	char state[3];
+	if (m->log_stream || m->trace_stream){
+		printf("Final state: %d\n", tm_state(m));
+		printf("Final position: %ld\n", tm_position(m));
+		printf("Bit at final position: %d\n", tm_bit(m));
+	}
+	if (opts->stats)
+		print_stats(m, opts->stats);
 
-	for (i=0; i<3 && instruc[i]!=','; i++)
-		state[i] = instruc[i];
-	if (i != 3)
-		state[i] = '\0';
-	if (instruc[i] != ',')
-		return 2;
+	return status;
+}
 
-	instate = atoi(state);
-	if (instate >= max_states)
-		return 3;
-	i++;
+// If there's no STOP command, the machine may run forever and clog up the terminal, so double-check
+// the user wants this. A budget of steps or time stops it anyway, so needn't ask; but there's nobody
+// to ask in a batch, or on stdin once it carries the tape. Returns 1 if the machine shouldn't be run.
+int check_stoppable(struct machine *m, char *fname, struct run_options *opts){
+	for (long i=0; i<(long) m->max_states * m->symbols; i++){
+		if (m->instructions[i].stop) return 0;
+	}
+	if (m->max_steps || m->timeout)
+		return 0;
 
-	// Then we have a 1 or a 0, followed immediately by ->
-	if (instruc[i] == '0' || instruc[i] == '1'){
-		indigit = instruc[i] - '0';
+	if (opts->batch || opts->tape_in){
+		snprintf(m->error, sizeof(m->error), "%s has no STOP command, so needs --max-steps or --timeout to run %s.", fname,
+			opts->batch ? "in a batch" : "on a tape from stdin");
+		return 1;
+	}
 
-		if (instruc[i+1] != '-' || instruc[i+2] != '>')
+	char c;
+	do{
+		printf("WARNING: No STOP command found. Run anyway? (y/n)");
+		if (scanf(" %c", &c) != 1)
 			return 1;
-	} else{
-		return 4;
-	}
-	i += 3;
-
-	// Now the operation, which comes after the "->", and takes the form state,bit,direction(STOP)
-	struct op curr_op;
-	// First, make a char array of just the chars after "->"
-	char opchars[strlen(instruc) - i];
-	for (int j=0; j+i<strlen(instruc); j++)
-		opchars[j] = instruc[j+i];
-
-	// Identify the state
-	for (i=0; i<3 && opchars[i]!=','; i++){
-		state[i] = opchars[i];
-	}
-	for (int j=i; j<3; j++)
-		state[j] = '\0';
-
-	curr_op.state = (char) atoi(state);
-	if (curr_op.state >= max_states)
-		return 5;
-	i++;
-
-	// Check the instruction contains enough characters for the remaining
-	if (strlen(opchars) < i+3)
-		return 6;
-	
-	// The next comma-delimited segment is either a 1 or a 0
-	if (opchars[i]=='0' || opchars[i]=='1'){
-		curr_op.val = opchars[i] == '1';
-	} else{
-		return 7;
+		c = tolower(c);
+	} while (c != 'y' && c != 'n');
+
+	return c == 'n';
+}
+
+/* With - as the tape, it is read from stdin and the final tape written to stdout, each in a single
+ * pass, so that the machine can sit in a pipeline; with --compress, through gzip or zstd run as
+ * filters on either end. The tape is held in memory, or on the sparse tape with --sparse, and
+ * everything else that would have gone to stdout, the log included, goes to stderr instead.
+ */
+
+// Start the compressor cmd as a filter between fd and a pipe, compressing what is written to the
+// stream returned into fd, or decompressing fd into the stream returned. Returns NULL on error.
+FILE *start_filter(char *cmd, bool compress, int fd, pid_t *pid){
+	int p[2];
+	if (pipe(p) != 0)
+		return NULL;
+
+	if ((*pid = fork()) == 0){
+		dup2(compress ? p[0] : fd, STDIN_FILENO);
+		dup2(compress ? fd : p[1], STDOUT_FILENO);
+		close(p[0]);
+		close(p[1]);
+		execlp(cmd, cmd, compress ? "-qc" : "-qdc", (char *) NULL);
+		_exit(127);
 	}
-	if (opchars[i+1] != ',')
-		return 8;
-	i += 2;
 
-	// Then either R or L
-	if (opchars[i] == 'L' || opchars[i] == 'R'){
-		curr_op.dir = opchars[i] == 'R';
-	} else{
-		return 9;
+	// Our end of the pipe is kept from any later child, so that the filter sees it close
+	int end = compress ? p[1] : p[0];
+	close(compress ? p[0] : p[1]);
+	if (*pid < 0){
+		close(end);
+		return NULL;
 	}
-	i += 1;
+	fcntl(end, F_SETFD, FD_CLOEXEC);
+	return fdopen(end, compress ? "wb" : "rb");
+}
 
-	// And finally check if the instruction contains STOP
-	if (opchars[i] == '\n' || opchars[i] == 127 || opchars[i] == '\0' || opchars[i] == EOF){
-		curr_op.stop = false;
-	} else{
-		if (strlen(opchars) < i+3)
-			return 10;
-		if (opchars[i] != 'S' || opchars[i+1] != 'T' || opchars[i+2] != 'O' || opchars[i+3] != 'P')
-			return 11;
+// Wait for a filter to finish, returning 1 if it failed
+int finish_filter(pid_t pid){
+	int wstatus;
+	return waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0;
+}
 
-		curr_op.stop = true;
+// Read the tape from stdin, or from the decompressor it is piped through, which must then have
+// finished cleanly, returning 1 on error
+int read_stream(struct machine *m, struct run_options *opts){
+	if (tm_read_tape(m, opts->tape_in, opts->tape_out))
+		return 1;
+	if (opts->tape_filter){
+		pid_t pid = opts->tape_filter;
+		opts->tape_filter = 0;
+		if (finish_filter(pid)){
+			snprintf(m->error, sizeof(m->error), "Error: %s could not decompress the tape from stdin.", opts->compress);
+			return 1;
+		}
 	}
-
-	// Then store the instruction in instructions
-	instructions[instate][indigit] = curr_op;
-	logprint("Loading operation %d, %d, %c %sto state %d and bit %d.\n", curr_op.state, curr_op.val, (curr_op.dir ? 'R' : 'L'), (curr_op.stop ? ", STOP " : " "), instate, indigit);
-	
 	return 0;
 }
 
-// Try to read and parse the intsruction set text file named by argv[1]
-int load_instrucs(char *fname){
+// Load a table and tape into the machine and run it, returning TM_ERROR on error, TM_STOPPED if it
+// ran out of budget, TM_LOOPING if it was proven never to halt, or TM_HALTED if it halted. Outside
+// a batch, errors are printed here.
+int run_job(struct machine *m, char *instrucs, char *tape, struct run_options *opts){
+	int status = TM_ERROR;
+
+	if (tm_load_table(m, instrucs) == 0 && check_stoppable(m, instrucs, opts) == 0
+			&& (opts->tape_in ? read_stream(m, opts) : tm_load_tape(m, tape)) == 0
+			&& (!opts->resume || tm_resume(m, opts->resume) == 0))
+		status = run(m, tape, opts);
+	if (status == TM_ERROR){
+		if (!opts->batch && m->error[0])
+			printf("%s\n", tm_error(m));
+		return TM_ERROR;
+	}
+	if (opts->strip && tm_strip(m)){
+		if (!opts->batch)
+			printf("%s\n", tm_error(m));
+		return TM_ERROR;
+	}
+
+	return status;
+}
+
+// Run the machine as run_job() does, on the tape from stdin, which is written back to stdout
+int run_streamed(struct machine *m, char *instrucs, struct run_options *opts){
+	pid_t out_filter = 0;
+	char *compress = opts->compress;
+
+	fflush(stdout);
+	int tape_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	if (tape_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0){
+		printf("Error: could not set stdout aside for the tape.\n");
+		return TM_ERROR;
+	}
+
+	opts->tape_in = compress ? start_filter(compress, false, STDIN_FILENO, &opts->tape_filter) : stdin;
+	opts->tape_out = compress ? start_filter(compress, true, tape_fd, &out_filter) : fdopen(tape_fd, "wb");
+	if (compress)
+		close(tape_fd);
+	if (!opts->tape_in || !opts->tape_out){
+		if (compress)
+			printf("Error: could not start %s.\n", compress);
+		else
+			printf("Error: could not open stdout for the tape.\n");
+		return TM_ERROR;
+	}
+	m->strip_stream = opts->strip;
+
+	int status = run_job(m, instrucs, "-", opts);
+
+	// Unless the tape couldn't be read to its end, the decompressor has been waited for already
+	if (opts->tape_in != stdin)
+		fclose(opts->tape_in);
+	if (opts->tape_filter)
+		finish_filter(opts->tape_filter);
+	int error = fclose(opts->tape_out) == EOF;
+	if (out_filter)
+		error |= finish_filter(out_filter);
+	if (error && status != TM_ERROR){
+		printf("Error: could not write the tape to stdout.\n");
+		status = TM_ERROR;
+	}
+
+	return status;
+}
+
+/* In --batch mode, the manifest lists one job to a line, as the instruction table and tape to run
+ * it on, separated by whitespace; blank lines and lines beginning with # are skipped. Each job is
+ * run silently, with the options given on the command line, by a pool of -j threads (one per core
+ * by default). Each thread keeps one machine, reset between its jobs, and takes the jobs in turn
+ * from a shared counter, so that none sits idle while there are jobs left, however unequal their
+ * lengths. Once they have all finished, one summary line is printed for each job, in the order of
+ * the manifest.
+ *
+ * Each job changes its tape in place, as a single run would, so no two jobs should share a tape.
+ */
+struct job{
+	char *instrucs;
+	char *tape;
+	int status;			// As returned by run_job()
+	long steps;
+	int state;
+	long position;
+	bool bit;
+	char *error;		// The message, if the job failed
+};
+
+struct batch{
+	struct machine *options;
+	struct job *jobs;
+	int n_jobs;
+	int next;			// The next job to be taken
+	struct run_options opts;
+};
+
+void *batch_worker(void *arg){
+	struct batch *b = arg;
+	struct machine jm = *b->options;
+	int j;
+
+	while ((j = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n_jobs){
+		struct job *job = &b->jobs[j];
+
+		job->status = run_job(&jm, job->instrucs, job->tape, &b->opts);
+		if (job->status == TM_ERROR){
+			job->error = strdup(tm_error(&jm));
+		} else{
+			job->steps = tm_steps(&jm);
+			job->state = tm_state(&jm);
+			job->position = tm_position(&jm);
+			job->bit = tm_bit(&jm);
+		}
+		tm_reset(&jm);
+	}
+	tm_free(&jm);
+
+	return NULL;
+}
+
+// Read the jobs from the manifest, returning their number or -1 on error
+int load_manifest(char *fname, struct job **jobs){
 	FILE *fp = fopen(fname, "r");
 	if (!fp){
 		printf("Couldn't open file: %s.\n", fname);
-		return 1;
+		return -1;
 	}
 
-	// First line should be "STATES: [number between 1 and 127]"
-	char first[12];
-	if (fgets(first, 12, fp)){
-		if (strncmp("STATES: ", first, 8) != 0){
-			printf("%s should begin \"STATES: [number between 1 and 127]\".\n", fname);
-			fclose(fp);
-			return 1;
+	char line[2*PATH_MAX + 2];
+	char instrucs[PATH_MAX];
+	char tape[PATH_MAX];
+	int n = 0;
+	int cap = 0;
+	int error = 0;
+
+	for (int l=1; !error && fgets(line, sizeof(line), fp); l++){
+		char *c = line;
+		while (isspace(*c))
+			c++;
+		if (*c == '\0' || *c == '#')
+			continue;
+
+		if (sscanf(line, "%4095s %4095s", instrucs, tape) != 2){
+			printf("%s:%d: should give an instruction table and a tape.\n", fname, l);
+			error = 1;
+		} else if (n == cap){
+			cap = cap ? 2 * cap : 64;
+			struct job *grown = realloc(*jobs, cap * sizeof(struct job));
+			if (!grown){
+				printf("Error: out of memory.\n");
+				error = 1;
+			} else{
+				*jobs = grown;
+			}
 		}
 
-		// Check the four characters after STATES: 
-		char states[4];
-		for (int i=8; ; i++){
-			states[i-8] = first[i];
-			if (first[i]=='\0') break;
+		if (!error){
+			(*jobs)[n] = (struct job){strdup(instrucs), strdup(tape), TM_ERROR, 0, 0, 0, 0, NULL};
+			error = !(*jobs)[n].instrucs || !(*jobs)[n].tape;
+			n++;
 		}
+	}
 
-		max_states = (char) atoi(states);
-		if (max_states <= 0){
-			printf("%s should begin \"STATES: [number between 1 and 127]\".\n", fname);
-			fclose(fp);
-			return 1;
+	fclose(fp);
+	if (error){
+		for (int j=0; j<n; j++){
+			free((*jobs)[j].instrucs);
+			free((*jobs)[j].tape);
 		}
-	} else{
-		printf("Error reading file: %s.\n", fname);
-		fclose(fp);
-		return 1;
+		free(*jobs);
+		return -1;
 	}
-	instructions = malloc(sizeof(struct op[max_states][2]));
 
-	// Set all instructions to just go right, to begin with
-	for (int s=0; s<max_states; s++){
-		for (int d=0; d<2; d++){
-			struct op default_op;
-			default_op.state = s;
-			default_op.val = d;
-			default_op.dir = 1;
-			default_op.stop = 0;
-			instructions[s][d] = default_op;
+	return n;
+}
+
+int run_batch(struct machine *options, char *manifest, int threads, struct run_options *opts){
+	struct batch b = {options, NULL, 0, 0, *opts};
+	double start = tm_clock();
+
+	if ((b.n_jobs = load_manifest(manifest, &b.jobs)) < 0)
+		return 1;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (threads > b.n_jobs)
+		threads = b.n_jobs > 0 ? b.n_jobs : 1;
+
+	pthread_t pool[threads];
+	int started = 0;
+	while (started < threads && pthread_create(&pool[started], NULL, batch_worker, &b) == 0)
+		started++;
+	if (started == 0)
+		batch_worker(&b);
+	for (int t=0; t<started; t++)
+		pthread_join(pool[t], NULL);
+
+	int failed = 0;
+	for (int j=0; j<b.n_jobs; j++){
+		struct job *job = &b.jobs[j];
+
+		if (job->status == TM_ERROR){
+			printf("%s %s: error: %s\n", job->instrucs, job->tape, job->error ? job->error : "out of memory");
+			failed++;
+		} else{
+			printf("%s %s: %s after %ld steps, state %d, position %ld, bit %d\n", job->instrucs, job->tape,
+				job->status == TM_STOPPED ? "stopped" : job->status == TM_LOOPING ? "looping" : "halted", job->steps, job->state, job->position, job->bit);
 		}
+		free(job->instrucs);
+		free(job->tape);
+		free(job->error);
 	}
+	free(b.jobs);
 
-	// Then loop through the subsequent lines, which should number max_states * 2
-	char line[20];
-	for (int l=0; l<max_states*2; l++){
-		if (!fgets(line, 20, fp)){
-			break;
-		}
-		int error = parse_instruc(line);
-		if (error){
-			printf("Error parsing instruction: %s\n", line);
-			parse_error(error);
-			fclose(fp);
-			return 1;
+	printf("Ran %d job(s) on %d thread(s) in %.3f seconds, %d failed.\n", b.n_jobs, started ? started : 1, tm_clock() - start, failed);
+	return failed > 0;
+}
+
+/* With --bench, a fixed set of workloads is generated and each is run under every engine and
+ * backend that can run it: the file-backed tape with its cache, the in-memory tape, the mapped
+ * tape, the sparse tape, and the sweep, macro, compiled and block engines on the in-memory tape.
+ * SCALE multiplies the size of those that can be scaled, and the other options are applied to every
+ * run. Each run is made in a process of its own, so that the peak memory reported is its own alone,
+ * and prints one line of JSON with its speed, the tape I/O it took, and whether it ended as it
+ * should have.
+ */
+struct bench_workload{
+	char *name;
+	char *table;
+	long ones;			// The tape is two runs of this many ones, times SCALE, or blank if zero
+	long max_steps;		// The budget, times SCALE, or zero to run until it halts
+	int status;			// How it should end
+	long steps;			// The steps it should take, if known
+	bool binary;		// Whether it has two symbols, as all but the plain and block engines need
+};
+
+struct bench_config{
+	char *name;
+	bool in_memory;
+	bool mapped;
+	bool sparse;
+	enum engine engine;
+	bool undo;			// Whether to keep the undo log, as --break-at does
+	char *options;		// The options to run it with, for --fuzz to report
+};
+
+struct bench_workload bench_workloads[] = {
+	// euclid.txt, on two numbers one apart, which takes the longest to get down to their divisor
+	{"euclid", "STATES: 11\n0,0->0,0,R\n0,1->1,1,L\n1,0->2,1,R\n1,1->1,1,L\n2,0->10,0,R\n2,1->3,0,R\n3,0->4,0,R\n"
+		"3,1->3,1,R\n4,0->4,0,R\n4,1->5,0,R\n5,0->7,0,L\n5,1->6,1,L\n6,0->6,0,L\n6,1->1,1,L\n7,0->7,0,L\n7,1->8,1,L\n"
+		"8,0->9,0,L\n8,1->8,1,L\n9,0->2,0,R\n9,1->1,1,L\n10,0->0,0,RSTOP\n10,1->10,1,R\n",
+		2000, 0, TM_HALTED, 0, true},
+	// Fills the tape leftwards with ones, three cells to every five steps, stepping back as it goes
+	{"left", "STATES: 4\n0,0->1,1,L\n0,1->0,1,L\n1,0->2,1,L\n1,1->1,1,L\n2,0->3,1,R\n2,1->2,1,R\n3,0->0,0,L\n3,1->0,1,L\n",
+		0, 20000000, TM_STOPPED, 0, true},
+	// The five-state busy beaver champion of Marxen and Buntrock
+	{"bb5", "STATES: 5\n0,0->1,1,R\n0,1->2,1,L\n1,0->2,1,R\n1,1->1,1,R\n2,0->3,1,R\n2,1->4,0,L\n3,0->0,1,L\n3,1->3,1,L\n"
+		"4,0->0,1,RSTOP\n4,1->0,0,L\n", 0, 0, TM_HALTED, 47176870, true},
+	// The two-state, four-symbol champion
+	{"bb2x4", "STATES: 2\nSYMBOLS: 4\n0,0->1,1,R\n0,1->0,2,L\n0,2->0,1,R\n0,3->0,1,R\n1,0->1,1,L\n1,1->0,1,L\n1,2->1,3,R\n"
+		"1,3->0,1,RSTOP\n", 0, 0, TM_HALTED, 3932964, false},
+};
+
+struct bench_config bench_configs[] = {
+	{"cached", false, false, false, ENGINE_PLAIN, false, ""},
+	{"memory", true, false, false, ENGINE_PLAIN, false, "-p"},
+	{"mmap", false, true, false, ENGINE_PLAIN, false, "-m"},
+	{"sparse", false, false, true, ENGINE_PLAIN, false, "--sparse"},
+	{"sweep", true, false, false, ENGINE_SWEEP, false, "-p --engine=sweep"},
+	{"macro", true, false, false, ENGINE_MACRO, false, "-p --engine=macro"},
+	{"compiled", true, false, false, ENGINE_COMPILED, false, "-p --compile -s"},
+	{"block", true, false, false, ENGINE_BLOCK, false, "-p --engine=block"},
+	{"undo", true, false, false, ENGINE_PLAIN, true, "--break-at 0"},
+};
+
+// Print s as a JSON string
+void print_json_string(char *s){
+	putchar('"');
+	for (; *s; s++){
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < ' ')
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+// Write the table and a fresh tape for a workload, returning 1 on error
+int bench_files(struct bench_workload *w, char *table, char *tape, int scale){
+	FILE *fp = fopen(table, "w");
+	int error = !fp || fputs(w->table, fp) == EOF;
+	if (fp)
+		error |= fclose(fp) != 0;
+
+	if (!error && (fp = fopen(tape, "w"))){
+		for (int run=0; run<2 && w->ones; run++){
+			for (long i=0; i<w->ones * scale - run; i++)
+				putc('1', fp);
+			if (!run)
+				putc('0', fp);
 		}
+		error |= fclose(fp) != 0;
+	} else{
+		error = 1;
 	}
 
-	// Ignore the rest of the file if there is any
-	if (fgetc(fp) != EOF)
-		logprint("WARNING: Ignoring %s from line %d.\n", fname, max_states*2+2);
+	if (error)
+		printf("Error: could not write the %s workload.\n", w->name);
+	return error;
+}
 
-	fclose(fp);
+// Run a workload under one configuration in a process of its own, returning 1 if it didn't end as
+// it should have
+int bench_run(struct machine *options, struct bench_workload *w, struct bench_config *c, char *table, char *tape, int scale){
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1){
+		printf("Error: could not start the %s run of %s.\n", c->name, w->name);
+		return 1;
+	}
 
-	// If there's no STOP command, the machine may run forever and clog up the terminal. 
-	// Double-check the user wants this
-	bool stoppable = false;
-	for (int s=0; s<max_states; s++){
-		for (int d=0; d<2; d++){
-			if (instructions[s][d].stop) stoppable = true;
+	if (pid == 0){
+		struct machine m = *options;
+		m.in_memory = c->in_memory;
+		m.mapped = c->mapped;
+		m.sparse = c->sparse;
+		m.engine = c->engine;
+		m.undo_steps = c->undo ? UNDO_STEPS : 0;
+		if (!m.max_steps && !m.timeout)
+			m.max_steps = w->max_steps * scale;
+
+		double start = tm_clock();
+		int status = tm_load_table(&m, table) || tm_load_tape(&m, tape) ? TM_ERROR : tm_run(&m);
+		double total = tm_clock() - start;
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		bool ok = status == w->status && (!w->steps || tm_steps(&m) == w->steps);
+
+		double secs = tm_seconds(&m);
+		char *ended[] = {"halted", "error", "stopped", "running", "looping"};
+		printf("{\"workload\": \"%s\", \"engine\": \"%s\", \"scale\": %d, \"status\": \"%s\", \"ok\": %s, ", w->name, c->name,
+			scale, ended[status], ok ? "true" : "false");
+		printf("\"steps\": %ld, \"seconds\": %.6f, \"total_seconds\": %.6f, \"steps_per_sec\": %.0f, ", tm_steps(&m), secs, total,
+			secs > 0 ? tm_steps(&m) / secs : 0);
+		printf("\"block_loads\": %ld, \"block_stores\": %ld, \"bytes_read\": %ld, \"bytes_written\": %ld, \"peak_rss_kb\": %ld",
+			m.io.block_loads, m.io.block_stores, m.io.bytes_read, m.io.bytes_written, usage.ru_maxrss);
+		if (status == TM_ERROR){
+			printf(", \"error\": ");
+			print_json_string(tm_error(&m));
 		}
+		printf("}\n");
+		fflush(stdout);
+		_exit(!ok);
+	}
+
+	int wstatus;
+	if (waitpid(pid, &wstatus, 0) == -1 || !WIFEXITED(wstatus)){
+		printf("{\"workload\": \"%s\", \"engine\": \"%s\", \"scale\": %d, \"status\": \"error\", \"ok\": false, \"error\": \"the run crashed\"}\n",
+			w->name, c->name, scale);
+		return 1;
 	}
+	return WEXITSTATUS(wstatus) != 0;
+}
 
-	if (!stoppable){
-		char c;
-		do{
-			printf("WARNING: No STOP command found. Run anyway? (y/n)");
-			scanf(" %c", &c);
-			c = tolower(c);
-		} while (c != 'y' && c != 'n');
+int run_bench(struct machine *options, int scale){
+	char dir[] = "/tmp/tape-bench-XXXXXX";
+	char table[sizeof(dir) + 16];	// Room for the .tmb cache of the table, too
+	char tape[sizeof(dir) + 16];
+	int failed = 0;
 
-		if (c == 'n')
-			return 1;
+	if (!mkdtemp(dir)){
+		printf("Error: could not make a directory for the benchmarks.\n");
+		return 1;
+	}
+	snprintf(table, sizeof(table), "%s/table.txt", dir);
+	snprintf(tape, sizeof(tape), "%s/tape.txt", dir);
+
+	for (size_t w=0; w<sizeof(bench_workloads) / sizeof(bench_workloads[0]); w++){
+		for (size_t c=0; c<sizeof(bench_configs) / sizeof(bench_configs[0]); c++){
+			struct bench_workload *wl = &bench_workloads[w];
+			if (!wl->binary && bench_configs[c].engine != ENGINE_PLAIN && bench_configs[c].engine != ENGINE_BLOCK)
+				continue;
+			if (bench_files(wl, table, tape, scale)){
+				failed++;
+				break;
+			}
+			failed += bench_run(options, wl, &bench_configs[c], table, tape, scale);
+		}
 	}
 
-	return 0;
+	remove(table);
+	remove(tape);
+	strcat(table, ".tmb");
+	remove(table);
+	rmdir(dir);
+
+	return failed > 0;
 }
 
-/* The following three functions handle the tape and its buffer.
- * read_buf() reads BUFFER_SIZE binary digits into buffer, starting at the given digit
- * write_buf() writes the current contents of the buffer back to the relevant segment of tape
- * load_tape() opens the tape file and sets the global variable tapef to point to it
+/* With --fuzz, random machines are run under every configuration of --bench that can run them, and
+ * each run is checked against the plain engine on the file-backed tape, which the others are meant
+ * to agree with exactly. A case is a table of up to FUZZ_STATES states, of two symbols or now and
+ * then more, written out as text for the parser, and a random tape of up to three blocks, which
+ * each configuration is given a fresh copy of to run for --max-steps steps (FUZZ_STEPS unless
+ * given). Its blocks are 64, 128 or 192 cells, its cache one, two or 16 blocks, and its I/O
+ * asynchronous or not, at random, so that the head crosses blocks, the cache evicts them and the
+ * tape grows to the left often even in short runs. A run agrees if it ends in the same way after
+ * the same steps, in the same state at the same position, and leaves the same tape, but for the
+ * blank cells past its end, which the backends pad the tape with differently.
+ *
+ * Each case's generator is seeded from --seed and the number of the case, so the cases come out the
+ * same however they are shared among the -j threads. A case that diverges is shrunk against the
+ * configuration it diverged under: to the fewest steps it still diverges in, then to as little of
+ * its tape as it still diverges on, a stretch at a time and then a cell at a time, and then with as
+ * many of its instructions made to STOP as can be. What is left is written to fuzz-SEED-CASE.txt
+ * and fuzz-SEED-CASE.tape in the current directory, and reported with the options to run it with.
  */
+#define FUZZ_STATES 6
+#define FUZZ_STEPS 20000
+#define FUZZ_TAPE (3 * 192)
+
+struct fuzz_case{
+	int states;
+	int symbols;
+	struct op ops[FUZZ_STATES * MAX_SYMBOLS];
+	char tape[FUZZ_TAPE + 1];
+	long steps;
+	int buffer_size;
+	int cache_blocks;
+	bool async_io;
+};
 
-int read_buf(int start){
-	extern FILE *tapef;
-	extern int left_added;
-	extern bool buffer[BUFFER_SIZE];
+// How a run ended, and the tape it left, without the blank cells past its end
+struct fuzz_result{
+	int status;
+	int state;
+	long position;
+	long steps;
+	char *tape;
+	char error[256];
+};
+
+struct fuzz{
+	long seed;
+	long cases;
+	long next;				// The next case to be taken
+	long max_steps;
+	char dir[32];
+	pthread_mutex_t lock;	// Covers stdout and the counts below
+	long diverged;
+	bool failed;
+};
 
-	// Take into account that the start of the file might not be start = 0
-	start += BUFFER_SIZE * left_added;
+// Each thread writes its cases to a table and a tape of its own in the directory
+struct fuzz_worker{
+	struct fuzz *f;
+	char table[64];
+	char tape[64];
+};
 
-	// Generate indefinite zeroes to either side of the tape that already exists
-	if (fseek(tapef, start, SEEK_SET) != 0){
-		for (int i=0; i<BUFFER_SIZE; i++)
-			buffer[i] = false;
+uint64_t fuzz_rand(uint64_t *x){
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return *x * 2685821657736338717ull;
+}
 
-		return 0;
+void fuzz_generate(struct fuzz *f, long n, struct fuzz_case *c){
+	uint64_t x = ((uint64_t) f->seed * 1000003 + n) * 0x9e3779b97f4a7c15ull | 1;
+	int sizes[] = {64, 128, 192};
+	int caches[] = {1, 2, 16};
+
+	c->states = 1 + fuzz_rand(&x) % FUZZ_STATES;
+	c->symbols = fuzz_rand(&x) % 4 ? 2 : 3 + fuzz_rand(&x) % (MAX_SYMBOLS - 2);
+	for (int i=0; i<c->states*c->symbols; i++){
+		c->ops[i].state = fuzz_rand(&x) % c->states;
+		c->ops[i].val = fuzz_rand(&x) % c->symbols;
+		c->ops[i].dir = fuzz_rand(&x) % 2;
+		c->ops[i].stop = fuzz_rand(&x) % (4 * c->states * c->symbols) == 0;
 	}
+	c->buffer_size = sizes[fuzz_rand(&x) % 3];
+	c->cache_blocks = caches[fuzz_rand(&x) % 3];
+	c->async_io = fuzz_rand(&x) % 2;
+	c->steps = f->max_steps;
+
+	int len = fuzz_rand(&x) % (3 * c->buffer_size + 1);
+	for (int i=0; i<len; i++)
+		c->tape[i] = "0123456789abcdef"[fuzz_rand(&x) % c->symbols];
+	c->tape[len] = '\0';
+}
 
-	for (int i=0; i<BUFFER_SIZE; i++){
-		char c = fgetc(tapef);
-		if (c == '0'){
-			buffer[i] = false;
-		} else if (c == '1'){
-			buffer [i] = true;
-		} else if (c == EOF){
-			// Pad the buffer with zeroes
-			for (; i<BUFFER_SIZE; i++)
-				buffer[i] = false;
-		} else{
-			printf("Unrecognised character in tape: %c.\n", c);
-			return 1;
-		}
+// Write the case's table and tape to the files given, returning 1 on error
+int fuzz_write(struct fuzz_case *c, char *table, char *tape){
+	char *digits = "0123456789abcdef";
+	FILE *fp = fopen(table, "w");
+	if (!fp)
+		return 1;
+	fprintf(fp, "STATES: %d\n", c->states);
+	if (c->symbols != 2)
+		fprintf(fp, "SYMBOLS: %d\n", c->symbols);
+	for (int i=0; i<c->states*c->symbols; i++){
+		struct op op = c->ops[i];
+		fprintf(fp, "%d,%c->%d,%c,%c%s\n", i / c->symbols, digits[i % c->symbols], op.state, digits[op.val], op.dir ? 'R' : 'L',
+			op.stop ? "STOP" : "");
 	}
+	int error = fclose(fp) != 0;
 
-	return 0;
+	if (!error && (fp = fopen(tape, "w"))){
+		error |= fputs(c->tape, fp) == EOF;
+		error |= fclose(fp) != 0;
+	} else{
+		error = 1;
+	}
+	return error;
 }
 
-int write_buf(int start){
-	extern FILE *tapef;
-	extern int flen;
-	extern int left_added;
-	extern bool buffer[BUFFER_SIZE];
+// Run the case under the configuration given, or the reference for NULL
+void fuzz_run(struct fuzz_worker *w, struct fuzz_case *c, struct bench_config *config, struct fuzz_result *r){
+	struct machine m;
+	tm_init(&m);
+	m.table_cache = false;
+	m.buffer_size = c->buffer_size;
+	m.buffer_words = c->buffer_size / WORD_BITS;
+	m.cache_blocks = c->cache_blocks;
+	m.max_steps = c->steps;
+	if (config){
+		m.in_memory = config->in_memory;
+		m.mapped = config->mapped;
+		m.sparse = config->sparse;
+		m.engine = config->engine;
+		m.undo_steps = config->undo ? UNDO_STEPS : 0;
+		m.async_io = c->async_io;
+	}
 
-	start += BUFFER_SIZE * left_added;
+	*r = (struct fuzz_result){TM_ERROR, 0, 0, 0, NULL, ""};
+	if (fuzz_write(c, w->table, w->tape)){
+		snprintf(r->error, sizeof(r->error), "Error: could not write the case to %s.", w->f->dir);
+		tm_free(&m);
+		return;
+	}
+	r->status = tm_load_table(&m, w->table) || tm_load_tape(&m, w->tape) ? TM_ERROR : tm_run(&m);
+	if (r->status == TM_ERROR){
+		snprintf(r->error, sizeof(r->error), "%s", tm_error(&m));
+		tm_free(&m);
+		return;
+	}
+	r->state = tm_state(&m);
+	r->position = tm_position(&m);
+	r->steps = tm_steps(&m);
+	tm_free(&m);
+
+	FILE *fp = fopen(w->tape, "r");
+	long len = fp && fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+	if (len >= 0 && (r->tape = malloc(len + 1)) && fseek(fp, 0, SEEK_SET) == 0 && (long) fread(r->tape, 1, len, fp) == len){
+		while (len > 0 && r->tape[len-1] == '0')
+			len--;
+		r->tape[len] = '\0';
+	} else{
+		r->status = TM_ERROR;
+		snprintf(r->error, sizeof(r->error), "Error: could not read back the tape in %s.", w->f->dir);
+		free(r->tape);
+		r->tape = NULL;
+	}
+	if (fp)
+		fclose(fp);
+}
 
-	if (fseek(tapef, start, SEEK_SET) != 0){
-		if (start < 0){
-			// The start point is before the file begins, i.e. a new buffer-sized segment has been
-			// added to the left. A real Turing machine would have infinite tape in both directions,
-			// and our limitation is just because we are simulating one using a .txt file that has to
-			// begin somewhere - so we can justifiably 'cheat' by moving the whole file to the right
-			// in a chunk of a size that the machine we are simulating wouldn't be able to process
-			// all at once.
-			char curr_f[flen];
+void fuzz_describe(struct fuzz_result *r, char *s, int size){
+	char *ended[] = {"halted", "failed", "stopped", "ran on", "looped"};
+	snprintf(s, size, "%s after %ld steps in state %d at position %ld", ended[r->status], r->steps, r->state, r->position);
+}
 
-			fseek(tapef, 0, SEEK_SET);
-			for (int i=0; i<flen; i++)
-				curr_f[i] = fgetc(tapef);
+// Run the case under the configuration and the reference, returning 0 if they agree, 1 if they
+// don't, 2 if the configuration failed and -1 if the reference did, with what happened in why
+int fuzz_check(struct fuzz_worker *w, struct fuzz_case *c, struct bench_config *config, char *why, int size){
+	struct fuzz_result ref;
+	struct fuzz_result got;
+	int diverged = 0;
+
+	fuzz_run(w, c, NULL, &ref);
+	if (ref.status == TM_ERROR){
+		snprintf(why, size, "%s", ref.error);
+		return -1;
+	}
+	fuzz_run(w, c, config, &got);
+
+	// The macro engine only checks the budget between visits to groups, so it may overrun it by a
+	// visit, and the reference is then run as far as it went; and it stops on a visit that never
+	// leaves its group, where the reference runs on until the budget is spent
+	if (config->engine == ENGINE_MACRO && ref.status == TM_STOPPED && got.status == TM_LOOPING){
+		free(ref.tape);
+		free(got.tape);
+		return 0;
+	}
+	if (config->engine == ENGINE_MACRO && ref.status == TM_STOPPED && got.status != TM_ERROR && got.steps > ref.steps){
+		struct fuzz_case further = *c;
+		further.steps = got.steps;
+		free(ref.tape);
+		fuzz_run(w, &further, NULL, &ref);
+		if (ref.status == TM_ERROR){
+			snprintf(why, size, "%s", ref.error);
+			free(got.tape);
+			return -1;
+		}
+	}
 
-			// Write the buffer to the beginning, and then append the rest of the tape
-			write_buf(0);
-			for (int i=0; i<flen; i++)
-				fputc(curr_f[i], tapef);
+	if (got.status == TM_ERROR){
+		snprintf(why, size, "it failed: %s", got.error);
+		diverged = 2;
+	} else if (got.status != ref.status || got.steps != ref.steps || got.state != ref.state || got.position != ref.position){
+		char a[128];
+		char b[128];
+		fuzz_describe(&got, a, sizeof(a));
+		fuzz_describe(&ref, b, sizeof(b));
+		snprintf(why, size, "it %s, where the reference %s", a, b);
+		diverged = 1;
+	} else if (strcmp(got.tape, ref.tape) != 0){
+		char a[128];
+		fuzz_describe(&got, a, sizeof(a));
+		snprintf(why, size, "it %s, as the reference did, but left a different tape", a);
+		diverged = 1;
+	}
 
-			// Update a global variable for how many times we have done this, for use in
-			// keeping track of what an overall position of x means as a file position
-			left_added++;
+	free(ref.tape);
+	free(got.tape);
+	return diverged;
+}
 
-			return 0;
-		} else{
-			// Then the problem was that start is beyond where the file ends, so we pad it with zeroes
-			fseek(tapef, 0, SEEK_END);
-			while (ftell(tapef) != start){
-				fputc('0', tapef);
-				fseek(tapef, 0, SEEK_END);
+// Shrink a case that diverges under the configuration as far as it still does, as given above
+void fuzz_shrink(struct fuzz_worker *w, struct fuzz_case *c, struct bench_config *config){
+	char why[512];
+	long lo = 1;
+	long hi = c->steps;
+	while (lo < hi){
+		c->steps = lo + (hi - lo) / 2;
+		if (fuzz_check(w, c, config, why, sizeof(why)) == 1)
+			hi = c->steps;
+		else
+			lo = c->steps + 1;
+	}
+	c->steps = hi;
+
+	char tape[FUZZ_TAPE + 1];
+	int len = strlen(c->tape);
+	for (int chunk=len/2; chunk>0; chunk/=2){
+		for (int i=0; i+chunk<=len; ){
+			memcpy(tape, c->tape, len + 1);
+			memmove(c->tape + i, c->tape + i + chunk, len - i - chunk + 1);
+			if (fuzz_check(w, c, config, why, sizeof(why)) == 1){
+				len -= chunk;
+			} else{
+				memcpy(c->tape, tape, len + 1);
+				i += chunk;
 			}
 		}
 	}
+	for (int i=0; i<len; i++){
+		char cell = c->tape[i];
+		if (cell == '0')
+			continue;
+		c->tape[i] = '0';
+		if (fuzz_check(w, c, config, why, sizeof(why)) != 1)
+			c->tape[i] = cell;
+	}
 
-	for (int i=0; i<BUFFER_SIZE; i++){
-		int error = fputc((buffer[i] ? '1' : '0'), tapef);
-		if (error == EOF){
-			printf("Error writing to tape.\n");
-			return 1;
+	for (int i=0; i<c->states*c->symbols; i++){
+		if (c->ops[i].stop)
+			continue;
+		c->ops[i].stop = 1;
+		if (fuzz_check(w, c, config, why, sizeof(why)) != 1)
+			c->ops[i].stop = 0;
+	}
+}
+
+// Write out a case that diverged, and how, returning 1 on error
+int fuzz_report(struct fuzz *f, long n, struct fuzz_case *c, struct bench_config *config, char *why){
+	char table[64];
+	char tape[64];
+	snprintf(table, sizeof(table), "fuzz-%ld-%ld.txt", f->seed, n);
+	snprintf(tape, sizeof(tape), "fuzz-%ld-%ld.tape", f->seed, n);
+
+	pthread_mutex_lock(&f->lock);
+	int error = fuzz_write(c, table, tape);
+	if (error){
+		printf("Error: could not write case %ld to %s.\n", n, table);
+		f->failed = true;
+	} else{
+		printf("Case %ld diverged under %s, in %s and %s: %s.\n", n, config->name, table, tape, why);
+		printf("  Run it with -b %d -n %d --max-steps %ld%s%s%s, against no options for the reference.\n", c->buffer_size,
+			c->cache_blocks, c->steps, c->async_io && !config->in_memory && !config->mapped && !config->sparse ? " --async-io" : "", *config->options ? " " : "",
+			config->options);
+		f->diverged++;
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&f->lock);
+	return error;
+}
+
+void *fuzz_thread(void *arg){
+	struct fuzz_worker *w = arg;
+	struct fuzz *f = w->f;
+	long n;
+
+	while ((n = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED)) < f->cases && !__atomic_load_n(&f->failed, __ATOMIC_RELAXED)){
+		struct fuzz_case c;
+		fuzz_generate(f, n, &c);
+
+		for (size_t i=0; i<sizeof(bench_configs) / sizeof(bench_configs[0]); i++){
+			struct bench_config *config = &bench_configs[i];
+			if (c.symbols != 2 && config->engine != ENGINE_PLAIN && config->engine != ENGINE_BLOCK)
+				continue;
+			// The reference is just the same run without asynchronous I/O
+			if (strcmp(config->name, "cached") == 0 && !c.async_io)
+				continue;
+
+			char why[512];
+			int diverged = fuzz_check(w, &c, config, why, sizeof(why));
+			if (diverged == -1){
+				pthread_mutex_lock(&f->lock);
+				printf("%s\n", why);
+				f->failed = true;
+				pthread_mutex_unlock(&f->lock);
+			}
+			if (diverged == 1){
+				fuzz_shrink(w, &c, config);
+				fuzz_check(w, &c, config, why, sizeof(why));
+			}
+			if (diverged > 0)
+				fuzz_report(f, n, &c, config, why);
+			if (diverged)
+				break;
 		}
 	}
 
-	return 0;
+	return NULL;
 }
 
-int load_tape(char *fname){
-	extern FILE *tapef;
-	if (!(tapef = fopen(fname, "rb+"))){
-		printf("Error: could not open file: %s.\n", fname);
+int run_fuzz(long cases, long seed, long max_steps, int threads){
+	struct fuzz f = {0};
+	f.seed = seed;
+	f.cases = cases;
+	f.max_steps = max_steps ? max_steps : FUZZ_STEPS;
+	double start = tm_clock();
+
+	strcpy(f.dir, "/tmp/tape-fuzz-XXXXXX");
+	if (!mkdtemp(f.dir)){
+		printf("Error: could not make a directory for the cases.\n");
 		return 1;
 	}
+	pthread_mutex_init(&f.lock, NULL);
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (threads > cases)
+		threads = cases;
+
+	struct fuzz_worker workers[threads];
+	for (int t=0; t<threads; t++){
+		workers[t].f = &f;
+		snprintf(workers[t].table, sizeof(workers[t].table), "%s/table-%d.txt", f.dir, t);
+		snprintf(workers[t].tape, sizeof(workers[t].tape), "%s/tape-%d.txt", f.dir, t);
+	}
 
-	// Get the file's length in bytes, for later
-	extern int flen;
-	fseek(tapef, 0, SEEK_END);
-	flen = ftell(tapef);
+	pthread_t pool[threads];
+	int started = 0;
+	while (started < threads && pthread_create(&pool[started], NULL, fuzz_thread, &workers[started]) == 0)
+		started++;
+	if (started == 0)
+		fuzz_thread(&workers[started++]);
+	else
+		for (int t=0; t<started; t++)
+			pthread_join(pool[t], NULL);
+
+	for (int t=0; t<threads; t++){
+		remove(workers[t].table);
+		remove(workers[t].tape);
+	}
+	rmdir(f.dir);
+	pthread_mutex_destroy(&f.lock);
 
-	if (read_buf(0))
+	if (f.failed)
 		return 1;
+	printf("Ran %ld case(s) of seed %ld under %zu configurations on %d thread(s) in %.3f seconds, and %ld diverged.\n", cases,
+		seed, sizeof(bench_configs) / sizeof(bench_configs[0]), started, tm_clock() - start, f.diverged);
+	return f.diverged > 0;
+}
 
-	return 0;
+/* With --enumerate, every machine of STATES states and two symbols is run from a blank tape, for up
+ * to --max-steps steps each, and the end of each run is written out as a line of
+ *   MACHINE RESULT STEPS MARKS
+ * where MACHINE is the table in the usual compact notation, 1RB1LB_1LA1RZ for instance, with the
+ * transitions of state A, then B, and so on, "---" for one that is never taken and Z for STOP;
+ * RESULT is halt, loop (with --detect-loops) or stop, for a machine still running at the limit; and
+ * MARKS is the number of 1s left on the tape.
+ *
+ * The machines are built in tree normal form. Each starts with none of its transitions chosen, and
+ * runs until it reaches one that hasn't been, which is written out as the STOP of a machine that
+ * halts there; then the search branches on every other choice for that transition and runs each
+ * again from the start. States are numbered in the order they are first entered, so that a
+ * transition may only go to a state already entered or to the next new one, and no two machines
+ * differ by a renaming of their states; and the first transition always moves right, to state B,
+ * since moving left only mirrors a machine and staying in state A runs right forever. Any other
+ * choice that leaves no unchosen transition reachable from state A can never halt, so it is pruned
+ * without being run. Each line stands for every machine that agrees with it on the transitions it
+ * took.
+ *
+ * The search is split by expanding the tree breadth-first until there are ENUM_TASKS machines left
+ * to run, or none. That doesn't depend on the threads or the shard, so every shard of --shard I/N
+ * splits it the same way and takes every Nth of those machines from the Ith, along with the lines
+ * written while splitting for shard 0, and the shards between them cover the search once over as
+ * long as they are run with the same options. The machines are run by a pool of -j threads.
+ */
+#define ENUM_MAX_STATES 16
+#define ENUM_TASKS 4096
+#define ENUM_BUF 65536
+
+struct enum_tally{
+	long machines;		// Run to an end, not counting those that were branched on
+	long halted;
+	long looping;
+	long stopped;
+	long pruned;
+	long max_steps;		// The longest run to halt, and the most marks left by one, with the
+	long max_marks;		// first machine in order of its notation to do either
+	char steps_by[ENUM_MAX_STATES * 7];
+	char marks_by[ENUM_MAX_STATES * 7];
+};
+
+struct enum_search{
+	struct machine *options;
+	int states;
+	FILE *out;				// Where to write the results, or NULL for nowhere
+	pthread_mutex_t lock;	// Covers out, the tally and the error
+	struct op *tasks;
+	int n_tasks;
+	int next;				// The next task to be taken
+	bool failed;
+	char error[256];
+	struct enum_tally tally;
+};
+
+// Each thread runs its machines on one struct machine, reset between them, and keeps its results
+// and its tally to itself until it has a buffer of the one to write out or has finished
+struct enum_worker{
+	struct enum_search *e;
+	struct machine m;
+	bool emit;			// Whether the results are this shard's to write out
+	struct enum_tally tally;
+	char buf[ENUM_BUF];
+	int used;
+};
+
+// A transition that hasn't been chosen is a STOP to a state beyond the last, which tells which it
+// was once the machine halts there. Only those transitions have STOP.
+struct op enum_unchosen(int states, int i){
+	return (struct op){states + i, 1, 1, 1};
 }
 
-void strip_zeroes(char *fname){
-	extern FILE *tapef;
-	fseek(tapef, 0, SEEK_SET);
-
-	// Seek to the first 1
-	while (fgetc(tapef) == '0')
-		;
-	fseek(tapef, -1, SEEK_CUR);
-	int start = ftell(tapef);
-
-	// First identifying where that last 1 is
-	fseek(tapef, 0, SEEK_END);
-	while (fgetc(tapef) != '1')
-		fseek(tapef, -2, SEEK_CUR);
-	int end = ftell(tapef);
-
-	// Then storing everything from the first to the last 1 in an array
-	char maintape[end - start];
-
-	fseek(tapef, start, SEEK_SET);
-	for (int i=0; ftell(tapef) < end; i++)
-		maintape[i] = fgetc(tapef);
-	
-	// Finally clear the tape file, and write the main section to it
-	fclose(tapef);
-	tapef = fopen(fname, "w");
-	for (int i=0; i<end-start; i++)
-		fputc(maintape[i], tapef);
-}
-
-int run(){
-	struct op curr_op;
-	extern bool buffer[BUFFER_SIZE];
-
-	logprint("Execution:\n");
-	logprint("|Machine state | Position | Bit | Instruction\n");
-	logprint("|=================================================\n");
-
-	while (true){		// Print to log
-		logprint("| %-13d| %-9d| %-4d| ", state, buf_pos*BUFFER_SIZE + position, buffer[position]);
-		print_instruc(state, buffer[position]);
-		logprint("\n");
-
-		// Execute the operation
-		curr_op = instructions[state][buffer[position]];
-		state = curr_op.state;
-		buffer[position] = curr_op.val;
-		position += curr_op.dir ? 1 : -1;
-
-		// Manage the position: move the buffer, stop. etc.
-		if (curr_op.stop){
-			logprint("STOP reached.\n");
-			break;
+// Write the table in the compact notation to name, with the transition at halt_at, if any, as STOP
+void enum_name(struct op *ops, int states, int halt_at, char *name){
+	for (int i=0; i<2*states; i++){
+		if (i && i % 2 == 0)
+			*name++ = '_';
+		if (i == halt_at)
+			memcpy(name, "1RZ", 3);
+		else if (ops[i].stop)
+			memcpy(name, "---", 3);
+		else{
+			name[0] = '0' + ops[i].val;
+			name[1] = ops[i].dir ? 'R' : 'L';
+			name[2] = 'A' + ops[i].state;
 		}
+		name += 3;
+	}
+	*name = '\0';
+}
 
-		if (position == BUFFER_SIZE){
-			// Write the current buffer, then load the block one to the right
-			if (write_buf(buf_pos*BUFFER_SIZE))
-				return 1;
-			position = 0;
-			buf_pos++;
-			if (read_buf(buf_pos*BUFFER_SIZE))
-				return 1;
-		} else if (position == -1){
-			// Do the same but to the left
-			if (write_buf(buf_pos*BUFFER_SIZE))
-				return 1;
-			position = BUFFER_SIZE - 1;
-			buf_pos--;
-			if (read_buf(buf_pos*BUFFER_SIZE))
-				return 1;
+void enum_flush(struct enum_worker *w){
+	if (!w->used)
+		return;
+	pthread_mutex_lock(&w->e->lock);
+	if (w->e->out)
+		fwrite(w->buf, 1, w->used, w->e->out);
+	pthread_mutex_unlock(&w->e->lock);
+	w->used = 0;
+}
+
+void enum_record(struct enum_worker *w, struct op *ops, int halt_at, int status, long steps, long marks){
+	if (!w->emit)
+		return;
+
+	struct enum_tally *t = &w->tally;
+	char name[ENUM_MAX_STATES * 7];
+	enum_name(ops, w->e->states, halt_at, name);
+
+	t->machines++;
+	if (status == TM_HALTED){
+		t->halted++;
+		if (steps > t->max_steps || (steps == t->max_steps && strcmp(name, t->steps_by) < 0)){
+			t->max_steps = steps;
+			strcpy(t->steps_by, name);
+		}
+		if (marks > t->max_marks || (marks == t->max_marks && strcmp(name, t->marks_by) < 0)){
+			t->max_marks = marks;
+			strcpy(t->marks_by, name);
 		}
+	} else if (status == TM_LOOPING){
+		t->looping++;
+	} else{
+		t->stopped++;
 	}
 
-	// Finish up
-	if (write_buf(buf_pos*BUFFER_SIZE))
-		return 1;
+	w->used += snprintf(w->buf + w->used, ENUM_BUF - w->used, "%s %s %ld %ld\n", name,
+		status == TM_HALTED ? "halt" : status == TM_LOOPING ? "loop" : "stop", steps, marks);
+	if (w->used > ENUM_BUF - 256)
+		enum_flush(w);
+}
 
-	if (LOG_STREAM){
-		printf("Final state: %d\n", state);
-		printf("Final position: %d\n", buf_pos*BUFFER_SIZE + position);
-		printf("Bit at final position: %d\n", buffer[position]);
+// Run a machine of the search and write out how it ended, returning the index of the unchosen
+// transition it reached, -1 if it reached none, or -2 on error
+int enum_run(struct enum_worker *w, struct op *ops){
+	struct machine *m = &w->m;
+	int states = w->e->states;
+
+	tm_reset(m);
+	int status = tm_set_table(m, ops, states, 2) || tm_load_tape(m, NULL) ? TM_ERROR : tm_step(m, -1);
+	if (status == TM_ERROR){
+		pthread_mutex_lock(&w->e->lock);
+		if (!w->e->failed)
+			snprintf(w->e->error, sizeof(w->e->error), "%s", tm_error(m));
+		w->e->failed = true;
+		pthread_mutex_unlock(&w->e->lock);
+		return -2;
+	}
+
+	int at = status == TM_HALTED ? tm_state(m) - states : -1;
+	enum_record(w, ops, at, status, tm_steps(m), tm_marks(m));
+	return at;
+}
+
+// Whether a machine still has an unchosen transition reachable from state A, without which it can
+// never halt
+bool enum_can_halt(struct op *ops, int states){
+	bool seen[ENUM_MAX_STATES] = {true};
+	int queue[ENUM_MAX_STATES] = {0};
+	int head = 0;
+	int tail = 1;
+
+	while (head < tail){
+		int s = queue[head++];
+		for (int d=0; d<2; d++){
+			struct op o = ops[s*2 + d];
+			if (o.stop)
+				return true;
+			// Only the machine's own states are searched, whatever the table gives
+			if (o.state >= states)
+				continue;
+			if (!seen[o.state]){
+				seen[o.state] = true;
+				queue[tail++] = o.state;
+			}
+		}
+	}
+
+	return false;
+}
+
+// Write to children each machine that makes one more choice for the unchosen transition at, as
+// given above, returning their number, which is at most 4 * states
+int enum_branch(struct enum_worker *w, struct op *ops, int at, struct op *children){
+	int states = w->e->states;
+	int n = 0;
+	int high = 0;
+	bool first = true;
+
+	for (int i=0; i<2*states; i++){
+		if (!ops[i].stop){
+			first = false;
+			high = ops[i].state > high ? ops[i].state : high;
+		}
+	}
+
+	int top = high + 1 < states ? high + 1 : states - 1;
+	for (int s=0; s<=top; s++){
+		for (int val=0; val<2; val++){
+			for (int dir=first; dir<2; dir++){
+				struct op *child = children + n * 2 * states;
+				memcpy(child, ops, sizeof(struct op) * 2 * states);
+				child[at] = (struct op){s, val, dir, 0};
+
+				if ((first && s == 0) || !enum_can_halt(child, states)){
+					w->tally.pruned += w->emit;
+					continue;
+				}
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+// Run a machine and, depth-first, every machine it branches into, returning 1 on error
+int enum_search(struct enum_worker *w, struct op *ops){
+	int states = w->e->states;
+	int at = enum_run(w, ops);
+	if (at < 0)
+		return at == -2;
+
+	struct op children[4 * states * 2 * states];
+	int n = enum_branch(w, ops, at, children);
+	for (int c=0; c<n; c++){
+		if (__atomic_load_n(&w->e->failed, __ATOMIC_RELAXED) || enum_search(w, children + c * 2 * states))
+			return 1;
 	}
 
 	return 0;
 }
 
+void *enum_thread(void *arg){
+	struct enum_worker *w = arg;
+	struct enum_search *e = w->e;
+	int t;
+
+	while ((t = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED)) < e->n_tasks){
+		if (enum_search(w, e->tasks + t * 2 * e->states))
+			break;
+	}
+	enum_flush(w);
+
+	return NULL;
+}
+
+void enum_merge(struct enum_tally *into, struct enum_tally *t){
+	into->machines += t->machines;
+	into->halted += t->halted;
+	into->looping += t->looping;
+	into->stopped += t->stopped;
+	into->pruned += t->pruned;
+	if (t->halted && (t->max_steps > into->max_steps || (t->max_steps == into->max_steps && strcmp(t->steps_by, into->steps_by) < 0))){
+		into->max_steps = t->max_steps;
+		strcpy(into->steps_by, t->steps_by);
+	}
+	if (t->halted && (t->max_marks > into->max_marks || (t->max_marks == into->max_marks && strcmp(t->marks_by, into->marks_by) < 0))){
+		into->max_marks = t->max_marks;
+		strcpy(into->marks_by, t->marks_by);
+	}
+}
+
+int run_enumerate(struct machine *options, int states, int shard, int shards, int threads, FILE *out){
+	struct enum_search e = {0};
+	e.options = options;
+	e.states = states;
+	e.out = out;
+	double start = tm_clock();
+	int width = 2 * states;
+	pthread_mutex_init(&e.lock, NULL);
+
+	// The tree is split from the machine with nothing chosen, on a worker of its own which only
+	// writes out what it finds for shard 0
+	struct enum_worker *split = calloc(1, sizeof(struct enum_worker));
+	int cap = ENUM_TASKS + 4 * states;
+	struct op *queue = malloc(sizeof(struct op) * width * cap);
+	if (!split || !queue){
+		printf("Error: out of memory.\n");
+		free(split);
+		free(queue);
+		return 1;
+	}
+	split->e = &e;
+	split->m = *options;
+	split->emit = shard == 0;
+
+	for (int i=0; i<width; i++)
+		queue[i] = enum_unchosen(states, i);
+	int head = 0;
+	int tail = 1;
+	while (!e.failed && head < tail && tail - head < ENUM_TASKS){
+		struct op node[width];
+		memcpy(node, queue + head++ * width, sizeof(node));
+
+		int at = enum_run(split, node);
+		if (at < 0)
+			continue;
+
+		// Room is made at the front of the queue first, where the machines already run were
+		if (tail + 4 * states > cap){
+			memmove(queue, queue + head * width, sizeof(struct op) * width * (tail - head));
+			tail -= head;
+			head = 0;
+		}
+		tail += enum_branch(split, node, at, queue + tail * width);
+	}
+	enum_flush(split);
+	enum_merge(&e.tally, &split->tally);
+	tm_free(&split->m);
+
+	// This shard's machines are moved down to the front of the queue, in order
+	for (int t=head; t<tail; t++){
+		if ((t - head) % shards == shard)
+			memmove(queue + e.n_tasks++ * width, queue + t * width, sizeof(struct op) * width);
+	}
+	e.tasks = queue;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (threads > e.n_tasks)
+		threads = e.n_tasks > 0 ? e.n_tasks : 1;
+
+	struct enum_worker *workers = calloc(threads, sizeof(struct enum_worker));
+	pthread_t pool[threads];
+	int started = 0;
+	if (e.n_tasks && !e.failed && workers){
+		for (int t=0; t<threads; t++){
+			workers[t].e = &e;
+			workers[t].m = *options;
+			workers[t].emit = true;
+		}
+		while (started < threads && pthread_create(&pool[started], NULL, enum_thread, &workers[started]) == 0)
+			started++;
+		if (started == 0)
+			enum_thread(&workers[started++]);
+		else
+			for (int t=0; t<started; t++)
+				pthread_join(pool[t], NULL);
+	} else if (!workers){
+		e.failed = true;
+		snprintf(e.error, sizeof(e.error), "Error: out of memory.");
+	}
+	for (int t=0; workers && t<started; t++){
+		enum_merge(&e.tally, &workers[t].tally);
+		tm_free(&workers[t].m);
+	}
+	free(workers);
+	free(split);
+	free(queue);
+	pthread_mutex_destroy(&e.lock);
+	if (out)
+		fflush(out);
+
+	if (e.failed){
+		printf("%s\n", e.error);
+		return 1;
+	}
+
+	struct enum_tally *t = &e.tally;
+	printf("Enumerated %ld machine(s) of %d state(s)", t->machines, states);
+	if (shards > 1)
+		printf(", as shard %d of %d,", shard, shards);
+	printf(" in %.3f seconds on %d thread(s): %ld halted, %ld proven never to halt, %ld stopped by --max-steps and %ld pruned.\n",
+		tm_clock() - start, started ? started : 1, t->halted, t->looping, t->stopped, t->pruned);
+	if (t->halted)
+		printf("The longest run to halt took %ld steps, by %s, and the most marks left were %ld, by %s.\n", t->max_steps, t->steps_by, t->max_marks, t->marks_by);
+
+	return 0;
+}
+
+// The count that may follow a mode such as --bench, as argv[2], or def if it is left out, in which
+// case the options start from argv[2] rather than argv[3]
+long optional_count(int argc, char *argv[], long def, int *first){
+	bool given = argc >= 3 && argv[2][0] != '-';
+	*first = given ? 3 : 2;
+	return given ? atol(argv[2]) : def;
+}
+
 int main(int argc, char *argv[]){
+	struct machine machine;
+	struct machine *m = &machine;
+	tm_init(m);
+	m->log_stream = stdout;
+
 	// Parse command-line arguments
-	if (argc <  3){
+	if ((argc == 4 && strcmp(argv[1], "--convert") == 0) || (argc == 3 && strcmp(argv[1], "--decode-trace") == 0)){
+		int error = argc == 4 ? tm_convert(m, argv[2], argv[3]) : tm_decode_trace(m, argv[2]);
+		if (error)
+			printf("%s\n", tm_error(m));
+		tm_free(m);
+		return error;
+	}
+
+	// With --bench, the scale takes the place of the instructions and the tape, and can be left out
+	int first = 3;
+	bool bench = argc >= 2 && strcmp(argv[1], "--bench") == 0;
+	int scale = bench ? optional_count(argc, argv, 1, &first) : 1;
+
+	// and so can the number of cases with --fuzz
+	bool fuzz = argc >= 2 && strcmp(argv[1], "--fuzz") == 0;
+	long cases = fuzz ? optional_count(argc, argv, FUZZ_CASES, &first) : FUZZ_CASES;
+
+	if (argc < 3 && !bench && !fuzz){
 		print_usg();
 		return 1;
 	}
+	if (scale <= 0){
+		printf("Please provide a positive scale after --bench.\n");
+		return 1;
+	}
+	if (cases <= 0){
+		printf("Please provide a positive number of cases after --fuzz.\n");
+		return 1;
+	}
+
+	// With --batch, the manifest takes the place of the instructions and the tape, and with
+	// --enumerate, the number of states does
+	bool batch = strcmp(argv[1], "--batch") == 0;
+	bool enumerate = strcmp(argv[1], "--enumerate") == 0;
+	int threads = 0;
+	int shard = 0;
+	int shards = 1;
+	long seed = 1;
 
 	// Handle any optional args
-	extern FILE *tapef;
-	extern FILE *LOG_STREAM;
-	LOG_STREAM = stdout;
-	bool strip = false;
+	struct run_options opts = {0};
+	bool binary_trace = false;
 
-	for (int a=3; a<argc; a++){
+	for (int a=first; a<argc; a++){
 		if (strcmp(argv[a], "-o") == 0){
 			if (a+1 == argc){
 				printf("Please provide a filename after -o.\n");
 				return 1;
 			}
-			if (!(LOG_STREAM = fopen(argv[a+1], "w"))){
+			if (!(m->log_stream = fopen(argv[a+1], "w"))){
 				printf("Error: could not open file: %s.\n", argv[a+1]);
 				return 1;
 			}
 		} else if (strcmp(argv[a], "-s") == 0){
-			LOG_STREAM = NULL;
+			m->log_stream = NULL;
 		} else if (strcmp(argv[a], "-c") == 0){
-			strip = true;
+			opts.strip = true;
+		} else if (strcmp(argv[a], "-p") == 0){
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "-m") == 0){
+			m->mapped = true;
+		} else if (strcmp(argv[a], "--sparse") == 0){
+			m->sparse = true;
+		} else if (strcmp(argv[a], "--async-io") == 0){
+			m->async_io = true;
+		} else if (strncmp(argv[a], "--engine=", 9) == 0){
+			if (strcmp(argv[a] + 9, "macro") == 0){
+				m->engine = ENGINE_MACRO;
+			} else if (strcmp(argv[a] + 9, "sweep") == 0){
+				m->engine = ENGINE_SWEEP;
+			} else if (strcmp(argv[a] + 9, "block") == 0){
+				m->engine = ENGINE_BLOCK;
+			} else if (strcmp(argv[a] + 9, "plain") == 0){
+				m->engine = ENGINE_PLAIN;
+			} else{
+				printf("Unknown engine: %s.\n", argv[a] + 9);
+				return 1;
+			}
+		} else if (strncmp(argv[a], "--compress=", 11) == 0){
+			if (strcmp(argv[a] + 11, "gzip") != 0 && strcmp(argv[a] + 11, "zstd") != 0){
+				printf("Unknown compressor: %s.\n", argv[a] + 11);
+				return 1;
+			}
+			opts.compress = argv[a] + 11;
+		} else if (strncmp(argv[a], "--trace-format=", 15) == 0){
+			if (strcmp(argv[a] + 15, "binary") == 0){
+				binary_trace = true;
+			} else if (strcmp(argv[a] + 15, "text") == 0){
+				binary_trace = false;
+			} else{
+				printf("Unknown trace format: %s.\n", argv[a] + 15);
+				return 1;
+			}
+		} else if (strcmp(argv[a], "-k") == 0){
+			if (a+1 == argc || (m->macro_k = atoi(argv[++a])) <= 0 || m->macro_k > MACRO_MAX_K || (m->macro_k & (m->macro_k - 1))){
+				printf("Please provide a power of two up to %d after -k.\n", MACRO_MAX_K);
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--summaries") == 0){
+			if (a+1 == argc || (m->summaries = atol(argv[++a])) <= 0 || (m->summaries & (m->summaries - 1))){
+				printf("Please provide a power of two after --summaries.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--max-steps") == 0){
+			if (a+1 == argc || (m->max_steps = atol(argv[++a])) <= 0){
+				printf("Please provide a positive number of steps after --max-steps.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--timeout") == 0){
+			if (a+1 == argc || (m->timeout = atof(argv[++a])) <= 0){
+				printf("Please provide a positive number of seconds after --timeout.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--compile") == 0){
+			m->engine = ENGINE_COMPILED;
+		} else if (strcmp(argv[a], "--detect-loops") == 0){
+			m->detect_loops = true;
+		} else if (strcmp(argv[a], "--no-table-cache") == 0){
+			m->table_cache = false;
+		} else if (strcmp(argv[a], "--stats") == 0 || strcmp(argv[a], "--stats=text") == 0){
+			opts.stats = STATS_TEXT;
+			m->count_stats = true;
+		} else if (strcmp(argv[a], "--stats=json") == 0){
+			opts.stats = STATS_JSON;
+			m->count_stats = true;
+		} else if (strcmp(argv[a], "--checkpoint-every") == 0){
+			if (a+1 == argc || (opts.checkpoint_every = atol(argv[++a])) <= 0){
+				printf("Please provide a positive number of steps after --checkpoint-every.\n");
+				return 1;
+			}
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "--break-at") == 0){
+			char *end;
+			if (a+1 == argc || (opts.break_at = strtol(argv[++a], &end, 10)) < 0 || *end || end == argv[a]){
+				printf("Please provide a step that isn't negative after --break-at.\n");
+				return 1;
+			}
+			opts.debug = true;
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "--view") == 0){
+			opts.view = true;
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "--view-cells") == 0){
+			if (a+1 == argc || (opts.view_cells = atol(argv[++a])) <= 0 || opts.view_cells > 4096){
+				printf("Please provide a number of cells from 1 to 4096 after --view-cells.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--fps") == 0){
+			if (a+1 == argc || (opts.fps = atof(argv[++a])) <= 0){
+				printf("Please provide a positive number of frames a second after --fps.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--diagram") == 0){
+			char *ext = a+1 < argc ? strrchr(argv[a+1], '.') : NULL;
+			if (!ext || (strcmp(ext, ".png") != 0 && strcmp(ext, ".pbm") != 0)){
+				printf("Please provide an image ending in .png or .pbm after --diagram.\n");
+				return 1;
+			}
+			opts.diagram = argv[++a];
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "--every") == 0){
+			if (a+1 == argc || (opts.every = atol(argv[++a])) <= 0){
+				printf("Please provide a positive number of steps after --every.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--undo-steps") == 0){
+			if (a+1 == argc || (m->undo_steps = atol(argv[++a])) <= 0 || (m->undo_steps & (m->undo_steps - 1))){
+				printf("Please provide a power of two after --undo-steps.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--snapshot-every") == 0){
+			if (a+1 == argc || (opts.snapshot_every = atol(argv[++a])) <= 0){
+				printf("Please provide a positive number of steps after --snapshot-every.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--resume") == 0){
+			if (a+1 == argc){
+				printf("Please provide a checkpoint after --resume.\n");
+				return 1;
+			}
+			opts.resume = argv[++a];
+			m->in_memory = true;
+		} else if (strcmp(argv[a], "-b") == 0){
+			if (a+1 == argc || (m->buffer_size = atoi(argv[++a])) <= 0 || m->buffer_size % WORD_BITS != 0){
+				printf("Please provide a positive multiple of %d after -b.\n", WORD_BITS);
+				return 1;
+			}
+			m->buffer_words = m->buffer_size / WORD_BITS;
+		} else if (strcmp(argv[a], "-n") == 0){
+			if (a+1 == argc || (m->cache_blocks = atoi(argv[++a])) <= 0){
+				printf("Please provide a positive number of blocks after -n.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "-j") == 0){
+			if (a+1 == argc || (threads = atoi(argv[++a])) <= 0){
+				printf("Please provide a positive number of threads after -j.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--shard") == 0){
+			if (a+1 == argc || sscanf(argv[++a], "%d/%d", &shard, &shards) != 2 || shards <= 0 || shard < 0 || shard >= shards){
+				printf("Please provide a shard I/N after --shard, with I from 0 to N-1.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[a], "--seed") == 0){
+			char *end;
+			if (a+1 == argc || (seed = strtol(argv[++a], &end, 10)) < 0 || *end || end == argv[a]){
+				printf("Please provide a seed that isn't negative after --seed.\n");
+				return 1;
+			}
 		}
 	}
 
-	// Parse the necessary args only after the log stream has been set
-	if (load_instrucs(argv[1]) == 1){
+	// A tape given as - is streamed, and only then is there a stream to compress
+	bool streamed = !batch && !enumerate && !bench && !fuzz && strcmp(argv[2], "-") == 0;
+	if (opts.compress && !streamed){
+		printf("Only a tape streamed through stdin and stdout is compressed, so --compress needs - as the tape.\n");
+		return 1;
+	}
+	if (streamed && (opts.checkpoint_every || opts.resume)){
+		printf("A tape from stdin has no file to keep a checkpoint beside, so --checkpoint-every and --resume\ncan't be used with - as the tape.\n");
 		return 1;
 	}
 
-	if (load_tape(argv[2]) == 1){
+	// The debugger takes its commands from stdin, and its snapshots of the in-memory tape
+	if (opts.debug){
+		if (batch || enumerate || bench || fuzz || streamed){
+			printf("The debugger reads its commands from stdin, so --break-at can only be used to run a single\nmachine on a tape file.\n");
+			return 1;
+		}
+		if (opts.checkpoint_every || m->sparse || m->timeout){
+			printf("The debugger takes the tape back and forth in memory, at its own pace, so --checkpoint-every,\n--sparse and --timeout can't be used with --break-at.\n");
+			return 1;
+		}
+		if (!m->undo_steps)
+			m->undo_steps = UNDO_STEPS;
+		if (!opts.snapshot_every)
+			opts.snapshot_every = SNAPSHOT_EVERY;
+	} else if (m->undo_steps || opts.snapshot_every){
+		printf("Steps are only undone in the debugger, so --undo-steps and --snapshot-every need --break-at.\n");
 		return 1;
 	}
 
-	// Run the machine
-	if (run())
+	// The view is drawn on stdout, from the in-memory tape, so the log has to go elsewhere
+	if (opts.view){
+		if (batch || enumerate || bench || fuzz || streamed || opts.debug || opts.checkpoint_every || m->sparse){
+			printf("The view is drawn for a single machine, on the terminal from a tape file held in memory, so\n"
+				"--view can't be used with -, --sparse, --break-at or --checkpoint-every.\n");
+			return 1;
+		}
+		if (m->log_stream == stdout){
+			printf("The view takes the place of the log on stdout, so please give -s or -o with --view.\n");
+			return 1;
+		}
+		if (!opts.view_cells)
+			opts.view_cells = VIEW_CELLS;
+		if (!opts.fps)
+			opts.fps = VIEW_FPS;
+	} else if (opts.view_cells || opts.fps){
+		printf("--view-cells and --fps are only used to draw the tape, so they need --view.\n");
+		return 1;
+	}
+
+	// The diagram is sampled from the in-memory tape between steps, as the view is drawn
+	if (opts.diagram){
+		if (batch || enumerate || bench || fuzz || opts.debug || opts.view || opts.checkpoint_every || m->sparse){
+			printf("The diagram is drawn of a single run, from a tape held in memory, so --diagram can't be used\n"
+				"with --sparse, --break-at, --view or --checkpoint-every.\n");
+			return 1;
+		}
+		if (!opts.every)
+			opts.every = 1;
+	} else if (opts.every){
+		printf("--every gives the steps between the rows of a diagram, so it needs --diagram.\n");
 		return 1;
-	if (strip)
-		strip_zeroes(argv[2]);
+	}
+	opts.threads = threads;
 
-	free(instructions);
-	fclose(tapef);
-	if (LOG_STREAM != stdout)
-		fclose(LOG_STREAM);
+	if (m->sparse && (opts.checkpoint_every || opts.resume)){
+		printf("Checkpoints are only taken of the in-memory tape, so --sparse can't be used with --checkpoint-every\nor --resume.\n");
+		return 1;
+	}
 
-	return 0;
-}
\ No newline at end of file
+	// The jobs of a batch are run silently, and only summed up once they are all done
+	if (batch){
+		if (m->log_stream && m->log_stream != stdout){
+			printf("The jobs of a batch aren't logged, so -o can't be used with --batch.\n");
+			return 1;
+		}
+		if (opts.resume){
+			printf("Each job of a batch has its own checkpoint, so --resume can't be used with --batch.\n");
+			return 1;
+		}
+		if (opts.stats){
+			printf("The jobs of a batch are only summed up, so --stats can't be used with --batch.\n");
+			return 1;
+		}
+		m->log_stream = NULL;
+		opts.batch = true;
+		return run_batch(m, argv[2], threads, &opts);
+	}
+
+	// The results of a search are written to the -o file in place of the log, or to stdout
+	if (enumerate){
+		int states = atoi(argv[2]);
+		if (states < 1 || states > ENUM_MAX_STATES){
+			printf("Please provide a number of states from 1 to %d after --enumerate.\n", ENUM_MAX_STATES);
+			return 1;
+		}
+		if (!m->max_steps || m->timeout){
+			printf("Each machine of a search must be limited by --max-steps, and only by that, so that\nevery shard splits it the same way.\n");
+			return 1;
+		}
+		if (opts.checkpoint_every || opts.resume || opts.stats || binary_trace){
+			printf("The machines of a search are only written out as results, so --checkpoint-every, --resume,\n--stats and --trace-format can't be used with --enumerate.\n");
+			return 1;
+		}
+		if (m->engine == ENGINE_COMPILED){
+			printf("The machines of a search are too many and too short-lived to compile each one, so --compile\ncan't be used with --enumerate.\n");
+			return 1;
+		}
+		FILE *out = m->log_stream;
+		m->log_stream = NULL;
+		int status = run_enumerate(m, states, shard, shards, threads, out);
+		if (out && out != stdout)
+			fclose(out);
+		return status;
+	}
+
+	// The benchmarks print their results as JSON, so nothing else is printed to stdout
+	if (bench){
+		if (m->log_stream && m->log_stream != stdout){
+			printf("The benchmarks aren't logged, so -o can't be used with --bench.\n");
+			return 1;
+		}
+		if (opts.checkpoint_every || opts.resume){
+			printf("The benchmarks aren't checkpointed, so --checkpoint-every and --resume can't be used with --bench.\n");
+			return 1;
+		}
+		m->log_stream = NULL;
+		return run_bench(m, scale);
+	}
+
+	// The cases choose their own blocks, cache and configurations, and only the divergent are reported
+	if (fuzz){
+		if (m->log_stream && m->log_stream != stdout){
+			printf("The cases aren't logged, so -o can't be used with --fuzz.\n");
+			return 1;
+		}
+		if (m->timeout){
+			printf("Each case must be limited by --max-steps, and only by that, so that it runs the same every time.\n");
+			return 1;
+		}
+		if (opts.checkpoint_every || opts.resume || opts.stats || binary_trace){
+			printf("The cases are only checked against each other, so --checkpoint-every, --resume, --stats and\n--trace-format can't be used with --fuzz.\n");
+			return 1;
+		}
+		return run_fuzz(cases, seed, m->max_steps, threads);
+	}
+
+	// A binary trace takes the place of the log file, so nothing else is logged there
+	if (binary_trace){
+		if (!m->log_stream || m->log_stream == stdout){
+			printf("Please provide a file with -o for a binary trace.\n");
+			return 1;
+		}
+		if (m->engine == ENGINE_MACRO || m->engine == ENGINE_COMPILED || m->engine == ENGINE_BLOCK){
+			printf("The %s engine can't write a binary trace.\n", m->engine == ENGINE_MACRO ? "macro" : m->engine == ENGINE_BLOCK ? "block" : "compiled");
+			return 1;
+		}
+		m->trace_stream = m->log_stream;
+		m->log_stream = NULL;
+	}
+
+	// The compiled code only steps, with nothing to log each step with
+	if (m->engine == ENGINE_COMPILED && m->log_stream){
+		printf("The compiled engine runs silently, so please give -s with --compile.\n");
+		return 1;
+	}
+
+	// Parse the necessary args only after the log stream has been set, and run the machine
+	int status = streamed ? run_streamed(m, argv[1], &opts) : run_job(m, argv[1], argv[2], &opts);
+
+	if (m->log_stream && m->log_stream != stdout)
+		fclose(m->log_stream);
+	if (m->trace_stream)
+		fclose(m->trace_stream);
+	tm_free(m);
+
+	return status;
+}